@@ -0,0 +1,45 @@
+#!/bin/bash
+# Chronos profile-guided builds of the benchmarks
+# Each program is built with --profile-generate, run once to write its
+# profile, then rebuilt with --profile-use. Both builds must print the same
+# output and exit with the same status.
+
+set -e
+
+GREEN='\033[0;32m'
+RED='\033[0;31m'
+NC='\033[0m' # No Color
+
+COMPILER=../compiler/bootstrap-c/chronos_v10
+command -v nasm >/dev/null 2>&1 || { echo "nasm not found!"; exit 1; }
+[ -x "$COMPILER" ] || { echo "Build the compiler first: gcc chronos_v10.c -o chronos_v10"; exit 1; }
+
+echo "========================================"
+echo "CHRONOS PGO BENCHMARKS"
+echo "========================================"
+
+failed=0
+for src in *.ch; do
+    name=${src%.ch}
+    rm -f "$name.pgo"
+
+    $COMPILER --profile-generate="$name.pgo" "$src" >/dev/null
+    status=0
+    ./chronos_program > "${name}_train.txt" || status=$?
+
+    $COMPILER --profile-use="$name.pgo" "$src" >/dev/null
+    start=$(date +%s%N)
+    pgo_status=0
+    ./chronos_program > "${name}_pgo.txt" || pgo_status=$?
+    end=$(date +%s%N)
+
+    if [ $status -eq $pgo_status ] && cmp -s "${name}_train.txt" "${name}_pgo.txt"; then
+        echo -e "${GREEN}✓${NC} $name: $((($end - $start) / 1000)) µs with profile"
+    else
+        echo -e "${RED}✗${NC} $name: output differs with the profile"
+        failed=1
+    fi
+    rm -f "${name}_train.txt" "${name}_pgo.txt"
+done
+
+exit $failed
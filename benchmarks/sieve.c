@@ -3,7 +3,7 @@
 
 int main() {
     int n = 1000;
-    int primes[1000];
+    unsigned char primes[1000];
     int count = 0;
 
     // Initialize
@@ -8,24 +8,39 @@
 #include <string.h>
 #include <stdarg.h>
 #include <ctype.h>
+#include <limits.h>
 
 // TOKENS
 typedef enum {
     T_EOF, T_IDENT, T_NUM, T_STR,
-    T_FN, T_LET, T_IF, T_ELSE, T_WHILE, T_FOR, T_RET, T_STRUCT,
+    T_FN, T_LET, T_IF, T_ELSE, T_WHILE, T_FOR, T_BREAK, T_CONTINUE, T_RET, T_STRUCT, T_CONST, T_STATIC, T_MATCH,
     T_LPAREN, T_RPAREN, T_LBRACE, T_RBRACE, T_LBRACKET, T_RBRACKET,
-    T_SEMI, T_COLON, T_COMMA, T_DOT, T_AMP,
-    T_PLUS, T_MINUS, T_STAR, T_SLASH,
-    T_EQ, T_EQEQ, T_NEQ, T_LT, T_GT, T_LTE, T_GTE, T_ARROW
+    T_SEMI, T_COLON, T_COMMA, T_DOT, T_DOTDOT, T_DOTDOTEQ, T_AMP,
+    T_PLUS, T_MINUS, T_STAR, T_SLASH, T_PERCENT, T_PIPE, T_AT,
+    T_EQ, T_EQEQ, T_NEQ, T_LT, T_GT, T_LTE, T_GTE, T_ARROW, T_FATARROW
 } TokType;
 
-typedef struct { TokType t; char* s; int len; } Tok;
+typedef struct { TokType t; char* s; int len; int line; } Tok;
 typedef struct { char* src; char* cur; } Lex;
 
 // TYPE SYSTEM
+typedef enum { TY_INT, TY_PTR, TY_ARRAY, TY_STRUCT, TY_STR } TypeKind;
+
+typedef struct Type {
+    TypeKind kind;
+    int size;                // TY_INT: 1, 2, 4 or 8 bytes
+    int is_unsigned;         // TY_INT: u8 .. u64
+    struct Type* base;       // Pointee or element type
+    int length;              // TY_ARRAY element count
+    char* name;              // TY_STRUCT name
+    struct StructType* st;   // TY_STRUCT layout, bound by the type checker
+} Type;
+
 typedef struct StructField {
     char* name;
+    Type* ty;
     int offset;
+    int align_attr;          // @align(N) on the field, 0 if none
 } StructField;
 
 typedef struct StructType {
@@ -33,6 +48,12 @@ typedef struct StructType {
     StructField* fields;
     int field_count;
     int size;
+    int align;
+    int layout;              // 0 = pending, 1 = in progress, 2 = done
+    int packed;              // @packed: no padding, byte aligned
+    int reorder;             // @reorder: fields sorted by alignment first
+    int align_attr;          // @align(N), 0 if none
+    int soa;                 // @soa: arrays of it store each field contiguously
 } StructType;
 
 typedef struct TypeTable {
@@ -46,7 +67,8 @@ typedef enum {
     AST_IF, AST_WHILE, AST_CALL, AST_IDENT, AST_NUMBER,
     AST_BINOP, AST_COMPARE, AST_STRING, AST_ASSIGN,
     AST_ARRAY_LITERAL, AST_INDEX, AST_STRUCT_DEF, AST_STRUCT_LITERAL, AST_FIELD_ACCESS,
-    AST_UNARY, AST_DEREF, AST_ADDR_OF
+    AST_UNARY, AST_DEREF, AST_ADDR_OF, AST_STORE, AST_VECTOR_LOOP, AST_INLINE, AST_GLOBAL,
+    AST_MATCH, AST_MATCH_ARM, AST_RANGE, AST_FOR, AST_BREAK, AST_CONTINUE
 } AstType;
 
 typedef struct AstNode {
@@ -60,15 +82,26 @@ typedef struct AstNode {
     int array_size;
     char* struct_type;
     int is_pointer;  // For type tracking
+    int is_global;   // IDENT / ASSIGN naming a global variable (set by the type checker)
+    Type* ty;        // Declared type (let, param, fn return) or inferred type (expressions)
+    struct Attribute* attrs;
+    int attr_count;
+    int line;        // Source line of a loop, for reports
+    int prof;        // First profile counter of a function or if, plus one (0: none)
 } AstNode;
 
+// Annotation preceding a declaration: @name or @name(expr)
+typedef struct Attribute {
+    char* name;
+    AstNode* arg;
+} Attribute;
+
 // Symbol table
 typedef struct {
     char* name;
     int offset;
-    int size;
-    char* type_name;
-    int is_pointer;
+    Type* ty;
+    char* label;     // Data label of a global, NULL for a frame slot
 } Symbol;
 
 typedef struct {
@@ -89,13 +122,73 @@ typedef struct {
     int count;
 } StringTable;
 
-typedef struct { Tok* tokens; int pos, count; } Parser;
+// Command-line options
+typedef enum { VEC_AUTO, VEC_SSE2, VEC_AVX2 } VecIsa;
+typedef enum { ARCH_SKYLAKE, ARCH_ZEN2 } Microarch;
+
+typedef struct {
+    int opt_level;       // -O0 / -O1
+    int vectorize;       // Cleared by -fno-vectorize
+    VecIsa vec_isa;      // -msse2 / -mavx2 pin one kernel; auto emits both
+    int dump_layout;     // -fdump-layout: print struct layouts
+    int loop_report;     // -floop-report: write output.loops.json
+    int unroll;          // -funroll: unroll small innermost loops
+    int dead_report;     // -fdead-report: list the functions and helpers dropped
+    int purity_report;   // -fpurity-report: print each function's inferred effects
+    char* profile_generate;  // --profile-generate: file the program adds its counts to
+    char* profile_use;       // --profile-use: file to lay out branches and functions by
+    Microarch tune;      // -mtune=skylake|zen2: cycle costs of the WCET analysis
+    int wcet_report;     // -fwcet-report: print and write output.wcet.json
+    int stack_report;    // -fstack-report: print and write output.stack.json
+    int bound_check;     // -fbound-check (and -O0): stop a loop that runs past its @bound
+} Options;
+
+// Counters of --profile-generate, numbered the same way for --profile-use
+typedef struct {
+    int count;
+    unsigned int checksum;  // Of the numbered program, to reject a stale profile
+    long* counts;           // Loaded by --profile-use, NULL without a usable profile
+} Profile;
+
+typedef struct {
+    Tok* tokens;
+    int pos, count;
+    int no_struct;       // In a for range: `n {` opens the body, not a struct literal
+} Parser;
+// A loop of the generated code, for the WCET analysis
+typedef struct {
+    int label;           // .L label at its top (and one for its test)
+    long bound;          // Most iterations, -1 if unknown
+    int line;            // Source line, 0 for loops the compiler makes, -1 for tail recursion
+} LoopBound;
+
 typedef struct {
     FILE* out;
+    Options* opts;
+    int uses_cpu_check;  // Emitted a kernel dispatched on __has_avx2
     int label_count;
+    int inline_exit;     // Label `return` jumps to inside an inlined body, -1 outside
+    AstNode* prog;
+    AstNode* func;       // Function being generated
+    Type* ret_ty;        // Return type of the function or inlined body being generated
+    int tail_label;      // Entry of its body, target of self tail calls
+    int break_label;     // Targets of break / continue in the innermost loop, -1 outside
+    int continue_label;
+    int frameless;       // Leaf without locals: no rbp frame to tear down
+    int realign;         // Locals need more than 16-byte alignment: rbp is realigned
+    int pushes;          // Values pushed by expression code and not yet popped
+    struct NameSet* externs;  // Functions called but not defined here
+    char* newline;       // String table label of "\n" for println
     SymbolTable* symtab;
+    SymbolTable* globals;  // Top-level variables, addressed by label
     StringTable* strtab;
     TypeTable* types;
+    Profile* profile;
+    char* cold;          // Less likely blocks of the function, emitted after its ret
+    char* unlikely;      // Its rare blocks, emitted in .text.unlikely
+    int in_unlikely;     // Generating a cold function or block, placed in .text.unlikely
+    LoopBound* loops;    // Every loop emitted so far
+    int loop_count;
     char* code_buf;
     int code_len;
     int code_cap;
@@ -119,21 +212,30 @@ StructType* typetab_lookup(TypeTable* tt, char* name) {
 void typetab_add(TypeTable* tt, char* name) {
     tt->count++;
     tt->types = realloc(tt->types, sizeof(StructType) * tt->count);
+    memset(&tt->types[tt->count - 1], 0, sizeof(StructType));
     tt->types[tt->count - 1].name = strdup(name);
-    tt->types[tt->count - 1].fields = NULL;
-    tt->types[tt->count - 1].field_count = 0;
-    tt->types[tt->count - 1].size = 0;
+    tt->types[tt->count - 1].align = 1;
 }
 
-void typetab_add_field(TypeTable* tt, char* struct_name, char* field_name) {
+// Fields are laid out by typetab_layout once every struct is known
+void typetab_add_field(TypeTable* tt, char* struct_name, char* field_name, Type* ty) {
     StructType* st = typetab_lookup(tt, struct_name);
     if (!st) return;
 
     st->field_count++;
     st->fields = realloc(st->fields, sizeof(StructField) * st->field_count);
     st->fields[st->field_count - 1].name = strdup(field_name);
-    st->fields[st->field_count - 1].offset = st->size;
-    st->size += 8;
+    st->fields[st->field_count - 1].ty = ty;
+    st->fields[st->field_count - 1].offset = 0;
+}
+
+StructField* typetab_field(TypeTable* tt, char* struct_name, char* field_name) {
+    StructType* st = typetab_lookup(tt, struct_name);
+    if (!st) return NULL;
+    for (int i = 0; i < st->field_count; i++) {
+        if (!strcmp(st->fields[i].name, field_name)) return &st->fields[i];
+    }
+    return NULL;
 }
 
 int typetab_field_offset(TypeTable* tt, char* struct_name, char* field_name) {
@@ -148,6 +250,223 @@ int typetab_field_offset(TypeTable* tt, char* struct_name, char* field_name) {
     return -1;
 }
 
+// ==== TYPES ====
+Type* type_new(TypeKind kind, int size) {
+    Type* t = calloc(1, sizeof(Type));
+    t->kind = kind;
+    t->size = size;
+    return t;
+}
+
+Type* type_int(int size) { return type_new(TY_INT, size); }
+
+Type* type_uint(int size) {
+    Type* t = type_new(TY_INT, size);
+    t->is_unsigned = 1;
+    return t;
+}
+
+Type* type_ptr(Type* base) {
+    Type* t = type_new(TY_PTR, 8);
+    t->base = base;
+    return t;
+}
+
+Type* type_array(Type* base, int length) {
+    Type* t = type_new(TY_ARRAY, 0);
+    t->base = base;
+    t->length = length;
+    return t;
+}
+
+Type* type_struct(char* name) {
+    Type* t = type_new(TY_STRUCT, 0);
+    t->name = name;
+    return t;
+}
+
+int type_is_soa(Type* t) {
+    return t && t->kind == TY_STRUCT && t->st && t->st->soa;
+}
+
+int type_size(Type* t);
+int type_align(Type* t);
+
+// An array of a @soa struct holds one array per field, each aligned for its
+// type. Returns where field `f`'s array starts, or the total size for NULL.
+int soa_field_offset(StructType* st, StructField* f, int length) {
+    int off = 0;
+    for (int i = 0; i < st->field_count; i++) {
+        StructField* g = &st->fields[i];
+        int align = type_align(g->ty);
+        off = (off + align - 1) / align * align;
+        if (g == f) return off;
+        off += type_size(g->ty) * length;
+    }
+    return (off + st->align - 1) / st->align * st->align;
+}
+
+int type_size(Type* t) {
+    if (!t) return 8;
+    if (t->kind == TY_ARRAY && type_is_soa(t->base)) return soa_field_offset(t->base->st, NULL, t->length);
+    if (t->kind == TY_ARRAY) return type_size(t->base) * t->length;
+    if (t->kind == TY_STRUCT) return t->st ? t->st->size : 8;
+    return t->size;
+}
+
+int type_align(Type* t) {
+    if (!t) return 8;
+    if (t->kind == TY_ARRAY) return type_align(t->base);
+    if (t->kind == TY_STRUCT) return t->st ? t->st->align : 8;
+    return t->size;
+}
+
+// Values of at most 32 bits live in eax; everything else uses all of rax.
+// Narrower integers are kept sign- or zero-extended to 32 bits there.
+int type_is_narrow(Type* t) {
+    return t && t->kind == TY_INT && t->size <= 4;
+}
+
+int type_is_unsigned(Type* t) {
+    return t && t->kind == TY_INT && t->is_unsigned;
+}
+
+// Type arithmetic and comparisons are done in: operands narrower than 32
+// bits promote to i32, then the wider operand wins, unsigned at equal width.
+// Pointer arithmetic keeps the pointer type.
+Type* type_arith(Type* l, Type* r) {
+    if (l->kind != TY_INT) return l;
+    if (r->kind != TY_INT) return r;
+    int size = l->size > r->size ? l->size : r->size;
+    if (size < 4) return type_int(4);
+    int is_unsigned = (l->size == size && l->is_unsigned) || (r->size == size && r->is_unsigned);
+    return is_unsigned ? type_uint(size) : type_int(size);
+}
+
+// Arrays and structs evaluate to their address
+int type_is_aggregate(Type* t) {
+    return t && (t->kind == TY_ARRAY || t->kind == TY_STRUCT);
+}
+
+int type_equal(Type* a, Type* b) {
+    if (!a || !b) return a == b;
+    if (a->kind != b->kind) return 0;
+    if (a->kind == TY_INT) return a->size == b->size && a->is_unsigned == b->is_unsigned;
+    if (a->kind == TY_STRUCT) return !strcmp(a->name, b->name);
+    if (a->kind == TY_ARRAY && a->length != b->length) return 0;
+    return a->kind == TY_STR || type_equal(a->base, b->base);
+}
+
+char* type_name(Type* t) {
+    static char buf[4][64];
+    static int slot;
+    char* out = buf[slot++ & 3];
+    if (!t) return "?";
+    if (t->kind == TY_INT) sprintf(out, "%c%d", t->is_unsigned ? 'u' : 'i', t->size * 8);
+    else if (t->kind == TY_STR) sprintf(out, "str");
+    else if (t->kind == TY_STRUCT) snprintf(out, 64, "%s", t->name);
+    else if (t->kind == TY_PTR) snprintf(out, 64, "*%s", type_name(t->base));
+    else snprintf(out, 64, "[%s; %d]", type_name(t->base), t->length);
+    return out;
+}
+
+void type_error(const char* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    fprintf(stderr, "Type error: ");
+    vfprintf(stderr, fmt, args);
+    fprintf(stderr, "\n");
+    va_end(args);
+    exit(1);
+}
+
+// Bind struct names to their layouts (and lay those out) throughout a type
+void type_resolve(TypeTable* tt, Type* t);
+
+static int field_align(StructType* st, StructField* f) {
+    int align = st->packed ? 1 : type_align(f->ty);
+    return f->align_attr > align ? f->align_attr : align;
+}
+
+// Fields go in declaration order (or by decreasing alignment with @reorder),
+// each at the next offset that is a multiple of its alignment
+void typetab_layout(TypeTable* tt, StructType* st) {
+    if (st->layout == 2) return;
+    if (st->layout == 1) type_error("struct %s contains itself", st->name);
+    st->layout = 1;
+    for (int i = 0; i < st->field_count; i++) type_resolve(tt, st->fields[i].ty);
+    if (st->reorder) {
+        // Stable insertion sort keeps declaration order among equals
+        for (int i = 1; i < st->field_count; i++) {
+            StructField f = st->fields[i];
+            int j = i;
+            while (j > 0 && field_align(st, &st->fields[j - 1]) < field_align(st, &f)) {
+                st->fields[j] = st->fields[j - 1];
+                j--;
+            }
+            st->fields[j] = f;
+        }
+    }
+    int size = 0;
+    if (st->align_attr > st->align) st->align = st->align_attr;
+    for (int i = 0; i < st->field_count; i++) {
+        StructField* f = &st->fields[i];
+        int align = field_align(st, f);
+        size = (size + align - 1) / align * align;
+        f->offset = size;
+        size += type_size(f->ty);
+        if (align > st->align) st->align = align;
+    }
+    st->size = (size + st->align - 1) / st->align * st->align;
+    st->layout = 2;
+}
+
+// -fdump-layout: offsets, padding and the cache lines each struct spans
+// when it starts on a line boundary
+void typetab_report(TypeTable* tt, FILE* out) {
+    for (int i = 0; i < tt->count; i++) {
+        StructType* st = &tt->types[i];
+        int lines = (st->size + 63) / 64;
+        fprintf(out, "struct %s: size %d, align %d, %d cache line%s\n",
+                st->name, st->size, st->align, lines, lines == 1 ? "" : "s");
+        int end = 0;
+        int padding = 0;
+        for (int j = 0; j < st->field_count; j++) {
+            StructField* f = &st->fields[j];
+            int size = type_size(f->ty);
+            if (f->offset > end) {
+                fprintf(out, "  %6d  (%d bytes padding)\n", end, f->offset - end);
+                padding += f->offset - end;
+            }
+            fprintf(out, "  %6d  %s: %s (%d byte%s)", f->offset, f->name, type_name(f->ty), size, size == 1 ? "" : "s");
+            if (size > 0 && f->offset / 64 != (f->offset + size - 1) / 64) fprintf(out, "  straddles a cache line");
+            fprintf(out, "\n");
+            end = f->offset + size;
+        }
+        if (st->size > end) {
+            fprintf(out, "  %6d  (%d bytes tail padding)\n", end, st->size - end);
+            padding += st->size - end;
+        }
+        fprintf(out, "  %d bytes of padding\n", padding);
+    }
+}
+
+void type_resolve(TypeTable* tt, Type* t) {
+    if (!t) return;
+    if (t->kind == TY_STRUCT && !t->st) {
+        t->st = typetab_lookup(tt, t->name);
+        if (!t->st) type_error("unknown type %s", t->name);
+        typetab_layout(tt, t->st);
+    }
+    // A pointer may refer to a struct still being laid out
+    if (t->kind == TY_PTR && t->base && t->base->kind == TY_STRUCT) {
+        if (!t->base->st) t->base->st = typetab_lookup(tt, t->base->name);
+        if (!t->base->st) type_error("unknown type %s", t->base->name);
+        return;
+    }
+    type_resolve(tt, t->base);
+}
+
 // ==== STRING TABLE ====
 StringTable* strtab_new() {
     StringTable* st = calloc(1, sizeof(StringTable));
@@ -175,40 +494,16 @@ SymbolTable* symtab_new() {
     return st;
 }
 
-int symtab_add(SymbolTable* st, char* name, int size) {
+// Reserve a naturally aligned slot below rbp
+int symtab_add(SymbolTable* st, char* name, Type* ty) {
     st->count++;
     st->symbols = realloc(st->symbols, sizeof(Symbol) * st->count);
-    int bytes = size * 8;
-    st->stack_size += bytes;
+    int align = type_align(ty);
+    st->stack_size = (st->stack_size + type_size(ty) + align - 1) / align * align;
     st->symbols[st->count - 1].name = strdup(name);
     st->symbols[st->count - 1].offset = -st->stack_size;
-    st->symbols[st->count - 1].size = size;
-    st->symbols[st->count - 1].type_name = NULL;
-    st->symbols[st->count - 1].is_pointer = 0;
-    return -st->stack_size;
-}
-
-int symtab_add_struct(SymbolTable* st, char* name, char* type_name, int size_bytes) {
-    st->count++;
-    st->symbols = realloc(st->symbols, sizeof(Symbol) * st->count);
-    st->stack_size += size_bytes;
-    st->symbols[st->count - 1].name = strdup(name);
-    st->symbols[st->count - 1].offset = -st->stack_size;
-    st->symbols[st->count - 1].size = size_bytes;
-    st->symbols[st->count - 1].type_name = strdup(type_name);
-    st->symbols[st->count - 1].is_pointer = 0;
-    return -st->stack_size;
-}
-
-int symtab_add_pointer(SymbolTable* st, char* name) {
-    st->count++;
-    st->symbols = realloc(st->symbols, sizeof(Symbol) * st->count);
-    st->stack_size += 8;  // Pointer is 8 bytes
-    st->symbols[st->count - 1].name = strdup(name);
-    st->symbols[st->count - 1].offset = -st->stack_size;
-    st->symbols[st->count - 1].size = 8;
-    st->symbols[st->count - 1].type_name = NULL;
-    st->symbols[st->count - 1].is_pointer = 1;
+    st->symbols[st->count - 1].ty = ty;
+    st->symbols[st->count - 1].label = NULL;
     return -st->stack_size;
 }
 
@@ -248,63 +543,93 @@ TokType kw(char* s, int len) {
     if (len == 2 && !memcmp(s, "if", 2)) return T_IF;
     if (len == 4 && !memcmp(s, "else", 4)) return T_ELSE;
     if (len == 5 && !memcmp(s, "while", 5)) return T_WHILE;
+    if (len == 3 && !memcmp(s, "for", 3)) return T_FOR;
+    if (len == 5 && !memcmp(s, "break", 5)) return T_BREAK;
+    if (len == 8 && !memcmp(s, "continue", 8)) return T_CONTINUE;
     if (len == 6 && !memcmp(s, "return", 6)) return T_RET;
     if (len == 6 && !memcmp(s, "struct", 6)) return T_STRUCT;
+    if (len == 5 && !memcmp(s, "const", 5)) return T_CONST;
+    if (len == 6 && !memcmp(s, "static", 6)) return T_STATIC;
+    if (len == 5 && !memcmp(s, "match", 5)) return T_MATCH;
     return T_IDENT;
 }
 
+// The line is filled in by tokenize
+Tok tok(TokType t, char* s, int len) {
+    Tok k = {t, s, len, 0};
+    return k;
+}
+
 Tok lex_tok(Lex* l) {
     skip(l);
     char* st = l->cur;
     char c = adv(l);
 
-    if (!c) return (Tok){T_EOF, st, 0};
+    if (!c) return tok(T_EOF, st, 0);
     if (isalpha(c) || c == '_') {
         while (isalnum(peek(l)) || peek(l) == '_') adv(l);
-        return (Tok){kw(st, l->cur - st), st, l->cur - st};
+        return tok(kw(st, l->cur - st), st, l->cur - st);
     }
     if (isdigit(c)) {
         while (isdigit(peek(l))) adv(l);
-        return (Tok){T_NUM, st, l->cur - st};
+        return tok(T_NUM, st, l->cur - st);
     }
     if (c == '"') {
         while (peek(l) != '"' && peek(l)) { if (peek(l) == '\\') adv(l); adv(l); }
         if (peek(l) == '"') adv(l);
-        return (Tok){T_STR, st, l->cur - st};
-    }
-
-    if (c == '(') return (Tok){T_LPAREN, st, 1};
-    if (c == ')') return (Tok){T_RPAREN, st, 1};
-    if (c == '{') return (Tok){T_LBRACE, st, 1};
-    if (c == '}') return (Tok){T_RBRACE, st, 1};
-    if (c == '[') return (Tok){T_LBRACKET, st, 1};
-    if (c == ']') return (Tok){T_RBRACKET, st, 1};
-    if (c == ';') return (Tok){T_SEMI, st, 1};
-    if (c == ':') return (Tok){T_COLON, st, 1};
-    if (c == ',') return (Tok){T_COMMA, st, 1};
-    if (c == '.') return (Tok){T_DOT, st, 1};
-    if (c == '&') return (Tok){T_AMP, st, 1};  // NEW
-    if (c == '+') return (Tok){T_PLUS, st, 1};
-    if (c == '*') return (Tok){T_STAR, st, 1};
-    if (c == '/') return (Tok){T_SLASH, st, 1};
-    if (c == '=' && peek(l) == '=') { adv(l); return (Tok){T_EQEQ, st, 2}; }
-    if (c == '=') return (Tok){T_EQ, st, 1};
-    if (c == '!' && peek(l) == '=') { adv(l); return (Tok){T_NEQ, st, 2}; }
-    if (c == '<' && peek(l) == '=') { adv(l); return (Tok){T_LTE, st, 2}; }
-    if (c == '<') return (Tok){T_LT, st, 1};
-    if (c == '>' && peek(l) == '=') { adv(l); return (Tok){T_GTE, st, 2}; }
-    if (c == '>') return (Tok){T_GT, st, 1};
-    if (c == '-' && peek(l) == '>') { adv(l); return (Tok){T_ARROW, st, 2}; }
-    if (c == '-') return (Tok){T_MINUS, st, 1};
-
-    return (Tok){T_EOF, st, 0};
+        return tok(T_STR, st, l->cur - st);
+    }
+
+    if (c == '(') return tok(T_LPAREN, st, 1);
+    if (c == ')') return tok(T_RPAREN, st, 1);
+    if (c == '{') return tok(T_LBRACE, st, 1);
+    if (c == '}') return tok(T_RBRACE, st, 1);
+    if (c == '[') return tok(T_LBRACKET, st, 1);
+    if (c == ']') return tok(T_RBRACKET, st, 1);
+    if (c == ';') return tok(T_SEMI, st, 1);
+    if (c == ':') return tok(T_COLON, st, 1);
+    if (c == ',') return tok(T_COMMA, st, 1);
+    if (c == '.' && peek(l) == '.') {
+        adv(l);
+        if (peek(l) == '=') { adv(l); return tok(T_DOTDOTEQ, st, 3); }
+        return tok(T_DOTDOT, st, 2);
+    }
+    if (c == '.') return tok(T_DOT, st, 1);
+    if (c == '&') return tok(T_AMP, st, 1);  // NEW
+    if (c == '+') return tok(T_PLUS, st, 1);
+    if (c == '*') return tok(T_STAR, st, 1);
+    if (c == '/') return tok(T_SLASH, st, 1);
+    if (c == '%') return tok(T_PERCENT, st, 1);
+    if (c == '|') return tok(T_PIPE, st, 1);
+    if (c == '@') return tok(T_AT, st, 1);
+    if (c == '=' && peek(l) == '=') { adv(l); return tok(T_EQEQ, st, 2); }
+    if (c == '=' && peek(l) == '>') { adv(l); return tok(T_FATARROW, st, 2); }
+    if (c == '=') return tok(T_EQ, st, 1);
+    if (c == '!' && peek(l) == '=') { adv(l); return tok(T_NEQ, st, 2); }
+    if (c == '<' && peek(l) == '=') { adv(l); return tok(T_LTE, st, 2); }
+    if (c == '<') return tok(T_LT, st, 1);
+    if (c == '>' && peek(l) == '=') { adv(l); return tok(T_GTE, st, 2); }
+    if (c == '>') return tok(T_GT, st, 1);
+    if (c == '-' && peek(l) == '>') { adv(l); return tok(T_ARROW, st, 2); }
+    if (c == '-') return tok(T_MINUS, st, 1);
+
+    return tok(T_EOF, st, 0);
 }
 
 Tok* tokenize(char* src, int* count) {
     Lex l; lex_init(&l, src);
-    Tok* toks = malloc(sizeof(Tok) * 2000);
+    int cap = 2000;
+    Tok* toks = malloc(sizeof(Tok) * cap);
     *count = 0;
-    do { toks[(*count)++] = lex_tok(&l); } while (toks[*count - 1].t != T_EOF);
+    int line = 1;
+    char* seen = src;  // Newlines are counted up to here
+    do {
+        if (*count == cap) toks = realloc(toks, sizeof(Tok) * (cap *= 2));
+        Tok t = lex_tok(&l);
+        for (; seen < t.s; seen++) line += *seen == '\n';
+        t.line = line;
+        toks[(*count)++] = t;
+    } while (toks[*count - 1].t != T_EOF);
     return toks;
 }
 
@@ -359,7 +684,7 @@ AstNode* parse_primary(Parser* p) {
         Tok t = advance_tok(p);
 
         // Struct literal
-        if (check_tok(p, T_LBRACE)) {
+        if (check_tok(p, T_LBRACE) && !p->no_struct) {
             advance_tok(p);
             AstNode* struct_lit = ast_new(AST_STRUCT_LITERAL);
             struct_lit->struct_type = strndup(t.s, t.len);
@@ -393,15 +718,6 @@ AstNode* parse_primary(Parser* p) {
             return call;
         }
 
-        // Assignment
-        if (check_tok(p, T_EQ)) {
-            advance_tok(p);
-            AstNode* assign = ast_new(AST_ASSIGN);
-            assign->name = strndup(t.s, t.len);
-            ast_add(assign, parse_expr(p));
-            return assign;
-        }
-
         // Identifier
         AstNode* n = ast_new(AST_IDENT);
         n->name = strndup(t.s, t.len);
@@ -415,37 +731,8 @@ AstNode* parse_primary(Parser* p) {
     fprintf(stderr, "Parse error\n"); exit(1);
 }
 
-// Parse unary operators: &x, *ptr
-AstNode* parse_unary(Parser* p) {
-    if (check_tok(p, T_AMP)) {
-        // Address-of: &variable
-        advance_tok(p);
-        AstNode* addr_of = ast_new(AST_ADDR_OF);
-        ast_add(addr_of, parse_unary(p));  // Allow chaining
-        return addr_of;
-    }
-    if (check_tok(p, T_STAR)) {
-        // Dereference: *ptr (need to distinguish from multiplication)
-        // Look ahead: if next is identifier/lparen, it's dereference
-        int saved_pos = p->pos;
-        advance_tok(p);
-        if (check_tok(p, T_IDENT) || check_tok(p, T_LPAREN) ||
-            check_tok(p, T_STAR) || check_tok(p, T_AMP)) {
-            // It's dereference
-            AstNode* deref = ast_new(AST_DEREF);
-            ast_add(deref, parse_unary(p));
-            return deref;
-        } else {
-            // It's multiplication, backtrack
-            p->pos = saved_pos;
-            return parse_primary(p);
-        }
-    }
-    return parse_primary(p);
-}
-
 AstNode* parse_postfix(Parser* p) {
-    AstNode* left = parse_unary(p);
+    AstNode* left = parse_primary(p);
     while (1) {
         if (check_tok(p, T_LBRACKET)) {
             // Array indexing
@@ -481,11 +768,40 @@ AstNode* parse_postfix(Parser* p) {
     return left;
 }
 
+// Parse unary operators: &x, *ptr (bind looser than postfix: &arr[i])
+AstNode* parse_unary(Parser* p) {
+    if (check_tok(p, T_AMP)) {
+        // Address-of: &variable
+        advance_tok(p);
+        AstNode* addr_of = ast_new(AST_ADDR_OF);
+        ast_add(addr_of, parse_unary(p));  // Allow chaining
+        return addr_of;
+    }
+    if (check_tok(p, T_STAR)) {
+        // Dereference: *ptr (need to distinguish from multiplication)
+        // Look ahead: if next is identifier/lparen, it's dereference
+        int saved_pos = p->pos;
+        advance_tok(p);
+        if (check_tok(p, T_IDENT) || check_tok(p, T_LPAREN) ||
+            check_tok(p, T_STAR) || check_tok(p, T_AMP)) {
+            // It's dereference
+            AstNode* deref = ast_new(AST_DEREF);
+            ast_add(deref, parse_unary(p));
+            return deref;
+        } else {
+            // It's multiplication, backtrack
+            p->pos = saved_pos;
+            return parse_postfix(p);
+        }
+    }
+    return parse_postfix(p);
+}
+
 AstNode* parse_multiplicative(Parser* p) {
-    AstNode* left = parse_postfix(p);
-    while (check_tok(p, T_STAR) || check_tok(p, T_SLASH)) {
+    AstNode* left = parse_unary(p);
+    while (check_tok(p, T_STAR) || check_tok(p, T_SLASH) || check_tok(p, T_PERCENT)) {
         Tok op = advance_tok(p);
-        AstNode* right = parse_postfix(p);
+        AstNode* right = parse_unary(p);
         AstNode* binop = ast_new(AST_BINOP);
         binop->op = strndup(op.s, op.len);
         ast_add(binop, left);
@@ -509,13 +825,42 @@ AstNode* parse_additive(Parser* p) {
     return left;
 }
 
-AstNode* parse_comparison(Parser* p) {
+// Bitwise operators bind tighter than comparisons: (x & 1) == 0 needs no parens
+AstNode* parse_bitand(Parser* p) {
     AstNode* left = parse_additive(p);
+    while (check_tok(p, T_AMP)) {
+        Tok op = advance_tok(p);
+        AstNode* right = parse_additive(p);
+        AstNode* binop = ast_new(AST_BINOP);
+        binop->op = strndup(op.s, op.len);
+        ast_add(binop, left);
+        ast_add(binop, right);
+        left = binop;
+    }
+    return left;
+}
+
+AstNode* parse_bitor(Parser* p) {
+    AstNode* left = parse_bitand(p);
+    while (check_tok(p, T_PIPE)) {
+        Tok op = advance_tok(p);
+        AstNode* right = parse_bitand(p);
+        AstNode* binop = ast_new(AST_BINOP);
+        binop->op = strndup(op.s, op.len);
+        ast_add(binop, left);
+        ast_add(binop, right);
+        left = binop;
+    }
+    return left;
+}
+
+AstNode* parse_comparison(Parser* p) {
+    AstNode* left = parse_bitor(p);
     while (check_tok(p, T_EQEQ) || check_tok(p, T_NEQ) ||
            check_tok(p, T_LT) || check_tok(p, T_GT) ||
            check_tok(p, T_LTE) || check_tok(p, T_GTE)) {
         Tok op = advance_tok(p);
-        AstNode* right = parse_additive(p);
+        AstNode* right = parse_bitor(p);
         AstNode* cmp = ast_new(AST_COMPARE);
         cmp->op = strndup(op.s, op.len);
         ast_add(cmp, left);
@@ -530,8 +875,115 @@ AstNode* parse_expr(Parser* p) {
 }
 
 AstNode* parse_block(Parser* p);
+void parse_attributes(Parser* p, AstNode* n);
+
+// Type annotation: i32, i64, str, *T, [T; N] or a struct name
+Type* parse_type(Parser* p) {
+    if (match_tok(p, T_STAR)) return type_ptr(parse_type(p));
+    if (match_tok(p, T_LBRACKET)) {
+        Type* elem = parse_type(p);
+        expect(p, T_SEMI);
+        Tok len = advance_tok(p);
+        expect(p, T_RBRACKET);
+        return type_array(elem, atoi(strndup(len.s, len.len)));
+    }
+    Tok t = advance_tok(p);
+    char* name = strndup(t.s, t.len);
+    // i8 i16 i32 i64 u8 u16 u32 u64
+    if ((name[0] == 'i' || name[0] == 'u') && isdigit(name[1])) {
+        int bits = atoi(name + 1);
+        if (bits == 8 || bits == 16 || bits == 32 || bits == 64) {
+            return name[0] == 'u' ? type_uint(bits / 8) : type_int(bits / 8);
+        }
+    }
+    if (!strcmp(name, "str")) return type_new(TY_STR, 8);
+    return type_struct(name);
+}
+
+// match (x) { 1, 3..=5 => { ... } 8..16 => { ... } _ => { ... } }
+// Each arm is an AST_MATCH_ARM: its patterns (values or AST_RANGEs), then
+// its block. The `_` arm has no patterns.
+AstNode* parse_match(Parser* p) {
+    AstNode* m = ast_new(AST_MATCH);
+    expect(p, T_LPAREN);
+    ast_add(m, parse_expr(p));
+    expect(p, T_RPAREN);
+    expect(p, T_LBRACE);
+    while (!check_tok(p, T_RBRACE) && !check_tok(p, T_EOF)) {
+        AstNode* arm = ast_new(AST_MATCH_ARM);
+        Tok t = peek_tok(p);
+        if (t.t == T_IDENT && t.len == 1 && t.s[0] == '_') {
+            advance_tok(p);
+        } else {
+            do {
+                AstNode* pat = parse_expr(p);
+                if (check_tok(p, T_DOTDOT) || check_tok(p, T_DOTDOTEQ)) {
+                    Tok op = advance_tok(p);
+                    AstNode* range = ast_new(AST_RANGE);
+                    range->op = strndup(op.s, op.len);
+                    ast_add(range, pat);
+                    ast_add(range, parse_expr(p));
+                    pat = range;
+                }
+                ast_add(arm, pat);
+            } while (match_tok(p, T_COMMA));
+        }
+        expect(p, T_FATARROW);
+        ast_add(arm, parse_block(p));
+        ast_add(m, arm);
+    }
+    expect(p, T_RBRACE);
+    return m;
+}
+
+// for i in a..b { ... } / for i in a..=b step s { ... }
+// AST_FOR: name = variable, op = ".." or "..=", children = { a, b, [s], block }
+AstNode* parse_for(Parser* p) {
+    AstNode* f = ast_new(AST_FOR);
+    Tok var = advance_tok(p);
+    Tok in = advance_tok(p);
+    if (var.t != T_IDENT || in.t != T_IDENT || in.len != 2 || memcmp(in.s, "in", 2)) {
+        fprintf(stderr, "Parse error\n"); exit(1);
+    }
+    f->name = strndup(var.s, var.len);
+    p->no_struct = 1;
+    ast_add(f, parse_expr(p));
+    if (!check_tok(p, T_DOTDOT) && !check_tok(p, T_DOTDOTEQ)) { fprintf(stderr, "Parse error\n"); exit(1); }
+    Tok op = advance_tok(p);
+    f->op = strndup(op.s, op.len);
+    ast_add(f, parse_expr(p));
+    Tok step = peek_tok(p);
+    if (step.t == T_IDENT && step.len == 4 && !memcmp(step.s, "step", 4)) {
+        advance_tok(p);
+        ast_add(f, parse_expr(p));
+    }
+    p->no_struct = 0;
+    ast_add(f, parse_block(p));
+    return f;
+}
 
 AstNode* parse_stmt(Parser* p) {
+    int line = peek_tok(p).line;
+    if (check_tok(p, T_AT)) {
+        // Loop annotations: @unroll(4) for i in ..., @bound(100) while ...
+        AstNode attrs = {0};
+        parse_attributes(p, &attrs);
+        AstNode* loop = parse_stmt(p);
+        for (int i = 0; i < attrs.attr_count; i++) {
+            if ((strcmp(attrs.attrs[i].name, "unroll") && strcmp(attrs.attrs[i].name, "bound")) ||
+                (loop->type != AST_WHILE && loop->type != AST_FOR)) {
+                fprintf(stderr, "Parse error: @%s on line %d is not a loop annotation\n", attrs.attrs[i].name, line);
+                exit(1);
+            }
+            if (!strcmp(attrs.attrs[i].name, "bound") && !attrs.attrs[i].arg) {
+                fprintf(stderr, "Parse error: @bound on line %d needs a count\n", line);
+                exit(1);
+            }
+        }
+        loop->attrs = attrs.attrs;
+        loop->attr_count = attrs.attr_count;
+        return loop;
+    }
     if (match_tok(p, T_RET)) {
         AstNode* ret = ast_new(AST_RETURN);
         if (!check_tok(p, T_SEMI)) ast_add(ret, parse_expr(p));
@@ -543,14 +995,11 @@ AstNode* parse_stmt(Parser* p) {
         AstNode* let = ast_new(AST_LET);
         let->name = strndup(name.s, name.len);
 
-        // Check for pointer type: let ptr: *Type
+        // Declared type: let ptr: *T, let arr: [T; N]
         if (match_tok(p, T_COLON)) {
-            if (match_tok(p, T_STAR)) {
-                let->is_pointer = 1;
-                advance_tok(p);  // Skip type name
-            } else {
-                advance_tok(p);  // Skip type name
-            }
+            let->ty = parse_type(p);
+            let->is_pointer = let->ty->kind == TY_PTR;
+            if (let->ty->kind == TY_ARRAY) let->array_size = let->ty->length;
         }
 
         if (match_tok(p, T_EQ)) ast_add(let, parse_expr(p));
@@ -566,8 +1015,20 @@ AstNode* parse_stmt(Parser* p) {
         if (match_tok(p, T_ELSE)) ast_add(ifnode, parse_block(p));
         return ifnode;
     }
+    if (match_tok(p, T_MATCH)) return parse_match(p);
+    if (match_tok(p, T_FOR)) {
+        AstNode* f = parse_for(p);
+        f->line = line;
+        return f;
+    }
+    if (match_tok(p, T_BREAK) || match_tok(p, T_CONTINUE)) {
+        AstNode* jump = ast_new(p->tokens[p->pos - 1].t == T_BREAK ? AST_BREAK : AST_CONTINUE);
+        expect(p, T_SEMI);
+        return jump;
+    }
     if (match_tok(p, T_WHILE)) {
         AstNode* whilenode = ast_new(AST_WHILE);
+        whilenode->line = line;
         expect(p, T_LPAREN);
         ast_add(whilenode, parse_expr(p));
         expect(p, T_RPAREN);
@@ -575,6 +1036,19 @@ AstNode* parse_stmt(Parser* p) {
         return whilenode;
     }
     AstNode* expr = parse_expr(p);
+    if (expr->type == AST_IDENT && match_tok(p, T_EQ)) {
+        // Assignment
+        AstNode* assign = ast_new(AST_ASSIGN);
+        assign->name = expr->name;
+        ast_add(assign, parse_expr(p));
+        expr = assign;
+    } else if (match_tok(p, T_EQ)) {
+        // Store through an lvalue: arr[i] = v, *ptr = v, s.field = v
+        AstNode* store = ast_new(AST_STORE);
+        ast_add(store, expr);
+        ast_add(store, parse_expr(p));
+        expr = store;
+    }
     expect(p, T_SEMI);
     return expr;
 }
@@ -597,12 +1071,12 @@ AstNode* parse_struct_def(Parser* p) {
 
     expect(p, T_LBRACE);
     while (!check_tok(p, T_RBRACE)) {
+        AstNode* field = ast_new(AST_IDENT);
+        parse_attributes(p, field);
         Tok field_name = advance_tok(p);
         expect(p, T_COLON);
-        advance_tok(p);  // Type
-
-        AstNode* field = ast_new(AST_IDENT);
         field->name = strndup(field_name.s, field_name.len);
+        field->ty = parse_type(p);
         ast_add(struct_def, field);
 
         if (!check_tok(p, T_RBRACE)) expect(p, T_COMMA);
@@ -624,159 +1098,4323 @@ AstNode* parse_func(Parser* p) {
         AstNode* par = ast_new(AST_IDENT);
         par->name = strndup(param.s, param.len);
         ast_add(func, par);
-        if (match_tok(p, T_COLON)) {
-            // Handle pointer types: *Type
-            if (match_tok(p, T_STAR)) {
-                par->is_pointer = 1;
-                advance_tok(p);  // Skip base type
-            } else {
-                advance_tok(p);  // Skip type
-            }
-        }
+        par->ty = match_tok(p, T_COLON) ? parse_type(p) : type_int(4);
+        par->is_pointer = par->ty->kind == TY_PTR;
         if (!check_tok(p, T_RPAREN)) expect(p, T_COMMA);
     }
     expect(p, T_RPAREN);
 
-    if (match_tok(p, T_ARROW)) advance_tok(p);
+    func->ty = match_tok(p, T_ARROW) ? parse_type(p) : type_int(4);
     ast_add(func, parse_block(p));
     return func;
 }
 
+// Attach any @name / @name(expr) annotations that precede a declaration
+void parse_attributes(Parser* p, AstNode* n) {
+    while (match_tok(p, T_AT)) {
+        Tok name = advance_tok(p);
+        n->attr_count++;
+        n->attrs = realloc(n->attrs, sizeof(Attribute) * n->attr_count);
+        Attribute* a = &n->attrs[n->attr_count - 1];
+        a->name = strndup(name.s, name.len);
+        a->arg = NULL;
+        if (match_tok(p, T_LPAREN)) {
+            a->arg = parse_expr(p);
+            expect(p, T_RPAREN);
+        }
+    }
+}
+
+Attribute* ast_attr(AstNode* n, const char* name) {
+    for (int i = 0; i < n->attr_count; i++) {
+        if (!strcmp(n->attrs[i].name, name)) return &n->attrs[i];
+    }
+    return NULL;
+}
+
+// Attributes the compiler derives itself, such as a loop's `trip` count
+void ast_add_attr(AstNode* n, char* name, AstNode* arg) {
+    n->attr_count++;
+    n->attrs = realloc(n->attrs, sizeof(Attribute) * n->attr_count);
+    n->attrs[n->attr_count - 1].name = name;
+    n->attrs[n->attr_count - 1].arg = arg;
+}
+
+void ast_drop_attr(AstNode* n, const char* name) {
+    Attribute* a = ast_attr(n, name);
+    if (!a) return;
+    // Clones share the array, so drop by copying
+    Attribute* rest = malloc(sizeof(Attribute) * n->attr_count);
+    int count = 0;
+    for (int i = 0; i < n->attr_count; i++) {
+        if (&n->attrs[i] != a) rest[count++] = n->attrs[i];
+    }
+    n->attrs = rest;
+    n->attr_count = count;
+}
+
+// Top-level `let` / `static` (mutable) or `const` (read-only) variable
+AstNode* parse_global(Parser* p) {
+    Tok kind = advance_tok(p);
+    Tok name = advance_tok(p);
+    AstNode* global = ast_new(AST_GLOBAL);
+    global->name = strndup(name.s, name.len);
+    global->op = strndup(kind.s, kind.len);
+    if (match_tok(p, T_COLON)) {
+        global->ty = parse_type(p);
+        global->is_pointer = global->ty->kind == TY_PTR;
+    }
+    if (match_tok(p, T_EQ)) ast_add(global, parse_expr(p));
+    expect(p, T_SEMI);
+    if (kind.t == T_CONST && global->child_count == 0) {
+        fprintf(stderr, "Error: const %s needs an initializer\n", global->name);
+        exit(1);
+    }
+    return global;
+}
+
 AstNode* parse(Parser* p) {
     AstNode* prog = ast_new(AST_PROGRAM);
     while (!check_tok(p, T_EOF)) {
+        AstNode attrs = {0};
+        parse_attributes(p, &attrs);
+        AstNode* decl;
         if (check_tok(p, T_STRUCT)) {
-            ast_add(prog, parse_struct_def(p));
+            decl = parse_struct_def(p);
+        } else if (check_tok(p, T_CONST) && p->tokens[p->pos + 1].t == T_FN) {
+            // const fn: same as @const, calls with constant arguments must fold
+            advance_tok(p);
+            attrs.attr_count++;
+            attrs.attrs = realloc(attrs.attrs, sizeof(Attribute) * attrs.attr_count);
+            attrs.attrs[attrs.attr_count - 1] = (Attribute){strdup("const"), NULL};
+            decl = parse_func(p);
+        } else if (check_tok(p, T_LET) || check_tok(p, T_STATIC) || check_tok(p, T_CONST)) {
+            decl = parse_global(p);
         } else {
-            ast_add(prog, parse_func(p));
+            decl = parse_func(p);
         }
+        decl->attrs = attrs.attrs;
+        decl->attr_count = attrs.attr_count;
+        ast_add(prog, decl);
     }
     return prog;
 }
 
-// ==== CODEGEN ====
-void emit(Codegen* cg, const char* fmt, ...) {
-    va_list args;
-    va_start(args, fmt);
+// ==== AST UTILITIES ====
+AstNode* ast_ident(char* name) {
+    AstNode* n = ast_new(AST_IDENT);
+    n->name = strdup(name);
+    return n;
+}
 
-    va_list args_copy;
-    va_copy(args_copy, args);
-    int needed = vsnprintf(NULL, 0, fmt, args_copy);
-    va_end(args_copy);
+AstNode* ast_num(long value) {
+    AstNode* n = ast_new(AST_NUMBER);
+    char buf[32];
+    sprintf(buf, "%ld", value);
+    n->value = strdup(buf);
+    return n;
+}
+
+AstNode* ast_binop(char* op, AstNode* left, AstNode* right) {
+    AstNode* n = ast_new(AST_BINOP);
+    n->op = strdup(op);
+    ast_add(n, left);
+    ast_add(n, right);
+    return n;
+}
+
+AstNode* ast_let(char* name, AstNode* init) {
+    AstNode* n = ast_new(AST_LET);
+    n->name = strdup(name);
+    if (init) ast_add(n, init);
+    return n;
+}
+
+AstNode* ast_assign(char* name, AstNode* value) {
+    AstNode* n = ast_new(AST_ASSIGN);
+    n->name = strdup(name);
+    ast_add(n, value);
+    return n;
+}
+
+AstNode* ast_clone(AstNode* n) {
+    AstNode* c = malloc(sizeof(AstNode));
+    *c = *n;
+    c->children = NULL;
+    c->child_count = 0;
+    for (int i = 0; i < n->child_count; i++) ast_add(c, ast_clone(n->children[i]));
+    return c;
+}
+
+static int str_eq(char* a, char* b) {
+    if (!a || !b) return a == b;
+    return !strcmp(a, b);
+}
+
+int ast_equal(AstNode* a, AstNode* b) {
+    if (a->type != b->type || a->child_count != b->child_count) return 0;
+    if (!str_eq(a->name, b->name) || !str_eq(a->value, b->value) || !str_eq(a->op, b->op)) return 0;
+    for (int i = 0; i < a->child_count; i++) {
+        if (!ast_equal(a->children[i], b->children[i])) return 0;
+    }
+    return 1;
+}
+
+// Overwrite a node in place so every pointer to it sees the replacement
+void ast_replace(AstNode* dst, AstNode* src) { *dst = *src; }
+
+void ast_insert(AstNode* p, int idx, AstNode* c) {
+    ast_add(p, c);
+    for (int i = p->child_count - 1; i > idx; i--) p->children[i] = p->children[i - 1];
+    p->children[idx] = c;
+}
+
+void ast_remove(AstNode* p, int idx) {
+    for (int i = idx; i < p->child_count - 1; i++) p->children[i] = p->children[i + 1];
+    p->child_count--;
+}
+
+int ast_index_of(AstNode* p, AstNode* c) {
+    for (int i = 0; i < p->child_count; i++) {
+        if (p->children[i] == c) return i;
+    }
+    return -1;
+}
+
+AstNode* ast_find_parent(AstNode* root, AstNode* target) {
+    for (int i = 0; i < root->child_count; i++) {
+        if (root->children[i] == target) return root;
+        AstNode* found = ast_find_parent(root->children[i], target);
+        if (found) return found;
+    }
+    return NULL;
+}
+
+int ast_is_num(AstNode* n, long* value) {
+    if (n->type != AST_NUMBER) return 0;
+    if (value) *value = atol(n->value);
+    return 1;
+}
+
+AstNode* find_global(AstNode* prog, char* name) {
+    for (int i = 0; i < prog->child_count; i++) {
+        AstNode* g = prog->children[i];
+        if (g->type == AST_GLOBAL && !strcmp(g->name, name)) return g;
+    }
+    return NULL;
+}
+
+// Value of an integer expression over literals and scalar consts
+int const_value(AstNode* prog, AstNode* e, long* value) {
+    long a, b;
+    if (ast_is_num(e, value)) return 1;
+    if (e->type == AST_IDENT && e->child_count == 0) {
+        AstNode* g = find_global(prog, e->name);
+        return g && !strcmp(g->op, "const") && g->child_count > 0 && const_value(prog, g->children[0], value);
+    }
+    if (e->type != AST_BINOP || !const_value(prog, e->children[0], &a) ||
+        !const_value(prog, e->children[1], &b)) return 0;
+    if ((e->op[0] == '/' || e->op[0] == '%') && (b == 0 || b == -1)) return 0;
+    *value = e->op[0] == '+' ? a + b : e->op[0] == '-' ? a - b : e->op[0] == '*' ? a * b :
+             e->op[0] == '&' ? (a & b) : e->op[0] == '|' ? (a | b) : e->op[0] == '%' ? a % b : a / b;
+    return 1;
+}
+
+// A match pattern once folded: the values lo..=hi select arm `arm`
+typedef struct MatchCase {
+    long lo;
+    long hi;
+    int arm;             // Child index of the AST_MATCH_ARM in the match
+} MatchCase;
+
+static int match_less(long a, long b, int is_unsigned) {
+    return is_unsigned ? (unsigned long)a < (unsigned long)b : a < b;
+}
+
+// Iterations of a loop that starts `v` at a, runs while `v op b` and steps it
+// by `step`; 0 unless op moves toward b (< or <= up, > or >= down)
+long loop_trip_count(long a, char* op, long b, long step, int is_unsigned) {
+    int up = op[0] == '<';
+    if ((op[0] != '<' && op[0] != '>') || up != (step > 0)) return 0;
+    long from = up ? a : b;
+    long to = up ? b : a;
+    int inclusive = op[1] == '=';
+    if (!match_less(from, to, is_unsigned) && !(inclusive && from == to)) return 0;
+    unsigned long mag = step > 0 ? step : -step;
+    return (long)(((unsigned long)to - (unsigned long)from - !inclusive) / mag) + 1;
+}
+
+// The folded patterns of a match sorted by value, with adjacent cases of
+// the same arm merged. Empty ranges and values two patterns cover are errors.
+int match_cases(AstNode* m, MatchCase** out) {
+    int is_unsigned = type_is_unsigned(m->children[0]->ty);
+    MatchCase* cases = NULL;
+    int count = 0;
+    for (int i = 1; i < m->child_count; i++) {
+        AstNode* arm = m->children[i];
+        for (int j = 0; j < arm->child_count - 1; j++) {
+            AstNode* p = arm->children[j];
+            MatchCase c = {0, 0, i};
+            if (p->type == AST_RANGE) {
+                ast_is_num(p->children[0], &c.lo);
+                ast_is_num(p->children[1], &c.hi);
+            } else {
+                ast_is_num(p, &c.lo);
+                c.hi = c.lo;
+            }
+            if (match_less(c.hi, c.lo, is_unsigned)) {
+                fprintf(stderr, "Error: match range %ld..=%ld is empty\n", c.lo, c.hi);
+                exit(1);
+            }
+            cases = realloc(cases, sizeof(MatchCase) * (count + 1));
+            int k = count++;
+            for (; k > 0 && match_less(c.lo, cases[k - 1].lo, is_unsigned); k--) cases[k] = cases[k - 1];
+            cases[k] = c;
+        }
+    }
+    int n = 0;
+    for (int i = 0; i < count; i++) {
+        MatchCase* prev = n > 0 ? &cases[n - 1] : NULL;
+        if (prev && !match_less(prev->hi, cases[i].lo, is_unsigned)) {
+            fprintf(stderr, "Error: match value %ld is covered by two patterns\n", cases[i].lo);
+            exit(1);
+        }
+        if (prev && prev->arm == cases[i].arm && prev->hi + 1 == cases[i].lo) prev->hi = cases[i].hi;
+        else cases[n++] = cases[i];
+    }
+    if (out) *out = cases;
+    else free(cases);
+    return n;
+}
+
+// Count reads of variable `name` (identifier nodes) in a subtree
+int ast_uses(AstNode* n, char* name) {
+    int count = (n->type == AST_IDENT && !strcmp(n->name, name)) ? 1 : 0;
+    for (int i = 0; i < n->child_count; i++) count += ast_uses(n->children[i], name);
+    return count;
+}
+
+int is_builtin(char* name) {
+    return !strcmp(name, "print") || !strcmp(name, "println") || !strcmp(name, "print_int") ||
+           !strcmp(name, "exit") || !strcmp(name, "strcmp") || !strcmp(name, "strcpy") ||
+           !strcmp(name, "strlen");
+}
+
+// print or println of anything but a literal: its length comes from __strlen
+int prints_str(AstNode* n) {
+    if (n->type == AST_CALL && (!strcmp(n->name, "print") || !strcmp(n->name, "println")) &&
+        n->child_count > 0 && n->children[0]->type != AST_STRING) return 1;
+    for (int i = 0; i < n->child_count; i++) {
+        if (prints_str(n->children[i])) return 1;
+    }
+    return 0;
+}
+
+// Does a subtree contain a call (or an inlined body) that may write memory?
+int ast_has_call(AstNode* n) {
+    if (n->type == AST_INLINE) return 1;
+    if (n->type == AST_CALL && strcmp(n->name, "print") && strcmp(n->name, "println") &&
+        strcmp(n->name, "print_int") && strcmp(n->name, "strlen") && strcmp(n->name, "strcmp")) {
+        return 1;
+    }
+    for (int i = 0; i < n->child_count; i++) {
+        if (ast_has_call(n->children[i])) return 1;
+    }
+    return 0;
+}
+
+// ==== TYPE CHECKER ====
+// Records a type on every expression (n->ty) and on every let, parameter and
+// function. Runs before optimization and again after it, so nodes the
+// optimizer creates are typed too; existing annotations are kept.
+typedef struct Checker {
+    TypeTable* types;
+    AstNode* prog;
+    AstNode* func;
+    char** names;        // Variables of the current function, first wins like the symbol table
+    Type** tys;
+    int count;
+    AstNode** globals;   // Globals declared so far
+    int global_count;
+    int loop_depth;      // Loops around the statement being checked
+    int for_count;       // Hidden bounds of lowered for loops
+} Checker;
+
+static AstNode* check_global(Checker* c, char* name) {
+    for (int i = 0; i < c->global_count; i++) {
+        if (!strcmp(c->globals[i]->name, name)) return c->globals[i];
+    }
+    return NULL;
+}
+
+static void check_declare(Checker* c, char* name, Type* ty) {
+    // One flat scope per function: a local named like a global would hide it
+    if (check_global(c, name)) type_error("%s in %s shadows a global", name, c->func->name);
+    c->count++;
+    c->names = realloc(c->names, sizeof(char*) * c->count);
+    c->tys = realloc(c->tys, sizeof(Type*) * c->count);
+    c->names[c->count - 1] = name;
+    c->tys[c->count - 1] = ty;
+}
+
+static Type* check_local(Checker* c, char* name) {
+    for (int i = 0; i < c->count; i++) {
+        if (!strcmp(c->names[i], name)) return c->tys[i];
+    }
+    return NULL;
+}
+
+static Type* check_lookup(Checker* c, char* name) {
+    Type* ty = check_local(c, name);
+    if (ty) return ty;
+    AstNode* g = check_global(c, name);
+    if (g) return g->ty;
+    type_error("undefined variable %s in %s", name, c->func ? c->func->name : "a global initializer");
+    return NULL;
+}
+
+static AstNode* find_function(AstNode* prog, char* name) {
+    for (int i = 0; i < prog->child_count; i++) {
+        AstNode* f = prog->children[i];
+        if (f->type == AST_FUNCTION && !strcmp(f->name, name)) return f;
+    }
+    return NULL;
+}
+
+static Type* field_type(Checker* c, Type* obj, char* field) {
+    if (!obj || obj->kind != TY_STRUCT) type_error("field access .%s on %s", field, type_name(obj));
+    type_resolve(c->types, obj);
+    StructField* f = typetab_field(c->types, obj->name, field);
+    if (!f) type_error("struct %s has no field %s", obj->name, field);
+    return f->ty;
+}
+
+static void check_stmt(Checker* c, AstNode* n);
+
+Type* check_expr(Checker* c, AstNode* n) {
+    Type* t = NULL;
+    switch (n->type) {
+    case AST_NUMBER: {
+        // Folded constants keep the type of the expression they replaced
+        long v = atol(n->value);
+        t = n->ty ? n->ty : type_int(v == (int)v ? 4 : 8);
+        break;
+    }
+    case AST_STRING:
+        t = type_new(TY_STR, 8);
+        break;
+    case AST_IDENT:
+        t = check_lookup(c, n->name);
+        n->is_global = check_global(c, n->name) != NULL;
+        break;
+    case AST_BINOP: {
+        Type* l = check_expr(c, n->children[0]);
+        Type* r = check_expr(c, n->children[1]);
+        if (type_is_aggregate(l) || type_is_aggregate(r)) {
+            type_error("operator %s on %s and %s", n->op, type_name(l), type_name(r));
+        }
+        t = type_arith(l, r);
+        break;
+    }
+    case AST_COMPARE:
+        check_expr(c, n->children[0]);
+        check_expr(c, n->children[1]);
+        t = type_int(4);
+        break;
+    case AST_CALL: {
+        for (int i = 0; i < n->child_count; i++) check_expr(c, n->children[i]);
+        AstNode* f = find_function(c->prog, n->name);
+        if (f) t = f->ty;
+        else if (!strcmp(n->name, "strlen")) t = type_int(8);
+        else if (!strcmp(n->name, "strcpy")) t = type_new(TY_STR, 8);
+        else if (is_builtin(n->name)) t = type_int(4);
+        else t = type_int(8);  // External: assume a full register
+        break;
+    }
+    case AST_INDEX: {
+        Type* base = check_expr(c, n->children[0]);
+        check_expr(c, n->children[1]);
+        if (base->kind != TY_ARRAY && base->kind != TY_PTR) type_error("cannot index %s", type_name(base));
+        if (base->kind == TY_PTR && type_is_soa(base->base)) {
+            type_error("@soa struct %s can only be indexed through its array", base->base->name);
+        }
+        t = base->base;
+        break;
+    }
+    case AST_DEREF: {
+        Type* p = check_expr(c, n->children[0]);
+        if (p->kind != TY_PTR) type_error("dereference of non-pointer %s", type_name(p));
+        t = p->base;
+        break;
+    }
+    case AST_ADDR_OF:
+        t = type_ptr(check_expr(c, n->children[0]));
+        break;
+    case AST_FIELD_ACCESS:
+        t = field_type(c, check_expr(c, n->children[0]), n->name);
+        break;
+    case AST_STRUCT_LITERAL:
+        t = type_struct(n->struct_type);
+        type_resolve(c->types, t);
+        for (int i = 0; i < n->child_count; i++) {
+            field_type(c, t, n->children[i]->name);
+            check_expr(c, n->children[i]->children[0]);
+        }
+        break;
+    case AST_ARRAY_LITERAL: {
+        int size = 4;
+        for (int i = 0; i < n->child_count; i++) {
+            Type* e = check_expr(c, n->children[i]);
+            if (e->kind != TY_INT || e->size > size) size = 8;
+        }
+        t = type_array(type_int(size), n->child_count);
+        break;
+    }
+    case AST_INLINE:
+        for (int i = 0; i < n->child_count; i++) check_stmt(c, n->children[i]);
+        t = n->ty ? n->ty : type_int(4);
+        break;
+    default:
+        for (int i = 0; i < n->child_count; i++) check_expr(c, n->children[i]);
+        t = type_int(4);
+        break;
+    }
+    type_resolve(c->types, t);
+    n->ty = t;
+    return t;
+}
+
+static void check_assignable(Type* target, Type* value, char* what) {
+    int target_struct = target->kind == TY_STRUCT;
+    int value_struct = value->kind == TY_STRUCT;
+    if (target_struct != value_struct || (target_struct && !type_equal(target, value)) ||
+        target->kind == TY_ARRAY) {
+        type_error("cannot assign %s to %s (%s)", type_name(value), type_name(target), what);
+    }
+}
+
+// Assignments may not target a const global or any part of one
+static void check_writable(Checker* c, AstNode* target, char* name) {
+    while (!name && (target->type == AST_INDEX || target->type == AST_FIELD_ACCESS)) target = target->children[0];
+    if (!name && target->type == AST_IDENT) name = target->name;
+    AstNode* g = name ? check_global(c, name) : NULL;
+    if (g && !strcmp(g->op, "const")) type_error("cannot assign to const %s", name);
+}
+
+// Insert `incr` before every `continue` of the loop whose body is `n`
+static void for_continue_incr(AstNode* n, AstNode* incr) {
+    for (int i = 0; i < n->child_count; i++) {
+        AstNode* s = n->children[i];
+        if (s->type == AST_CONTINUE) ast_insert(n, i++, ast_clone(incr));
+        else if (s->type != AST_WHILE && s->type != AST_FOR) for_continue_incr(s, incr);
+    }
+}
+
+// Can `last + step` still be held by `t`? A loop whose variable wraps never ends.
+static int for_step_fits(long last, long step, Type* t) {
+    int bits = type_size(t) * 8;
+    if (type_is_unsigned(t)) {
+        unsigned long next = (unsigned long)last + (unsigned long)step;
+        if (step > 0 ? next < (unsigned long)last : next > (unsigned long)last) return 0;
+        return bits == 64 || next >> bits == 0;
+    }
+    long next;
+    if (__builtin_add_overflow(last, step, &next)) return 0;
+    return bits == 64 || (next >= -(1L << (bits - 1)) && next < (1L << (bits - 1)));
+}
+
+// Lower the for loop at block->children[at] in place:
+//     let i = a; let __forN = b; while (i < __forN) { body; i = i + s; }
+// with <= for a..=b and > / >= for a negative step. The bound is evaluated
+// once; a constant one is compared directly and, with a constant start,
+// gives the loop a `trip` attribute. `continue` runs the increment first.
+static void check_for(Checker* c, AstNode* block, int at) {
+    AstNode* f = block->children[at];
+    AstNode* lo = f->children[0];
+    AstNode* hi = f->children[1];
+    AstNode* body = f->children[f->child_count - 1];
+    Type* lt = check_expr(c, lo);
+    Type* ht = check_expr(c, hi);
+    if (lt->kind != TY_INT || ht->kind != TY_INT) {
+        type_error("for range over %s and %s", type_name(lt), type_name(ht));
+    }
+    long step = 1, a, b;
+    if (f->child_count > 3 && !const_value(c->prog, f->children[2], &step)) {
+        type_error("for step must be an integer constant");
+    }
+    if (step == 0) type_error("for step is zero");
+
+    // An existing variable (one flat scope per function) is reused
+    Type* ty = check_local(c, f->name);
+    AstNode* g = ty ? NULL : check_global(c, f->name);
+    if (g) ty = g->ty;
+    AstNode* init;
+    if (ty) {
+        init = ast_assign(f->name, lo);
+    } else {
+        ty = type_arith(lt, ht);
+        init = ast_let(f->name, lo);
+        init->ty = ty;
+    }
+    if (ty->kind != TY_INT) type_error("for variable %s of type %s", f->name, type_name(ty));
+    ast_insert(block, at++, init);
+
+    AstNode* end = hi;
+    if (!const_value(c->prog, hi, &b)) {
+        char name[32];
+        sprintf(name, "__for%d", c->for_count++);
+        AstNode* let = ast_let(name, hi);
+        let->ty = ht;
+        ast_insert(block, at++, let);
+        end = ast_ident(name);
+    }
+    int inclusive = !strcmp(f->op, "..=");
+    AstNode* cond = ast_new(AST_COMPARE);
+    cond->op = strdup(step > 0 ? (inclusive ? "<=" : "<") : (inclusive ? ">=" : ">"));
+    ast_add(cond, ast_ident(f->name));
+    ast_add(cond, end);
+    AstNode* incr = ast_assign(f->name, ast_binop(step > 0 ? "+" : "-", ast_ident(f->name), ast_num(step > 0 ? step : -step)));
+    for_continue_incr(body, incr);
+    ast_add(body, incr);
+
+    AstNode* w = ast_new(AST_WHILE);
+    w->name = f->name;  // Marks a lowered for loop in the loop report
+    w->line = f->line;
+    w->attrs = f->attrs;
+    w->attr_count = f->attr_count;
+    ast_add(w, cond);
+    ast_add(w, body);
+    block->children[at] = w;
+
+    if (end == hi && const_value(c->prog, lo, &a)) {
+        long trip = loop_trip_count(a, cond->op, b, step, type_is_unsigned(ty));
+        if (trip > 0 && !for_step_fits(a + (trip - 1) * step, step, ty)) {
+            type_error("for loop at line %d never ends: %s wraps past %ld%s%ld", f->line, type_name(ty), a, f->op, b);
+        }
+        ast_add_attr(w, "trip", ast_num(trip));
+    }
+}
+
+static void check_stmt(Checker* c, AstNode* n) {
+    switch (n->type) {
+    case AST_LET: {
+        Type* init = n->child_count > 0 ? check_expr(c, n->children[0]) : NULL;
+        // A redeclared local (one flat scope per function) keeps its slot and type
+        Type* prev = check_local(c, n->name);
+        if (!n->ty) n->ty = prev ? prev : init ? init : type_int(4);
+        type_resolve(c->types, n->ty);
+        if (prev && !type_equal(prev, n->ty)) {
+            type_error("%s redeclared in %s as %s, was %s", n->name, c->func->name, type_name(n->ty), type_name(prev));
+        }
+        if (init && init->kind != TY_ARRAY) check_assignable(n->ty, init, n->name);
+        n->is_pointer = n->ty->kind == TY_PTR;
+        if (n->ty->kind == TY_ARRAY) n->array_size = n->ty->length;
+        check_declare(c, n->name, n->ty);
+        break;
+    }
+    case AST_ASSIGN:
+        check_writable(c, NULL, n->name);
+        n->is_global = check_global(c, n->name) != NULL;
+        check_assignable(check_lookup(c, n->name), check_expr(c, n->children[0]), n->name);
+        for (int i = 1; i < n->child_count; i++) check_expr(c, n->children[i]);
+        break;
+    case AST_STORE:
+        check_writable(c, n->children[0], NULL);
+        check_assignable(check_expr(c, n->children[0]), check_expr(c, n->children[1]), "store");
+        break;
+    case AST_IF:
+        check_expr(c, n->children[0]);
+        for (int i = 1; i < n->child_count; i++) check_stmt(c, n->children[i]);
+        break;
+    case AST_WHILE: {
+        Attribute* unroll = ast_attr(n, "unroll");
+        long count;
+        if (unroll && !(unroll->arg && const_value(c->prog, unroll->arg, &count) && count >= 1)) {
+            type_error("@unroll needs a positive constant count");
+        }
+        if (unroll) unroll->arg = ast_num(count);
+        check_expr(c, n->children[0]);
+        c->loop_depth++;
+        check_stmt(c, n->children[1]);
+        c->loop_depth--;
+        break;
+    }
+    case AST_BLOCK:
+        for (int i = 0; i < n->child_count; i++) {
+            if (n->children[i]->type == AST_FOR) check_for(c, n, i);
+            check_stmt(c, n->children[i]);
+        }
+        break;
+    case AST_BREAK:
+    case AST_CONTINUE:
+        if (!c->loop_depth) type_error("%s outside a loop", n->type == AST_BREAK ? "break" : "continue");
+        break;
+    case AST_VECTOR_LOOP:
+        check_expr(c, n->children[0]);
+        check_stmt(c, n->children[1]);
+        check_expr(c, n->children[2]);
+        break;
+    case AST_MATCH: {
+        Type* t = check_expr(c, n->children[0]);
+        if (t->kind != TY_INT) type_error("match on %s", type_name(t));
+        int defaults = 0;
+        for (int i = 1; i < n->child_count; i++) {
+            AstNode* arm = n->children[i];
+            if (arm->child_count == 1 && ++defaults > 1) type_error("match has more than one _ arm");
+            for (int j = 0; j < arm->child_count - 1; j++) {
+                AstNode* p = arm->children[j];
+                for (int k = 0; k < (p->type == AST_RANGE ? 2 : 1); k++) {
+                    Type* pt = check_expr(c, p->type == AST_RANGE ? p->children[k] : p);
+                    if (pt->kind != TY_INT) type_error("match pattern of type %s", type_name(pt));
+                }
+            }
+            check_stmt(c, arm->children[arm->child_count - 1]);
+        }
+        break;
+    }
+    case AST_RETURN:
+        if (n->child_count > 0) check_expr(c, n->children[0]);
+        break;
+    default:
+        check_expr(c, n);
+        break;
+    }
+}
+
+void typecheck(AstNode* prog, TypeTable* types) {
+    Checker c;
+    memset(&c, 0, sizeof(c));
+    c.types = types;
+    c.prog = prog;
+    // Globals first, in order: an initializer sees only the globals above it
+    for (int i = 0; i < prog->child_count; i++) {
+        AstNode* g = prog->children[i];
+        if (g->type != AST_GLOBAL) continue;
+        Type* init = g->child_count > 0 ? check_expr(&c, g->children[0]) : NULL;
+        if (!g->ty) g->ty = init ? init : type_int(4);
+        type_resolve(types, g->ty);
+        if (init && init->kind != TY_ARRAY) check_assignable(g->ty, init, g->name);
+        g->is_pointer = g->ty->kind == TY_PTR;
+        c.global_count++;
+        c.globals = realloc(c.globals, sizeof(AstNode*) * c.global_count);
+        c.globals[c.global_count - 1] = g;
+    }
+    for (int i = 0; i < prog->child_count; i++) {
+        AstNode* f = prog->children[i];
+        if (f->type != AST_FUNCTION) continue;
+        c.func = f;
+        c.count = 0;
+        type_resolve(types, f->ty);
+        for (int j = 0; j < f->child_count - 1; j++) {
+            type_resolve(types, f->children[j]->ty);
+            check_declare(&c, f->children[j]->name, f->children[j]->ty);
+        }
+        check_stmt(&c, f->children[f->child_count - 1]);
+    }
+    free(c.names);
+    free(c.tys);
+    free(c.globals);
+}
+
+// ==== LOOP REPORT ====
+// -floop-report writes output.loops.json: the loops of each function in
+// source order with their line, nesting depth and, for a for loop with
+// constant bounds, the number of iterations. Each loop's bound says whether
+// it was declared with @bound or inferred (see LOOP BOUNDS). Taken before
+// optimization, so it describes the source rather than the rewritten loops.
+static void loop_report_walk(FILE* out, AstNode* prog, AstNode* n, int depth, int* count) {
+    for (int i = 0; i < n->child_count; i++) {
+        AstNode* c = n->children[i];
+        if (c->type == AST_WHILE) {
+            Attribute* trip = ast_attr(c, "trip");
+            Attribute* most = trip ? trip : ast_attr(c, "max_trip");
+            Attribute* declared = ast_attr(c, "bound");
+            long bound = -1, limit;
+            if (most) ast_is_num(most->arg, &bound);
+            const char* kind = most ? "inferred" : NULL;
+            // A trip count is exact and wins over a declared bound
+            if (declared && !trip && !const_value(prog, declared->arg, &limit)) {
+                if (!most) kind = "runtime";
+            } else if (declared && !trip && (bound < 0 || limit <= bound)) {
+                bound = limit;
+                kind = "declared";
+            }
+            fprintf(out, "%s\n        {\"line\": %d, \"kind\": \"%s\", ", (*count)++ ? "," : "",
+                    c->line, c->name ? "for" : "while");
+            if (c->name) fprintf(out, "\"var\": \"%s\", ", c->name);
+            fprintf(out, "\"depth\": %d, \"trip_count\": %s, \"bound\": ", depth, trip ? trip->arg->value : "null");
+            if (bound >= 0) fprintf(out, "%ld", bound);
+            else fprintf(out, "null");
+            if (kind) fprintf(out, ", \"bound_kind\": \"%s\"}", kind);
+            else fprintf(out, ", \"bound_kind\": null}");
+        }
+        loop_report_walk(out, prog, c, depth + (c->type == AST_WHILE), count);
+    }
+}
+
+void loop_report(AstNode* prog, const char* file) {
+    FILE* out = fopen(file, "w");
+    if (!out) { perror("Error"); exit(1); }
+    fprintf(out, "{\n  \"functions\": [");
+    int funcs = 0;
+    for (int i = 0; i < prog->child_count; i++) {
+        AstNode* f = prog->children[i];
+        if (f->type != AST_FUNCTION) continue;
+        fprintf(out, "%s\n    {\"name\": \"%s\", \"loops\": [", funcs++ ? "," : "", f->name);
+        int count = 0;
+        loop_report_walk(out, prog, f->children[f->child_count - 1], 1, &count);
+        fprintf(out, count ? "\n    ]}" : "]}");
+    }
+    fprintf(out, "\n  ]\n}\n");
+    fclose(out);
+}
+
+// ==== PROFILE ====
+// --profile-generate gives every function an entry counter and every `if`
+// two (times reached, times its then-block ran), numbered in source order
+// before optimization. The program adds its counts to the profile file at
+// exit. The file is a 16-byte header (magic "CHPF", version, counter count,
+// checksum of the numbering) followed by one little-endian i64 per counter.
+// --profile-use numbers the program the same way and reads the counts back.
+#define PROFILE_MAGIC 0x46504843
+#define PROFILE_VERSION 1
+
+static void profile_mix(Profile* p, const char* s) {
+    for (; *s; s++) p->checksum = p->checksum * 31 + (unsigned char)*s;
+    p->checksum = p->checksum * 31 + 1;
+}
+
+static void profile_walk(Profile* p, AstNode* n) {
+    if (n->type == AST_IF) {
+        n->prof = p->count + 1;
+        p->count += 2;
+        profile_mix(p, "if");
+    }
+    for (int i = 0; i < n->child_count; i++) profile_walk(p, n->children[i]);
+}
+
+void profile_number(Profile* p, AstNode* prog) {
+    for (int i = 0; i < prog->child_count; i++) {
+        AstNode* f = prog->children[i];
+        if (f->type != AST_FUNCTION) continue;
+        f->prof = ++p->count;
+        profile_mix(p, f->name);
+        profile_walk(p, f->children[f->child_count - 1]);
+    }
+}
+
+// A missing or mismatched profile only costs the layout, so it is a warning
+void profile_load(Profile* p, const char* file) {
+    FILE* in = fopen(file, "rb");
+    if (!in) {
+        fprintf(stderr, "Warning: cannot read profile %s, compiling without it\n", file);
+        return;
+    }
+    unsigned int header[4];
+    long* counts = malloc(sizeof(long) * p->count);
+    int ok = fread(header, sizeof(unsigned int), 4, in) == 4 && header[0] == PROFILE_MAGIC &&
+             header[1] == PROFILE_VERSION && header[2] == (unsigned int)p->count &&
+             header[3] == p->checksum && fread(counts, sizeof(long), p->count, in) == (size_t)p->count;
+    fclose(in);
+    if (!ok) {
+        fprintf(stderr, "Warning: profile %s does not match this program, compiling without it\n", file);
+        free(counts);
+        return;
+    }
+    p->counts = counts;
+}
+
+// Count `k` of the counters of n, -1 when there is no profile for it
+static long profile_count(Profile* p, AstNode* n, int k) {
+    if (!p || !p->counts || !n->prof) return -1;
+    return p->counts[n->prof - 1 + k];
+}
+
+// ==== CONST EVAL ====
+// Compile-time interpreter for pure integer code. A call whose arguments are
+// constants is replaced by its result: always for a `const fn`, and at -O1
+// for any function the interpreter finishes within its step budget. Reads
+// of scalar consts become literals. Results are memoized per function and
+// arguments, so recursive definitions such as fib evaluate in linear time.
+static const long CONST_EVAL_STEPS = 1000000;  // Per folded call
+static const int CONST_EVAL_DEPTH = 2000;      // Nested interpreted calls
+
+typedef struct ConstMemo {
+    AstNode* func;       // NULL for an empty slot
+    long args[6];        // Unused ones are 0
+    long value;
+} ConstMemo;
+
+typedef struct ConstEval {
+    AstNode* prog;
+    long steps;
+    int depth;
+    const char* failed;  // Why evaluation gave up, NULL while it succeeds
+    ConstMemo* memo;     // Open-addressed table of finished calls
+    int memo_cap;
+    int memo_count;
+    AstNode* global;     // The global whose initializer is being folded
+} ConstEval;
+
+// Variables of one interpreted call
+typedef struct ConstFrame {
+    char** names;
+    Type** tys;
+    long* values;
+    int count;
+    int returned;
+    long ret;
+    AstType jump;        // AST_BREAK / AST_CONTINUE leaving the loop body, 0 if none
+} ConstFrame;
+
+// Reduce `v` to a value of integer type `ty`, as a register holding it would
+static long const_wrap(long v, Type* ty) {
+    if (!ty || ty->kind != TY_INT || ty->size == 8) return v;
+    if (ty->size == 4) return ty->is_unsigned ? (long)(unsigned int)v : (long)(int)v;
+    if (ty->size == 2) return ty->is_unsigned ? (long)(unsigned short)v : (long)(short)v;
+    return ty->is_unsigned ? (long)(unsigned char)v : (long)(signed char)v;
+}
+
+static void const_fail(ConstEval* ev, const char* why) {
+    if (!ev->failed) ev->failed = why;
+}
+
+// The entry for f(args), or the empty slot where it belongs
+static ConstMemo* const_memo_slot(ConstEval* ev, AstNode* f, long* args) {
+    unsigned long h = (unsigned long)f;
+    for (int i = 0; i < 6; i++) h = h * 1000003 ^ (unsigned long)args[i];
+    for (int i = h % ev->memo_cap;; i = (i + 1) % ev->memo_cap) {
+        ConstMemo* m = &ev->memo[i];
+        if (!m->func || (m->func == f && !memcmp(m->args, args, sizeof(m->args)))) return m;
+    }
+}
+
+static void const_memo_add(ConstEval* ev, AstNode* f, long* args, long value) {
+    if ((ev->memo_count + 1) * 2 > ev->memo_cap) {
+        ConstMemo* old = ev->memo;
+        int old_cap = ev->memo_cap;
+        ev->memo_cap = old_cap ? old_cap * 2 : 64;
+        ev->memo = calloc(ev->memo_cap, sizeof(ConstMemo));
+        for (int i = 0; i < old_cap; i++) {
+            if (old[i].func) *const_memo_slot(ev, old[i].func, old[i].args) = old[i];
+        }
+        free(old);
+    }
+    ConstMemo* m = const_memo_slot(ev, f, args);
+    m->func = f;
+    memcpy(m->args, args, sizeof(m->args));
+    m->value = value;
+    ev->memo_count++;
+}
+
+static long* const_var(ConstFrame* fr, char* name, Type** ty) {
+    for (int i = 0; i < fr->count; i++) {
+        if (!strcmp(fr->names[i], name)) {
+            if (ty) *ty = fr->tys[i];
+            return &fr->values[i];
+        }
+    }
+    return NULL;
+}
+
+static void const_declare(ConstFrame* fr, char* name, Type* ty, long value) {
+    fr->count++;
+    fr->names = realloc(fr->names, sizeof(char*) * fr->count);
+    fr->tys = realloc(fr->tys, sizeof(Type*) * fr->count);
+    fr->values = realloc(fr->values, sizeof(long) * fr->count);
+    fr->names[fr->count - 1] = name;
+    fr->tys[fr->count - 1] = ty;
+    fr->values[fr->count - 1] = const_wrap(value, ty);
+}
+
+static long const_call(ConstEval* ev, AstNode* f, long* args, int argc);
+static void const_stmt(ConstEval* ev, ConstFrame* fr, AstNode* s);
+
+static long const_expr(ConstEval* ev, ConstFrame* fr, AstNode* e) {
+    if (ev->failed) return 0;
+    if (++ev->steps > CONST_EVAL_STEPS) {
+        const_fail(ev, "runs past the step budget");
+        return 0;
+    }
+    switch (e->type) {
+    case AST_NUMBER:
+        return const_wrap(atol(e->value), e->ty);
+    case AST_IDENT: {
+        long* v = fr ? const_var(fr, e->name, NULL) : NULL;
+        if (v) return *v;
+        AstNode* g = find_global(ev->prog, e->name);
+        if (!g || strcmp(g->op, "const") || g->ty->kind != TY_INT) {
+            const_fail(ev, "reads a variable");
+            return 0;
+        }
+        return const_wrap(const_expr(ev, NULL, g->children[0]), g->ty);
+    }
+    case AST_INDEX: {
+        // Lookup tables: an element of a const array literal
+        AstNode* arr = e->children[0];
+        AstNode* g = arr->type == AST_IDENT && (!fr || !const_var(fr, arr->name, NULL)) ?
+                     find_global(ev->prog, arr->name) : NULL;
+        long i = const_expr(ev, fr, e->children[1]);
+        if (!g || strcmp(g->op, "const") || g->children[0]->type != AST_ARRAY_LITERAL ||
+            g->ty->base->kind != TY_INT) {
+            const_fail(ev, "indexes memory");
+            return 0;
+        }
+        AstNode* lit = g->children[0];
+        if (i < 0 || i >= g->ty->length) {
+            const_fail(ev, "indexes out of bounds");
+            return 0;
+        }
+        return i < lit->child_count ? const_wrap(const_expr(ev, NULL, lit->children[i]), g->ty->base) : 0;
+    }
+    case AST_BINOP: {
+        // Operands are converted to the result type first, as in codegen
+        Type* t = e->ty;
+        long a = const_wrap(const_expr(ev, fr, e->children[0]), t);
+        long b = const_wrap(const_expr(ev, fr, e->children[1]), t);
+        unsigned long ua = a, ub = b;
+        switch (e->op[0]) {
+        case '+': return const_wrap((long)(ua + ub), t);
+        case '-': return const_wrap((long)(ua - ub), t);
+        case '*': return const_wrap((long)(ua * ub), t);
+        case '&': return a & b;
+        case '|': return a | b;
+        }
+        long min = type_size(t) == 8 ? (long)(1UL << 63) : -0x80000000L;
+        if (b == 0 || (!type_is_unsigned(t) && b == -1 && a == min)) {
+            const_fail(ev, "divides by zero or overflows");
+            return 0;
+        }
+        if (type_is_unsigned(t)) return const_wrap(e->op[0] == '/' ? (long)(ua / ub) : (long)(ua % ub), t);
+        return const_wrap(e->op[0] == '/' ? a / b : a % b, t);
+    }
+    case AST_COMPARE: {
+        Type* t = type_arith(e->children[0]->ty, e->children[1]->ty);
+        long a = const_wrap(const_expr(ev, fr, e->children[0]), t);
+        long b = const_wrap(const_expr(ev, fr, e->children[1]), t);
+        int u = type_is_unsigned(t);
+        int lt = u ? (unsigned long)a < (unsigned long)b : a < b;
+        int gt = u ? (unsigned long)a > (unsigned long)b : a > b;
+        if (!strcmp(e->op, "==")) return a == b;
+        if (!strcmp(e->op, "!=")) return a != b;
+        if (!strcmp(e->op, "<")) return lt;
+        if (!strcmp(e->op, ">")) return gt;
+        if (!strcmp(e->op, "<=")) return !gt;
+        return !lt;
+    }
+    case AST_CALL: {
+        AstNode* f = find_function(ev->prog, e->name);
+        if (!f || e->child_count > 6) {
+            const_fail(ev, "calls a builtin or external function");
+            return 0;
+        }
+        long args[6];
+        for (int i = 0; i < e->child_count; i++) args[i] = const_expr(ev, fr, e->children[i]);
+        return const_call(ev, f, args, e->child_count);
+    }
+    default:
+        const_fail(ev, "uses an operation without a constant value");
+        return 0;
+    }
+}
+
+// Does pattern `p` of a match on a value of type `ty` cover v?
+static int const_pattern_has(ConstEval* ev, ConstFrame* fr, AstNode* p, long v, Type* ty) {
+    int u = type_is_unsigned(ty);
+    if (p->type != AST_RANGE) return const_expr(ev, fr, p) == v;
+    long lo = const_expr(ev, fr, p->children[0]);
+    long hi = const_expr(ev, fr, p->children[1]);
+    if (!match_less(v, lo, u) && (match_less(v, hi, u) || (v == hi && !strcmp(p->op, "..=")))) return 1;
+    return 0;
+}
+
+static void const_stmt(ConstEval* ev, ConstFrame* fr, AstNode* s) {
+    if (ev->failed || fr->returned || fr->jump) return;
+    switch (s->type) {
+    case AST_LET: {
+        if (s->ty->kind != TY_INT) {
+            const_fail(ev, "declares a non-integer local");
+            return;
+        }
+        long v = s->child_count > 0 ? const_expr(ev, fr, s->children[0]) : 0;
+        long* slot = const_var(fr, s->name, NULL);
+        if (slot) *slot = const_wrap(v, s->ty);
+        else const_declare(fr, s->name, s->ty, v);
+        break;
+    }
+    case AST_ASSIGN: {
+        Type* ty;
+        long* slot = const_var(fr, s->name, &ty);
+        long v = const_expr(ev, fr, s->children[0]);
+        if (!slot) const_fail(ev, "writes a global");
+        else *slot = const_wrap(v, ty);
+        break;
+    }
+    case AST_IF:
+        if (const_expr(ev, fr, s->children[0])) const_stmt(ev, fr, s->children[1]);
+        else if (s->child_count > 2) const_stmt(ev, fr, s->children[2]);
+        break;
+    case AST_WHILE:
+        while (!ev->failed && !fr->returned && const_expr(ev, fr, s->children[0])) {
+            const_stmt(ev, fr, s->children[1]);
+            AstType jump = fr->jump;
+            fr->jump = 0;
+            if (jump == AST_BREAK) break;
+        }
+        break;
+    case AST_BREAK:
+    case AST_CONTINUE:
+        fr->jump = s->type;
+        break;
+    case AST_BLOCK:
+        for (int i = 0; i < s->child_count; i++) const_stmt(ev, fr, s->children[i]);
+        break;
+    case AST_MATCH: {
+        long v = const_expr(ev, fr, s->children[0]);
+        AstNode* chosen = NULL;
+        AstNode* fallback = NULL;
+        for (int i = 1; i < s->child_count && !chosen; i++) {
+            AstNode* arm = s->children[i];
+            if (arm->child_count == 1) fallback = arm;
+            for (int j = 0; j < arm->child_count - 1 && !chosen; j++) {
+                if (const_pattern_has(ev, fr, arm->children[j], v, s->children[0]->ty)) chosen = arm;
+            }
+        }
+        if (!chosen) chosen = fallback;
+        if (chosen) const_stmt(ev, fr, chosen->children[chosen->child_count - 1]);
+        break;
+    }
+    case AST_RETURN:
+        fr->ret = s->child_count > 0 ? const_expr(ev, fr, s->children[0]) : 0;
+        fr->returned = 1;
+        break;
+    case AST_CALL:
+        const_expr(ev, fr, s);
+        break;
+    default:
+        const_fail(ev, "has a side effect");
+        break;
+    }
+}
+
+static long const_call(ConstEval* ev, AstNode* f, long* args, int argc) {
+    int param_count = f->child_count - 1;
+    if (ev->failed) return 0;
+    if (argc != param_count || f->ty->kind != TY_INT) {
+        const_fail(ev, "does not return an integer");
+        return 0;
+    }
+    if (ev->depth >= CONST_EVAL_DEPTH) {
+        const_fail(ev, "recurses too deep");
+        return 0;
+    }
+    long key[6] = {0};
+    for (int i = 0; i < param_count; i++) {
+        if (f->children[i]->ty->kind != TY_INT) const_fail(ev, "takes a non-integer parameter");
+        key[i] = const_wrap(args[i], f->children[i]->ty);
+    }
+    ConstMemo* m = ev->memo_cap ? const_memo_slot(ev, f, key) : NULL;
+    if (m && m->func) return m->value;
+
+    ConstFrame fr;
+    memset(&fr, 0, sizeof(fr));
+    for (int i = 0; i < param_count; i++) const_declare(&fr, f->children[i]->name, f->children[i]->ty, key[i]);
+
+    ev->depth++;
+    const_stmt(ev, &fr, f->children[param_count]);
+    ev->depth--;
+    long value = const_wrap(fr.returned ? fr.ret : 0, f->ty);  // Falling off the end returns 0
+    free(fr.names);
+    free(fr.tys);
+    free(fr.values);
+    if (!ev->failed) const_memo_add(ev, f, key, value);
+    return value;
+}
+
+// Evaluate `e` (no variables in scope) with a fresh budget
+int const_eval(ConstEval* ev, AstNode* e, long* value) {
+    ev->steps = 0;
+    ev->depth = 0;
+    ev->failed = NULL;
+    *value = const_expr(ev, NULL, e);
+    return !ev->failed;
+}
+
+static AstNode* const_literal(long value, Type* ty) {
+    AstNode* n = ast_num(value);
+    n->ty = ty;  // Keeps the type of the expression it replaces
+    return n;
+}
+
+// Match patterns must be constants at every level; `a..b` becomes `a..=b-1`
+static AstNode* fold_pattern(ConstEval* ev, AstNode* p) {
+    long v;
+    if (!const_eval(ev, p, &v)) {
+        fprintf(stderr, "Error: match pattern is not a constant: it %s\n", ev->failed);
+        exit(1);
+    }
+    return const_literal(v, p->ty);
+}
+
+static void fold_match_arm(ConstEval* ev, AstNode* arm, Type* subject) {
+    for (int i = 0; i < arm->child_count - 1; i++) {
+        AstNode* p = arm->children[i];
+        if (p->type != AST_RANGE) {
+            ast_replace(p, fold_pattern(ev, p));
+            continue;
+        }
+        AstNode* lo = fold_pattern(ev, p->children[0]);
+        AstNode* hi = fold_pattern(ev, p->children[1]);
+        // fold_pattern returns number literals
+        long a = atol(lo->value), b = atol(hi->value);
+        int inclusive = !strcmp(p->op, "..=");
+        if (match_less(b, a, type_is_unsigned(subject)) || (!inclusive && a == b)) {
+            fprintf(stderr, "Error: match range %ld%s%ld is empty\n", a, p->op, b);
+            exit(1);
+        }
+        if (!inclusive) {
+            hi = const_literal(b - 1, hi->ty);
+            p->op = "..=";
+        }
+        p->children[0] = lo;
+        p->children[1] = hi;
+    }
+}
+
+static void fold_walk(ConstEval* ev, AstNode* n, int opt_level) {
+    if (n->type == AST_ADDR_OF) return;  // &K needs the const's storage
+    for (int i = 1; n->type == AST_MATCH && i < n->child_count; i++) {
+        fold_match_arm(ev, n->children[i], n->children[0]->ty);
+    }
+    for (int i = 0; i < n->child_count; i++) fold_walk(ev, n->children[i], opt_level);
+    long v;
+    if (n->type == AST_IDENT && n->child_count == 0 && n->is_global && n->ty->kind == TY_INT) {
+        AstNode* g = find_global(ev->prog, n->name);
+        if (!strcmp(g->op, "const") && const_eval(ev, n, &v)) ast_replace(n, const_literal(v, n->ty));
+        return;
+    }
+    if (n->type == AST_MATCH) match_cases(n, NULL);  // Reject overlapping patterns now
+    if (n->type != AST_CALL) return;
+    AstNode* f = find_function(ev->prog, n->name);
+    if (!f || (opt_level < 1 && !ast_attr(f, "const"))) return;
+    for (int i = 0; i < n->child_count; i++) {
+        if (n->children[i]->type != AST_NUMBER) return;
+    }
+    if (const_eval(ev, n, &v)) {
+        ast_replace(n, const_literal(v, n->ty));
+    } else if (ev->global) {
+        fprintf(stderr, "Error: initializer of %s is not a constant: %s %s\n", ev->global->name, f->name, ev->failed);
+        exit(1);
+    } else if (ast_attr(f, "const")) {
+        fprintf(stderr, "Error: const fn %s cannot be evaluated at compile time: it %s\n", f->name, ev->failed);
+        exit(1);
+    }
+}
+
+// Replace constant calls and const reads in initializers and function bodies
+void fold_constants(AstNode* prog, Options* opts) {
+    ConstEval ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.prog = prog;
+    for (int i = 0; i < prog->child_count; i++) {
+        AstNode* n = prog->children[i];
+        if (n->type == AST_GLOBAL && n->child_count > 0) {
+            ev.global = n;
+            fold_walk(&ev, n->children[0], 1);
+            ev.global = NULL;
+        } else if (n->type == AST_FUNCTION) {
+            fold_walk(&ev, n->children[n->child_count - 1], opts->opt_level);
+        }
+    }
+    free(ev.memo);
+}
+
+// ==== NAME SET ====
+typedef struct NameSet {
+    char** names;
+    int count;
+} NameSet;
+
+int nameset_has(NameSet* s, char* name) {
+    for (int i = 0; i < s->count; i++) {
+        if (!strcmp(s->names[i], name)) return 1;
+    }
+    return 0;
+}
+
+void nameset_add(NameSet* s, char* name) {
+    if (nameset_has(s, name)) return;
+    s->count++;
+    s->names = realloc(s->names, sizeof(char*) * s->count);
+    s->names[s->count - 1] = name;
+}
+
+// ==== CFG ====
+// Control-flow graph over the statements of one function body. Straight-line
+// statements live in blocks; if/while conditions terminate them.
+typedef struct BasicBlock {
+    AstNode** stmts;
+    int stmt_count;
+    AstNode* cond;       // Branch condition: succs[0] when true, succs[1] when false
+    AstNode* loop;       // AST_WHILE this block is the header of
+    int succs[2];
+    int succ_count;
+    int* preds;
+    int pred_count;
+    int idom;            // Immediate dominator, -1 if unreachable
+    int rpo;             // Reverse post-order index, -1 if unreachable
+} BasicBlock;
+
+typedef struct Loop {
+    AstNode* node;       // AST_WHILE
+    int header;
+    int exit;            // Block control reaches when the condition fails
+    char* body;          // Membership flag per block (natural loop)
+    int* latches;        // Sources of back edges into the header
+    int latch_count;
+    int depth;
+} Loop;
+
+typedef struct Cfg {
+    BasicBlock* blocks;
+    int count;
+    int entry;
+    int exit;
+    int* order;          // Reachable blocks in reverse post-order
+    int order_count;
+    Loop* loops;
+    int loop_count;
+    int break_to;        // Exit and header of the innermost loop being built, -1 outside
+    int continue_to;
+} Cfg;
+
+int cfg_new_block(Cfg* cfg) {
+    cfg->count++;
+    cfg->blocks = realloc(cfg->blocks, sizeof(BasicBlock) * cfg->count);
+    BasicBlock* b = &cfg->blocks[cfg->count - 1];
+    memset(b, 0, sizeof(BasicBlock));
+    b->idom = -1;
+    b->rpo = -1;
+    return cfg->count - 1;
+}
+
+void cfg_edge(Cfg* cfg, int from, int to) {
+    BasicBlock* f = &cfg->blocks[from];
+    f->succs[f->succ_count++] = to;
+    BasicBlock* t = &cfg->blocks[to];
+    t->pred_count++;
+    t->preds = realloc(t->preds, sizeof(int) * t->pred_count);
+    t->preds[t->pred_count - 1] = from;
+}
+
+void cfg_add_stmt(Cfg* cfg, int b, AstNode* stmt) {
+    BasicBlock* bb = &cfg->blocks[b];
+    bb->stmt_count++;
+    bb->stmts = realloc(bb->stmts, sizeof(AstNode*) * bb->stmt_count);
+    bb->stmts[bb->stmt_count - 1] = stmt;
+}
+
+// Append the statements of an AST block starting in block `cur`;
+// returns the block control falls out of.
+int cfg_build_stmts(Cfg* cfg, AstNode* block, int cur) {
+    for (int i = 0; i < block->child_count; i++) {
+        AstNode* s = block->children[i];
+        if (s->type == AST_IF) {
+            int then_b = cfg_new_block(cfg);
+            int else_b = cfg_new_block(cfg);
+            cfg->blocks[cur].cond = s->children[0];
+            cfg_edge(cfg, cur, then_b);
+            cfg_edge(cfg, cur, else_b);
+            int then_end = cfg_build_stmts(cfg, s->children[1], then_b);
+            int else_end = s->child_count > 2 ? cfg_build_stmts(cfg, s->children[2], else_b) : else_b;
+            int join = cfg_new_block(cfg);
+            cfg_edge(cfg, then_end, join);
+            cfg_edge(cfg, else_end, join);
+            cur = join;
+        } else if (s->type == AST_WHILE) {
+            int header = cfg_new_block(cfg);
+            cfg_edge(cfg, cur, header);
+            int body = cfg_new_block(cfg);
+            int exit = cfg_new_block(cfg);
+            cfg->blocks[header].cond = s->children[0];
+            cfg->blocks[header].loop = s;
+            cfg_edge(cfg, header, body);
+            cfg_edge(cfg, header, exit);
+            int outer_break = cfg->break_to, outer_continue = cfg->continue_to;
+            cfg->break_to = exit;
+            cfg->continue_to = header;
+            int body_end = cfg_build_stmts(cfg, s->children[1], body);
+            cfg->break_to = outer_break;
+            cfg->continue_to = outer_continue;
+            cfg_edge(cfg, body_end, header);
+            cur = exit;
+        } else if (s->type == AST_MATCH) {
+            // A chain of two-way tests, one per arm; the subject is read by the first
+            int join = cfg_new_block(cfg);
+            int test = cur;
+            cfg->blocks[cur].cond = s->children[0];
+            for (int j = 1; j < s->child_count; j++) {
+                int arm = cfg_new_block(cfg);
+                int next = j + 1 < s->child_count ? cfg_new_block(cfg) : join;
+                cfg_edge(cfg, test, arm);
+                cfg_edge(cfg, test, next);
+                AstNode* arm_node = s->children[j];
+                cfg_edge(cfg, cfg_build_stmts(cfg, arm_node->children[arm_node->child_count - 1], arm), join);
+                test = next;
+            }
+            if (s->child_count == 1) cfg_edge(cfg, cur, join);
+            cur = join;
+        } else if (s->type == AST_RETURN) {
+            cfg_add_stmt(cfg, cur, s);
+            cfg_edge(cfg, cur, cfg->exit);
+            cur = cfg_new_block(cfg);  // Unreachable continuation
+        } else if (s->type == AST_BREAK || s->type == AST_CONTINUE) {
+            cfg_edge(cfg, cur, s->type == AST_BREAK ? cfg->break_to : cfg->continue_to);
+            cur = cfg_new_block(cfg);
+        } else {
+            cfg_add_stmt(cfg, cur, s);
+        }
+    }
+    return cur;
+}
+
+static void cfg_postorder(Cfg* cfg, int b, char* seen, int* post, int* n) {
+    seen[b] = 1;
+    for (int i = 0; i < cfg->blocks[b].succ_count; i++) {
+        int s = cfg->blocks[b].succs[i];
+        if (!seen[s]) cfg_postorder(cfg, s, seen, post, n);
+    }
+    post[(*n)++] = b;
+}
+
+static int cfg_intersect(Cfg* cfg, int a, int b) {
+    while (a != b) {
+        while (cfg->blocks[a].rpo > cfg->blocks[b].rpo) a = cfg->blocks[a].idom;
+        while (cfg->blocks[b].rpo > cfg->blocks[a].rpo) b = cfg->blocks[b].idom;
+    }
+    return a;
+}
+
+// Iterative dominator computation (Cooper, Harvey, Kennedy)
+void cfg_compute_dominators(Cfg* cfg) {
+    char* seen = calloc(cfg->count, 1);
+    int* post = malloc(sizeof(int) * cfg->count);
+    int n = 0;
+    cfg_postorder(cfg, cfg->entry, seen, post, &n);
+
+    cfg->order = malloc(sizeof(int) * n);
+    cfg->order_count = n;
+    for (int i = 0; i < n; i++) {
+        cfg->order[i] = post[n - 1 - i];
+        cfg->blocks[cfg->order[i]].rpo = i;
+    }
+    free(seen);
+    free(post);
+
+    cfg->blocks[cfg->entry].idom = cfg->entry;
+    int changed = 1;
+    while (changed) {
+        changed = 0;
+        for (int i = 1; i < cfg->order_count; i++) {
+            BasicBlock* b = &cfg->blocks[cfg->order[i]];
+            int new_idom = -1;
+            for (int j = 0; j < b->pred_count; j++) {
+                int p = b->preds[j];
+                if (cfg->blocks[p].idom < 0) continue;
+                new_idom = new_idom < 0 ? p : cfg_intersect(cfg, p, new_idom);
+            }
+            if (b->idom != new_idom) {
+                b->idom = new_idom;
+                changed = 1;
+            }
+        }
+    }
+}
+
+int cfg_dominates(Cfg* cfg, int a, int b) {
+    if (cfg->blocks[b].rpo < 0) return 0;
+    while (b != a) {
+        if (b == cfg->entry) return 0;
+        b = cfg->blocks[b].idom;
+    }
+    return 1;
+}
+
+// Natural loops: one per header, from back edges u -> h where h dominates u
+void cfg_find_loops(Cfg* cfg) {
+    for (int i = 0; i < cfg->order_count; i++) {
+        int u = cfg->order[i];
+        for (int j = 0; j < cfg->blocks[u].succ_count; j++) {
+            int h = cfg->blocks[u].succs[j];
+            if (!cfg_dominates(cfg, h, u)) continue;
+
+            Loop* loop = NULL;
+            for (int k = 0; k < cfg->loop_count; k++) {
+                if (cfg->loops[k].header == h) loop = &cfg->loops[k];
+            }
+            if (!loop) {
+                cfg->loop_count++;
+                cfg->loops = realloc(cfg->loops, sizeof(Loop) * cfg->loop_count);
+                loop = &cfg->loops[cfg->loop_count - 1];
+                memset(loop, 0, sizeof(Loop));
+                loop->node = cfg->blocks[h].loop;
+                loop->header = h;
+                loop->exit = cfg->blocks[h].succ_count > 1 ? cfg->blocks[h].succs[1] : -1;
+                loop->body = calloc(cfg->count, 1);
+                loop->body[h] = 1;
+            }
+            loop->latch_count++;
+            loop->latches = realloc(loop->latches, sizeof(int) * loop->latch_count);
+            loop->latches[loop->latch_count - 1] = u;
+
+            // Walk predecessors back from the latch up to the header
+            int* work = malloc(sizeof(int) * cfg->count);
+            int top = 0;
+            if (!loop->body[u]) { loop->body[u] = 1; work[top++] = u; }
+            while (top > 0) {
+                int b = work[--top];
+                for (int k = 0; k < cfg->blocks[b].pred_count; k++) {
+                    int p = cfg->blocks[b].preds[k];
+                    if (!loop->body[p] && cfg->blocks[p].rpo >= 0) {
+                        loop->body[p] = 1;
+                        work[top++] = p;
+                    }
+                }
+            }
+            free(work);
+        }
+    }
+
+    for (int i = 0; i < cfg->loop_count; i++) {
+        for (int j = 0; j < cfg->loop_count; j++) {
+            if (cfg->loops[j].body[cfg->loops[i].header]) cfg->loops[i].depth++;
+        }
+    }
+}
+
+Cfg* cfg_build(AstNode* body) {
+    Cfg* cfg = calloc(1, sizeof(Cfg));
+    cfg->break_to = cfg->continue_to = -1;
+    cfg->entry = cfg_new_block(cfg);
+    cfg->exit = cfg_new_block(cfg);
+    int end = cfg_build_stmts(cfg, body, cfg->entry);
+    cfg_edge(cfg, end, cfg->exit);
+    cfg_compute_dominators(cfg);
+    cfg_find_loops(cfg);
+    return cfg;
+}
+
+void cfg_free(Cfg* cfg) {
+    for (int i = 0; i < cfg->count; i++) {
+        free(cfg->blocks[i].stmts);
+        free(cfg->blocks[i].preds);
+    }
+    for (int i = 0; i < cfg->loop_count; i++) {
+        free(cfg->loops[i].body);
+        free(cfg->loops[i].latches);
+    }
+    free(cfg->blocks);
+    free(cfg->order);
+    free(cfg->loops);
+    free(cfg);
+}
+
+int cfg_block_of(Cfg* cfg, AstNode* stmt) {
+    for (int i = 0; i < cfg->count; i++) {
+        for (int j = 0; j < cfg->blocks[i].stmt_count; j++) {
+            if (cfg->blocks[i].stmts[j] == stmt) return i;
+        }
+    }
+    return -1;
+}
+
+static int cfg_live_from(Cfg* cfg, int b, char* name, char* visited) {
+    if (visited[b]) return 0;
+    visited[b] = 1;
+    BasicBlock* bb = &cfg->blocks[b];
+    for (int i = 0; i < bb->stmt_count; i++) {
+        AstNode* s = bb->stmts[i];
+        if (ast_uses(s, name)) return 1;
+        if ((s->type == AST_ASSIGN || s->type == AST_LET) && !strcmp(s->name, name)) return 0;
+    }
+    if (bb->cond && ast_uses(bb->cond, name)) return 1;
+    for (int i = 0; i < bb->succ_count; i++) {
+        if (cfg_live_from(cfg, bb->succs[i], name, visited)) return 1;
+    }
+    return 0;
+}
+
+// Is `name` read on some path starting at the top of block b?
+int cfg_var_live(Cfg* cfg, int b, char* name) {
+    char* visited = calloc(cfg->count, 1);
+    int live = cfg_live_from(cfg, b, name, visited);
+    free(visited);
+    return live;
+}
+
+// ==== LOOP OPTIMIZER ====
+// Loop-invariant code motion and induction-variable strength reduction.
+// Hoisted values and derived induction variables become hidden `__` locals
+// initialized just before the loop (its preheader).
+typedef struct Optimizer {
+    Options* opts;
+    int temp_count;
+    AstNode** done;      // Loops already optimized
+    int done_count;
+    struct Effects* effects;  // What each function may do (see PURITY)
+} Optimizer;
+
+int call_known_readonly(struct Effects* fx, AstNode* call);
+int call_hoistable(struct Effects* fx, AstNode* call);
+void effects_note_hoist(struct Effects* fx, AstNode* e);
+
+typedef struct LoopOpt {
+    Optimizer* opt;
+    Cfg* cfg;
+    Loop* loop;
+    NameSet defs;        // Variables written inside the loop
+    NameSet escaped;     // Variables whose address is taken in the function, and globals
+    NameSet arrays;      // Arrays declared in the function or global ones it uses
+    int has_unknown_store;
+    AstNode* preheader;  // Statements to insert before the loop
+    AstNode* func_body;
+    AstNode** hoisted;   // Hoisted expressions and the temps holding them
+    char** hoisted_names;
+    int hoisted_count;
+} LoopOpt;
+
+char* opt_temp(Optimizer* opt, const char* prefix) {
+    char* name = malloc(32);
+    sprintf(name, "__%s%d", prefix, opt->temp_count++);
+    return name;
+}
+
+static void collect_function_facts(AstNode* n, NameSet* escaped, NameSet* arrays) {
+    // Calls and stores through pointers may reach any global scalar; a
+    // global array is a distinct object just like a local one
+    if ((n->type == AST_IDENT || n->type == AST_ASSIGN) && n->is_global) {
+        if (n->ty && n->ty->kind == TY_ARRAY) nameset_add(arrays, n->name);
+        else nameset_add(escaped, n->name);
+    }
+    if (n->type == AST_ADDR_OF) {
+        AstNode* target = n->children[0];
+        if (target->type == AST_IDENT) nameset_add(escaped, target->name);
+        if (target->type == AST_INDEX) nameset_add(escaped, target->children[0]->name);
+    }
+    if (n->type == AST_LET && !n->is_pointer &&
+        (n->array_size > 0 || (n->child_count > 0 && n->children[0]->type == AST_ARRAY_LITERAL))) {
+        nameset_add(arrays, n->name);
+    }
+    for (int i = 0; i < n->child_count; i++) collect_function_facts(n->children[i], escaped, arrays);
+}
+
+static void collect_loop_defs(LoopOpt* lo, AstNode* s) {
+    if (s->type == AST_ASSIGN || s->type == AST_LET) nameset_add(&lo->defs, s->name);
+    if (s->type == AST_STORE) {
+        AstNode* lv = s->children[0];
+        int known_array = lv->type == AST_INDEX && nameset_has(&lo->arrays, lv->children[0]->name);
+        if (!known_array) lo->has_unknown_store = 1;
+    }
+    if (s->type == AST_CALL && ast_has_call(s) && !call_known_readonly(lo->opt->effects, s)) {
+        lo->has_unknown_store = 1;
+    }
+    // Inlined bodies nest statements inside expressions
+    for (int i = 0; i < s->child_count; i++) collect_loop_defs(lo, s->children[i]);
+}
+
+int loop_invariant(LoopOpt* lo, AstNode* e) {
+    long v;
+    switch (e->type) {
+    case AST_NUMBER:
+        return 1;
+    case AST_IDENT:
+        return e->child_count == 0 && !nameset_has(&lo->defs, e->name) &&
+               !(nameset_has(&lo->escaped, e->name) && lo->has_unknown_store);
+    case AST_BINOP:
+        // Division may trap, so only hoist it by a constant that cannot
+        if ((e->op[0] == '/' || e->op[0] == '%') &&
+            !(ast_is_num(e->children[1], &v) && v != 0 && v != -1)) return 0;
+        return loop_invariant(lo, e->children[0]) && loop_invariant(lo, e->children[1]);
+    case AST_COMPARE:
+        return loop_invariant(lo, e->children[0]) && loop_invariant(lo, e->children[1]);
+    case AST_CALL:
+        // Only calls that may run even if the loop body never would
+        if (!call_hoistable(lo->opt->effects, e)) return 0;
+        for (int i = 0; i < e->child_count; i++) {
+            if (!loop_invariant(lo, e->children[i])) return 0;
+        }
+        return 1;
+    case AST_ADDR_OF:
+        // Address arithmetic on an array never touches memory
+        return e->children[0]->type == AST_INDEX &&
+               nameset_has(&lo->arrays, e->children[0]->children[0]->name) &&
+               !nameset_has(&lo->defs, e->children[0]->children[0]->name) &&
+               loop_invariant(lo, e->children[0]->children[1]);
+    default:
+        return 0;
+    }
+}
+
+// Name of the preheader temp holding `e`, hoisting it on first request
+char* licm_temp(LoopOpt* lo, AstNode* e) {
+    for (int i = 0; i < lo->hoisted_count; i++) {
+        if (ast_equal(lo->hoisted[i], e)) return lo->hoisted_names[i];
+    }
+    char* name = opt_temp(lo->opt, "licm");
+    AstNode* init = ast_clone(e);
+    AstNode* let = ast_let(name, init);
+    let->is_pointer = e->type == AST_ADDR_OF;
+    ast_add(lo->preheader, let);
+    effects_note_hoist(lo->opt->effects, init);
+
+    lo->hoisted_count++;
+    lo->hoisted = realloc(lo->hoisted, sizeof(AstNode*) * lo->hoisted_count);
+    lo->hoisted_names = realloc(lo->hoisted_names, sizeof(char*) * lo->hoisted_count);
+    lo->hoisted[lo->hoisted_count - 1] = init;
+    lo->hoisted_names[lo->hoisted_count - 1] = name;
+    return name;
+}
+
+// Replace maximal invariant subexpressions of `e` with preheader temps
+void licm_rewrite(LoopOpt* lo, AstNode* e) {
+    long a, b;
+    if (e->type == AST_BINOP && ast_is_num(e->children[0], &a) && ast_is_num(e->children[1], &b)) {
+        // Folded in the node's type, wrapping and signed or not as codegen would
+        Type* t = e->ty;
+        a = const_wrap(a, t);
+        b = const_wrap(b, t);
+        unsigned long ua = a, ub = b;
+        int u = type_is_unsigned(t);
+        if ((e->op[0] == '/' || e->op[0] == '%') && (b == 0 || (!u && b == -1))) {
+            for (int i = 0; i < e->child_count; i++) licm_rewrite(lo, e->children[i]);
+            return;
+        }
+        long r = e->op[0] == '+' ? (long)(ua + ub) : e->op[0] == '-' ? (long)(ua - ub) :
+                 e->op[0] == '*' ? (long)(ua * ub) : e->op[0] == '&' ? (a & b) : e->op[0] == '|' ? (a | b) :
+                 u ? (long)(e->op[0] == '%' ? ua % ub : ua / ub) : e->op[0] == '%' ? a % b : a / b;
+        ast_replace(e, const_literal(const_wrap(r, t), t));
+        return;
+    }
+    if ((e->type == AST_BINOP || e->type == AST_COMPARE || e->type == AST_ADDR_OF || e->type == AST_CALL) &&
+        loop_invariant(lo, e)) {
+        ast_replace(e, ast_ident(licm_temp(lo, e)));
+        return;
+    }
+    for (int i = 0; i < e->child_count; i++) licm_rewrite(lo, e->children[i]);
+}
+
+// Rewrite the expressions of a statement, leaving its assignment target alone
+void licm_rewrite_stmt(LoopOpt* lo, AstNode* s) {
+    if (s->type == AST_STORE) {
+        AstNode* lv = s->children[0];
+        for (int i = 0; i < lv->child_count; i++) {
+            if (lv->type != AST_INDEX || i > 0) licm_rewrite(lo, lv->children[i]);
+        }
+        licm_rewrite(lo, s->children[1]);
+        return;
+    }
+    for (int i = 0; i < s->child_count; i++) licm_rewrite(lo, s->children[i]);
+}
+
+// ---- Induction variables ----
+typedef struct InductionVar {
+    char* name;
+    AstNode* incr;       // The single `v = v + step` statement
+    AstNode* step;       // NUMBER or loop-invariant IDENT
+} InductionVar;
+
+// Recognize `v = v + s`, `v = s + v` or `v = v - c`
+static AstNode* iv_step(LoopOpt* lo, AstNode* s) {
+    if (s->type != AST_ASSIGN || s->children[0]->type != AST_BINOP) return NULL;
+    AstNode* rhs = s->children[0];
+    AstNode* l = rhs->children[0];
+    AstNode* r = rhs->children[1];
+    int l_is_v = l->type == AST_IDENT && !strcmp(l->name, s->name);
+    int r_is_v = r->type == AST_IDENT && !strcmp(r->name, s->name);
+    if (rhs->op[0] == '+') {
+        if (l_is_v && (r->type == AST_NUMBER || r->type == AST_IDENT) && loop_invariant(lo, r)) return r;
+        if (r_is_v && (l->type == AST_NUMBER || l->type == AST_IDENT) && loop_invariant(lo, l)) return l;
+    }
+    long c;
+    if (rhs->op[0] == '-' && l_is_v && ast_is_num(r, &c)) return ast_num(-c);
+    return NULL;
+}
+
+static int count_defs(LoopOpt* lo, char* name) {
+    int defs = 0;
+    for (int b = 0; b < lo->cfg->count; b++) {
+        if (!lo->loop->body[b]) continue;
+        for (int i = 0; i < lo->cfg->blocks[b].stmt_count; i++) {
+            AstNode* s = lo->cfg->blocks[b].stmts[i];
+            if ((s->type == AST_ASSIGN || s->type == AST_LET) && !strcmp(s->name, name)) defs++;
+        }
+    }
+    return defs;
+}
+
+int find_induction_vars(LoopOpt* lo, InductionVar* ivs, int max) {
+    int count = 0;
+    AstNode* body = lo->loop->node->children[1];
+    for (int i = 0; i < body->child_count && count < max; i++) {
+        AstNode* s = body->children[i];
+        AstNode* step = iv_step(lo, s);
+        if (!step || nameset_has(&lo->escaped, s->name) || count_defs(lo, s->name) != 1) continue;
+
+        // The increment must run on every iteration that reaches a latch
+        int b = cfg_block_of(lo->cfg, s);
+        int every_iteration = b >= 0;
+        for (int j = 0; j < lo->loop->latch_count; j++) {
+            if (!cfg_dominates(lo->cfg, b, lo->loop->latches[j])) every_iteration = 0;
+        }
+        if (!every_iteration) continue;
+
+        ivs[count].name = s->name;
+        ivs[count].incr = s;
+        ivs[count].step = step;
+        count++;
+    }
+    return count;
+}
+
+// Derived induction expressions: arr[v], v * inv and v * v
+typedef struct DerivedIv {
+    AstNode* expr;       // Representative expression (a clone)
+    char* temp;
+    int kind;            // 0 = pointer to arr[v], 1 = v * inv, 2 = v * v
+} DerivedIv;
+
+static int derived_kind(LoopOpt* lo, InductionVar* iv, AstNode* e) {
+    if (e->type == AST_INDEX && e->children[0]->type == AST_IDENT &&
+        nameset_has(&lo->arrays, e->children[0]->name) &&
+        !nameset_has(&lo->defs, e->children[0]->name) &&
+        e->children[1]->type == AST_IDENT && !strcmp(e->children[1]->name, iv->name) &&
+        !type_is_soa(e->ty)) {
+        return 0;  // A @soa element has no address of its own
+    }
+    if (e->type == AST_BINOP && e->op[0] == '*') {
+        AstNode* l = e->children[0];
+        AstNode* r = e->children[1];
+        int l_is_v = l->type == AST_IDENT && !strcmp(l->name, iv->name);
+        int r_is_v = r->type == AST_IDENT && !strcmp(r->name, iv->name);
+        if (l_is_v && r_is_v) return iv->step->type == AST_NUMBER ? 2 : -1;
+        if (l_is_v && (r->type == AST_NUMBER || r->type == AST_IDENT) && loop_invariant(lo, r)) return 1;
+        if (r_is_v && (l->type == AST_NUMBER || l->type == AST_IDENT) && loop_invariant(lo, l)) return 1;
+    }
+    return -1;
+}
+
+static void strength_reduce_expr(LoopOpt* lo, InductionVar* iv, AstNode* e,
+                                 DerivedIv* derived, int* derived_count) {
+    int kind = derived_kind(lo, iv, e);
+    if (kind >= 0 && *derived_count < 16) {
+        DerivedIv* d = NULL;
+        for (int i = 0; i < *derived_count; i++) {
+            if (ast_equal(derived[i].expr, e)) d = &derived[i];
+        }
+        if (!d) {
+            d = &derived[(*derived_count)++];
+            d->expr = ast_clone(e);
+            d->kind = kind;
+            d->temp = opt_temp(lo->opt, "iv");
+            AstNode* init;
+            if (kind == 0) {
+                init = ast_new(AST_ADDR_OF);
+                ast_add(init, ast_clone(e));
+            } else {
+                init = ast_clone(e);
+            }
+            AstNode* let = ast_let(d->temp, init);
+            let->is_pointer = kind == 0;
+            ast_add(lo->preheader, let);
+        }
+        if (kind == 0) {
+            AstNode* deref = ast_new(AST_DEREF);
+            ast_add(deref, ast_ident(d->temp));
+            ast_replace(e, deref);
+        } else {
+            ast_replace(e, ast_ident(d->temp));
+        }
+        return;
+    }
+    for (int i = 0; i < e->child_count; i++) {
+        strength_reduce_expr(lo, iv, e->children[i], derived, derived_count);
+    }
+}
+
+// Per-iteration increment of a derived induction variable
+static AstNode* derived_step(LoopOpt* lo, InductionVar* iv, DerivedIv* d) {
+    long s = 0;
+    int const_step = ast_is_num(iv->step, &s);
+    if (d->kind == 0) {
+        int size = type_size(d->expr->ty);
+        if (const_step) return ast_num(s * size);
+        return ast_ident(licm_temp(lo, ast_binop("*", ast_clone(iv->step), ast_num(size))));
+    }
+    if (d->kind == 1) {
+        AstNode* l = d->expr->children[0];
+        AstNode* factor = (l->type == AST_IDENT && !strcmp(l->name, iv->name)) ? d->expr->children[1] : l;
+        long f;
+        if (const_step && ast_is_num(factor, &f)) return ast_num(s * f);
+        return ast_ident(licm_temp(lo, ast_binop("*", ast_clone(iv->step), ast_clone(factor))));
+    }
+    // (v + s)^2 - v^2 with v already incremented: 2*s*v - s*s
+    if (s == 1) {
+        return ast_binop("-", ast_binop("+", ast_ident(iv->name), ast_ident(iv->name)), ast_num(1));
+    }
+    return ast_binop("-", ast_binop("*", ast_ident(iv->name), ast_num(2 * s)), ast_num(s * s));
+}
+
+// Constant value of v on entry, set by the statement just before the loop
+static int iv_start(LoopOpt* lo, InductionVar* iv, long* start) {
+    AstNode* parent = ast_find_parent(lo->func_body, lo->loop->node);
+    int at = parent ? ast_index_of(parent, lo->loop->node) : -1;
+    AstNode* prev = at > 0 ? parent->children[at - 1] : NULL;
+    return prev && (prev->type == AST_LET || prev->type == AST_ASSIGN) && !strcmp(prev->name, iv->name) &&
+           prev->child_count > 0 && ast_is_num(prev->children[0], start);
+}
+
+// Is v * f the same number once held by `t`?
+static int iv_product_fits(long v, long f, Type* t) {
+    long p;
+    return !__builtin_mul_overflow(v, f, &p) && const_wrap(p, t) == p;
+}
+
+// Linear-function test replacement: if v only feeds the exit test after
+// strength reduction and is dead after the loop, compare the derived
+// variable against a hoisted limit instead and delete v's increment.
+// v * inv must not wrap anywhere v goes, from its start to one step past
+// the bound, or the two tests would disagree.
+static void replace_iv_test(LoopOpt* lo, InductionVar* iv, DerivedIv* derived, int derived_count) {
+    AstNode* w = lo->loop->node;
+    AstNode* cond = w->children[0];
+    if (cond->type != AST_COMPARE) return;
+    int v_side = -1;
+    for (int i = 0; i < 2; i++) {
+        AstNode* c = cond->children[i];
+        if (c->type == AST_IDENT && !strcmp(c->name, iv->name) && loop_invariant(lo, cond->children[1 - i])) {
+            v_side = i;
+        }
+    }
+    if (v_side < 0) return;
+    if (ast_uses(w, iv->name) != 2) return;  // The test and the increment only
+    if (lo->loop->exit < 0 || cfg_var_live(lo->cfg, lo->loop->exit, iv->name)) return;
+
+    DerivedIv* d = NULL;
+    long f;
+    for (int i = 0; i < derived_count && !d; i++) {
+        if (derived[i].kind == 0) d = &derived[i];
+    }
+    for (int i = 0; i < derived_count && !d; i++) {
+        if (derived[i].kind != 1) continue;
+        AstNode* l = derived[i].expr->children[0];
+        AstNode* factor = (l->type == AST_IDENT && !strcmp(l->name, iv->name)) ? derived[i].expr->children[1] : l;
+        if (ast_is_num(factor, &f) && f > 0) d = &derived[i];
+    }
+    if (!d) return;
+
+    AstNode* bound = cond->children[1 - v_side];
+    AstNode* limit;
+    if (d->kind == 0) {
+        limit = ast_new(AST_ADDR_OF);
+        AstNode* idx = ast_new(AST_INDEX);
+        ast_add(idx, ast_clone(d->expr->children[0]));
+        ast_add(idx, ast_clone(bound));
+        ast_add(limit, idx);
+    } else {
+        long b, s, start, end;
+        Type* t = d->expr->ty;
+        if (!ast_is_num(bound, &b) || !ast_is_num(iv->step, &s) || !iv_start(lo, iv, &start) ||
+            __builtin_add_overflow(b, s, &end) || !iv_product_fits(start, f, t) || !iv_product_fits(end, f, t)) {
+            return;
+        }
+        limit = ast_num(b * f);
+    }
+    ast_replace(cond->children[v_side], ast_ident(d->temp));
+    ast_replace(cond->children[1 - v_side], ast_ident(licm_temp(lo, limit)));
+
+    AstNode* body = w->children[1];
+    ast_remove(body, ast_index_of(body, iv->incr));
+}
+
+void optimize_loop(Optimizer* opt, AstNode* func_body, Cfg* cfg, Loop* loop) {
+    LoopOpt lo;
+    memset(&lo, 0, sizeof(lo));
+    lo.opt = opt;
+    lo.cfg = cfg;
+    lo.loop = loop;
+    lo.preheader = ast_new(AST_BLOCK);
+    lo.func_body = func_body;
+    collect_function_facts(func_body, &lo.escaped, &lo.arrays);
+
+    for (int b = 0; b < cfg->count; b++) {
+        if (!loop->body[b]) continue;
+        for (int i = 0; i < cfg->blocks[b].stmt_count; i++) collect_loop_defs(&lo, cfg->blocks[b].stmts[i]);
+        if (cfg->blocks[b].cond) collect_loop_defs(&lo, cfg->blocks[b].cond);
+    }
+
+    // Hoist invariant computations
+    for (int b = 0; b < cfg->count; b++) {
+        if (!loop->body[b]) continue;
+        for (int i = 0; i < cfg->blocks[b].stmt_count; i++) licm_rewrite_stmt(&lo, cfg->blocks[b].stmts[i]);
+        if (cfg->blocks[b].cond) licm_rewrite(&lo, cfg->blocks[b].cond);
+    }
+
+    // Strength-reduce expressions derived from basic induction variables
+    InductionVar ivs[8];
+    int iv_count = find_induction_vars(&lo, ivs, 8);
+    for (int k = 0; k < iv_count; k++) {
+        InductionVar* iv = &ivs[k];
+        DerivedIv derived[16];
+        int derived_count = 0;
+        for (int b = 0; b < cfg->count; b++) {
+            if (!loop->body[b]) continue;
+            for (int i = 0; i < cfg->blocks[b].stmt_count; i++) {
+                AstNode* s = cfg->blocks[b].stmts[i];
+                if (s == iv->incr) continue;
+                for (int c = 0; c < s->child_count; c++) {
+                    strength_reduce_expr(&lo, iv, s->children[c], derived, &derived_count);
+                }
+            }
+            if (cfg->blocks[b].cond) {
+                strength_reduce_expr(&lo, iv, cfg->blocks[b].cond, derived, &derived_count);
+            }
+        }
+        if (derived_count == 0) continue;
+
+        // Keep each derived variable in step right after v's increment
+        AstNode* body = loop->node->children[1];
+        int at = ast_index_of(body, iv->incr) + 1;
+        for (int i = 0; i < derived_count; i++) {
+            AstNode* step = derived_step(&lo, iv, &derived[i]);
+            ast_insert(body, at++, ast_assign(derived[i].temp, ast_binop("+", ast_ident(derived[i].temp), step)));
+        }
+        replace_iv_test(&lo, iv, derived, derived_count);
+    }
+
+    // Materialize the preheader
+    if (lo.preheader->child_count > 0) {
+        AstNode* parent = ast_find_parent(func_body, loop->node);
+        int at = ast_index_of(parent, loop->node);
+        for (int i = 0; i < lo.preheader->child_count; i++) {
+            ast_insert(parent, at + i, lo.preheader->children[i]);
+        }
+    }
+}
+
+// ---- Vectorizer ----
+// Innermost counted loops `while (i < n) { ...; i = i + 1; }` whose body only
+// stores arrays at [i] or folds reductions get an AST_VECTOR_LOOP in
+// front of them. Codegen turns it into SIMD kernels that run while a full
+// vector of iterations remains; the original loop then finishes the rest.
+//
+// AST_VECTOR_LOOP: name = induction variable, op = "<" or "<=",
+// children = { bound, block of vector statements, IDENT iv }. Reductions are
+// normalized to AST_ASSIGN { name = acc, op = "+" "-" "*" "&" "|" "min" "max",
+// children = { element expression, IDENT acc } }.
+typedef struct VecCheck {
+    char* iv;
+    NameSet defs;        // Induction and reduction variables
+    NameSet arrays;      // Local and global arrays of the function
+    NameSet escaped;
+} VecCheck;
+
+static int vec_is_iv(VecCheck* vc, AstNode* e) {
+    return e->type == AST_IDENT && e->child_count == 0 && !strcmp(e->name, vc->iv);
+}
+
+// Invariant scalar operand: broadcast once before the kernel
+static int vec_scalar_ok(VecCheck* vc, AstNode* e) {
+    if (e->type == AST_NUMBER) return 1;
+    if (e->type == AST_IDENT) {
+        return e->child_count == 0 && !nameset_has(&vc->defs, e->name) &&
+               !nameset_has(&vc->escaped, e->name) && strcmp(e->name, vc->iv);
+    }
+    if (e->type == AST_BINOP && strchr("+-*&|", e->op[0])) {
+        return vec_scalar_ok(vc, e->children[0]) && vec_scalar_ok(vc, e->children[1]);
+    }
+    return 0;
+}
+
+// The array a vector load or store walks: arr[i], or arr[i].f of a
+// @soa array (f's elements are contiguous); NULL for anything else
+static AstNode* vec_access_array(AstNode* e) {
+    if (e->type == AST_FIELD_ACCESS && e->children[0]->type == AST_INDEX && type_is_soa(e->children[0]->ty)) {
+        e = e->children[0];
+    } else if (e->type != AST_INDEX || type_is_aggregate(e->ty)) {
+        return NULL;
+    }
+    return e->children[0]->type == AST_IDENT ? e->children[0] : NULL;
+}
+
+static AstNode* vec_access_index(AstNode* e) {
+    return e->type == AST_FIELD_ACCESS ? e->children[0]->children[1] : e->children[1];
+}
+
+static int vec_access_ok(VecCheck* vc, AstNode* e) {
+    AstNode* arr = vec_access_array(e);
+    return arr && nameset_has(&vc->arrays, arr->name) && vec_is_iv(vc, vec_access_index(e));
+}
+
+static int vec_expr_ok(VecCheck* vc, AstNode* e) {
+    if (vec_scalar_ok(vc, e) || vec_is_iv(vc, e)) return 1;
+    if (vec_access_array(e)) return vec_access_ok(vc, e);
+    if (e->type == AST_BINOP && strchr("+-*&|", e->op[0])) {
+        return vec_expr_ok(vc, e->children[0]) && vec_expr_ok(vc, e->children[1]);
+    }
+    return 0;
+}
+
+static AstNode* vec_reduction(char* acc, char* op, AstNode* elem) {
+    AstNode* r = ast_assign(acc, ast_clone(elem));
+    r->op = strdup(op);
+    ast_add(r, ast_ident(acc));
+    return r;
+}
+
+// Normalize one body statement into its vector form, or NULL
+static AstNode* vec_stmt(VecCheck* vc, AstNode* w, AstNode* s) {
+    if (s->type == AST_STORE) {
+        if (!vec_access_ok(vc, s->children[0])) return NULL;
+        return vec_expr_ok(vc, s->children[1]) ? ast_clone(s) : NULL;
+    }
+    if (s->type == AST_ASSIGN && s->children[0]->type == AST_BINOP) {
+        // acc = acc op e (acc - e only in that order)
+        AstNode* rhs = s->children[0];
+        if (!strchr("+-*&|", rhs->op[0])) return NULL;
+        if (nameset_has(&vc->escaped, s->name) || nameset_has(&vc->arrays, s->name)) return NULL;
+        if (ast_uses(w, s->name) != 1) return NULL;
+        AstNode* l = rhs->children[0];
+        AstNode* r = rhs->children[1];
+        int l_acc = l->type == AST_IDENT && !strcmp(l->name, s->name);
+        int r_acc = r->type == AST_IDENT && !strcmp(r->name, s->name) && rhs->op[0] != '-';
+        AstNode* elem = l_acc ? r : r_acc ? l : NULL;
+        if (!elem) return NULL;
+        nameset_add(&vc->defs, s->name);
+        if (!vec_expr_ok(vc, elem)) return NULL;
+        AstNode* red = vec_reduction(s->name, rhs->op, elem);
+        red->ty = (l_acc ? l : r)->ty;
+        return red;
+    }
+    if (s->type == AST_IF && s->child_count == 2 && s->children[1]->child_count == 1) {
+        // if (e < acc) { acc = e; } and friends: min/max
+        AstNode* cond = s->children[0];
+        AstNode* then = s->children[1]->children[0];
+        if (cond->type != AST_COMPARE || then->type != AST_ASSIGN) return NULL;
+        if (nameset_has(&vc->escaped, then->name) || ast_uses(w, then->name) != 1) return NULL;
+        int acc_left = cond->children[0]->type == AST_IDENT && !strcmp(cond->children[0]->name, then->name);
+        AstNode* elem = cond->children[acc_left ? 1 : 0];
+        AstNode* acc = cond->children[acc_left ? 0 : 1];
+        if (acc->type != AST_IDENT || strcmp(acc->name, then->name)) return NULL;
+        if (!ast_equal(elem, then->children[0])) return NULL;
+        int less = cond->op[0] == '<' && (!cond->op[1] || cond->op[1] == '=');
+        int greater = cond->op[0] == '>';
+        if (!less && !greater) return NULL;
+        int is_min = acc_left ? greater : less;
+        nameset_add(&vc->defs, then->name);
+        if (!vec_expr_ok(vc, elem)) return NULL;
+        AstNode* red = vec_reduction(then->name, is_min ? "min" : "max", elem);
+        red->ty = acc->ty;
+        return red;
+    }
+    return NULL;
+}
+
+// Element size shared by every array access in `e` (0 if none yet), -1 if mixed
+static int vec_array_width(AstNode* e, int width) {
+    if (width < 0) return width;
+    if (vec_access_array(e)) {
+        int size = type_size(e->ty);
+        return (size != 4 && size != 8) || (width && width != size) ? -1 : size;
+    }
+    for (int i = 0; i < e->child_count; i++) width = vec_array_width(e->children[i], width);
+    return width;
+}
+
+// Bytes per lane for a vector body, 0 if it cannot be given one
+static int vec_lane_width(AstNode* vbody) {
+    int width = 0;
+    for (int i = 0; i < vbody->child_count; i++) width = vec_array_width(vbody->children[i], width);
+    if (width < 0) return 0;
+    // Accumulators must match the lanes; min/max also compare at lane width
+    for (int i = 0; i < vbody->child_count; i++) {
+        AstNode* v = vbody->children[i];
+        if (v->type != AST_ASSIGN) continue;
+        int size = type_size(v->ty);
+        if (!width) width = size;
+        if (size != width) return 0;
+        // Lane min/max compare signed
+        if ((!strcmp(v->op, "min") || !strcmp(v->op, "max")) &&
+            (type_size(v->children[0]->ty) != width || type_is_unsigned(v->ty) ||
+             type_is_unsigned(v->children[0]->ty))) return 0;
+    }
+    return width ? width : 8;
+}
+
+AstNode* vectorize_loop(AstNode* func_body, AstNode* w) {
+    AstNode* cond = w->children[0];
+    AstNode* body = w->children[1];
+    if (cond->type != AST_COMPARE || body->child_count < 2) return NULL;
+
+    // Canonical counted loop: i < n / i <= n (or n > i), ending in i = i + 1
+    AstNode* incr = body->children[body->child_count - 1];
+    long step;
+    if (incr->type != AST_ASSIGN || incr->children[0]->type != AST_BINOP ||
+        incr->children[0]->op[0] != '+' || incr->children[0]->children[0]->type != AST_IDENT ||
+        strcmp(incr->children[0]->children[0]->name, incr->name) ||
+        !ast_is_num(incr->children[0]->children[1], &step) || step != 1) {
+        return NULL;
+    }
+    VecCheck vc;
+    memset(&vc, 0, sizeof(vc));
+    vc.iv = incr->name;
+    nameset_add(&vc.defs, vc.iv);
+    collect_function_facts(func_body, &vc.escaped, &vc.arrays);
+    if (nameset_has(&vc.escaped, vc.iv)) return NULL;
+
+    char* op;
+    AstNode* bound;
+    if (vec_is_iv(&vc, cond->children[0]) && (!strcmp(cond->op, "<") || !strcmp(cond->op, "<="))) {
+        op = cond->op;
+        bound = cond->children[1];
+    } else if (vec_is_iv(&vc, cond->children[1]) && (!strcmp(cond->op, ">") || !strcmp(cond->op, ">="))) {
+        op = cond->op[1] ? "<=" : "<";
+        bound = cond->children[0];
+    } else {
+        return NULL;
+    }
+    AstNode* vbody = ast_new(AST_BLOCK);
+    for (int i = 0; i < body->child_count - 1; i++) {
+        AstNode* v = vec_stmt(&vc, w, body->children[i]);
+        if (!v) return NULL;
+        ast_add(vbody, v);
+    }
+    // Reductions are only known once the whole body has been seen
+    for (int i = 0; i < vbody->child_count; i++) {
+        AstNode* v = vbody->children[i];
+        AstNode* e = v->type == AST_STORE ? v->children[1] : v->children[0];
+        if (!vec_expr_ok(&vc, e)) return NULL;
+    }
+    if (!vec_scalar_ok(&vc, bound)) return NULL;
+    int width = vec_lane_width(vbody);
+    if (!width) return NULL;
+
+    AstNode* vloop = ast_new(AST_VECTOR_LOOP);
+    vloop->name = strdup(vc.iv);
+    vloop->op = strdup(op);
+    vloop->ty = type_int(width);  // Lane type
+    ast_add(vloop, ast_clone(bound));
+    ast_add(vloop, vbody);
+    ast_add(vloop, ast_ident(vc.iv));
+    return vloop;
+}
+
+static int vectorize_walk(AstNode* func_body, AstNode* n) {
+    int has_loop = 0;
+    for (int i = 0; i < n->child_count; i++) {
+        AstNode* c = n->children[i];
+        int inner = vectorize_walk(func_body, c);
+        if (c->type == AST_WHILE && !inner) {
+            AstNode* vloop = vectorize_loop(func_body, c);
+            if (vloop) {
+                ast_insert(n, i, vloop);
+                i++;
+                // The scalar loop now runs the remainder only, or all of it
+                // when the CPU lacks the one kernel: the count becomes a bound
+                Attribute* trip = ast_attr(c, "trip");
+                Attribute* most = trip ? trip : ast_attr(c, "max_trip");
+                if (most) ast_add_attr(vloop, "max_trip", most->arg);
+                if (trip) {
+                    AstNode* count = trip->arg;
+                    ast_drop_attr(c, "trip");  // Unshares the attributes before adding
+                    ast_add_attr(c, "max_trip", count);
+                }
+                vloop->line = c->line;
+            }
+        }
+        has_loop |= inner || c->type == AST_WHILE;
+    }
+    return has_loop;
+}
+
+void vectorize_loops(AstNode* func) {
+    AstNode* body = func->children[func->child_count - 1];
+    vectorize_walk(body, body);
+}
+
+// ---- Unroller ----
+// Innermost loops `while (i < n) { ...; i = i + s; }` (or > / >= counting
+// down) that write i only in that last statement run several copies of the
+// body per test, copy k reading i + k*s. With a constant trip count the
+// unroll is deterministic: the leftover trip % U iterations are peeled off
+// in front as straight-line code, and a loop of at most U iterations is
+// replaced by its copies. Otherwise the copies run while i + (U-1)*s stays
+// within the bound and the original loop finishes the rest. Each copy of a
+// reduction `acc = acc op e` gets its own accumulator so the copies do not
+// wait on each other; they are combined after the loop.
+//
+// -funroll unrolls small loops by 4 (fully when short); @unroll(N) asks for
+// N on any loop, and @unroll(1) keeps it rolled.
+static const int UNROLL_FACTOR = 4;
+static const int UNROLL_MAX_BODY = 48;   // AST nodes of a body -funroll copies
+static const int UNROLL_MAX_FULL = 256;  // AST nodes a -funroll full unroll may produce
+
+int ast_size(AstNode* n);
+
+typedef struct Unroller {
+    Optimizer* opt;
+    NameSet escaped;     // Address-taken locals and globals of the function
+    NameSet arrays;
+    NameSet locals;      // Declared and used only in the loop body: renamed in each copy
+    AstNode* func;       // Function body
+    int copy;            // Suffix of the copy being made, from 1
+} Unroller;
+
+static int count_writes(AstNode* n, char* name) {
+    int count = (n->type == AST_ASSIGN || n->type == AST_LET) && !strcmp(n->name, name);
+    for (int i = 0; i < n->child_count; i++) count += count_writes(n->children[i], name);
+    return count;
+}
+
+// Loops and jumps stop a body from being copied
+static int unroll_blocked(AstNode* n) {
+    if (n->type == AST_WHILE || n->type == AST_VECTOR_LOOP || n->type == AST_BREAK || n->type == AST_CONTINUE) return 1;
+    for (int i = 0; i < n->child_count; i++) {
+        if (unroll_blocked(n->children[i])) return 1;
+    }
+    return 0;
+}
+
+static int count_refs(AstNode* n, char* name) {
+    return ast_uses(n, name) + count_writes(n, name);
+}
+
+// A `let` of a name the rest of the function also uses is that same variable
+// (one flat scope per function), so it keeps its name
+static void unroll_collect_locals(Unroller* u, AstNode* body, AstNode* n) {
+    if (n->type == AST_LET && count_refs(u->func, n->name) == count_refs(body, n->name)) nameset_add(&u->locals, n->name);
+    for (int i = 0; i < n->child_count; i++) unroll_collect_locals(u, body, n->children[i]);
+}
+
+// Clone `n` for copy u->copy: reads of iv become iv + delta (or the constant
+// `value` when `fixed`), and body-local variables get a fresh name so the
+// copies do not share one slot
+static AstNode* unroll_clone(Unroller* u, AstNode* n, char* iv, long delta, int fixed, long value) {
+    AstNode* c = ast_clone(n);
+    if (c->type == AST_IDENT && c->child_count == 0 && !strcmp(c->name, iv)) {
+        if (fixed) return ast_num(value);
+        if (delta) return ast_binop("+", c, ast_num(delta));
+    }
+    if ((c->type == AST_IDENT || c->type == AST_ASSIGN || c->type == AST_LET) && nameset_has(&u->locals, c->name)) {
+        char* name = malloc(strlen(c->name) + 16);
+        sprintf(name, "%s__u%d", c->name, u->copy);
+        c->name = name;
+    }
+    for (int i = 0; i < c->child_count; i++) {
+        if (c->type == AST_STRUCT_LITERAL) {
+            AstNode* field = c->children[i];
+            for (int j = 0; j < field->child_count; j++) {
+                field->children[j] = unroll_clone(u, field->children[j], iv, delta, fixed, value);
+            }
+        } else {
+            c->children[i] = unroll_clone(u, c->children[i], iv, delta, fixed, value);
+        }
+    }
+    return c;
+}
+
+// Index of the reduction op for `acc = acc op e` or `acc = e op acc` in loop w, -1 if not one
+static int unroll_reduction(Unroller* u, AstNode* w, AstNode* s, char* iv) {
+    if (s->type != AST_ASSIGN || s->children[0]->type != AST_BINOP || !strcmp(s->name, iv)) return -1;
+    AstNode* rhs = s->children[0];
+    char* op = strchr("+-*&|", rhs->op[0]);
+    if (!op || nameset_has(&u->escaped, s->name) || nameset_has(&u->arrays, s->name)) return -1;
+    if (nameset_has(&u->locals, s->name)) return -1;
+    if (ast_uses(w, s->name) != 1 || count_writes(w, s->name) != 1) return -1;
+    AstNode* l = rhs->children[0];
+    AstNode* r = rhs->children[1];
+    int l_acc = l->type == AST_IDENT && !strcmp(l->name, s->name);
+    int r_acc = r->type == AST_IDENT && !strcmp(r->name, s->name) && *op != '-';
+    AstNode* acc = l_acc ? l : r_acc ? r : NULL;
+    if (!acc || !acc->ty || acc->ty->kind != TY_INT) return -1;
+    return op - "+-*&|";
+}
+
+// Unroll loop block->children[at]; returns how many statements replaced it
+static int unroll_loop(Unroller* u, AstNode* block, int at) {
+    AstNode* w = block->children[at];
+    AstNode* cond = w->children[0];
+    AstNode* body = w->children[1];
+    Attribute* attr = ast_attr(w, "unroll");
+    long factor = attr ? atol(attr->arg->value) : UNROLL_FACTOR;
+    if (factor < 2 || (!attr && (!u->opt->opts->unroll || ast_size(body) > UNROLL_MAX_BODY))) return 1;
+    if (cond->type != AST_COMPARE || body->child_count < 2 || unroll_blocked(body)) return 1;
+
+    // Shape: the last statement steps iv by a constant toward the bound
+    AstNode* incr = body->children[body->child_count - 1];
+    long step, b;
+    if (incr->type != AST_ASSIGN || incr->children[0]->type != AST_BINOP) return 1;
+    AstNode* rhs = incr->children[0];
+    char* iv = incr->name;
+    if ((rhs->op[0] != '+' && rhs->op[0] != '-') || rhs->children[0]->type != AST_IDENT ||
+        strcmp(rhs->children[0]->name, iv) || !ast_is_num(rhs->children[1], &step) || step == 0) return 1;
+    if (rhs->op[0] == '-') step = -step;
+    AstNode* v = cond->children[0];
+    AstNode* bound = cond->children[1];
+    if (v->type != AST_IDENT || strcmp(v->name, iv) || !v->ty || v->ty->kind != TY_INT) return 1;
+    if ((cond->op[0] != '<' && cond->op[0] != '>') || (cond->op[0] == '<') != (step > 0)) return 1;
+    if (nameset_has(&u->escaped, iv) || count_writes(body, iv) != 1) return 1;
+    if (!ast_is_num(bound, &b) && (bound->type != AST_IDENT || bound->child_count > 0 ||
+        nameset_has(&u->escaped, bound->name) || count_writes(body, bound->name) > 0)) return 1;
+    // The vectorized loop in front already ran all but the last few iterations
+    if (at > 0 && block->children[at - 1]->type == AST_VECTOR_LOOP && !strcmp(block->children[at - 1]->name, iv)) return 1;
+
+    memset(&u->locals, 0, sizeof(u->locals));
+    unroll_collect_locals(u, body, body);
+    int stmts = body->child_count - 1;
+
+    // Constant trip count: iv starts from a literal just before the loop
+    long trip = -1, start;
+    AstNode* prev = at > 0 ? block->children[at - 1] : NULL;
+    if (prev && (prev->type == AST_LET || prev->type == AST_ASSIGN) && !strcmp(prev->name, iv) &&
+        prev->child_count > 0 && ast_is_num(prev->children[0], &start) && ast_is_num(bound, &b)) {
+        trip = loop_trip_count(start, cond->op, b, step, type_is_unsigned(v->ty));
+    }
+    if (trip == 0) return 1;
+    int full = trip > 0 && (trip <= factor ||
+                            (!attr && trip <= 32 && trip * ast_size(body) <= UNROLL_MAX_FULL));
+    if (full) {
+        ast_remove(block, at);
+        int n = 0;
+        for (long k = 0; k < trip; k++) {
+            u->copy = k + 1;
+            for (int i = 0; i < stmts; i++) {
+                ast_insert(block, at + n++, unroll_clone(u, body->children[i], iv, 0, 1, start + k * step));
+            }
+        }
+        ast_insert(block, at + n++, ast_assign(iv, ast_num(start + trip * step)));
+        return n;
+    }
+
+    int n = 0;
+    if (trip > 0) {
+        // Peel trip % factor iterations so the loop runs a whole number of rounds
+        for (long k = 0; k < trip % factor; k++) {
+            u->copy = factor + k + 1;
+            for (int i = 0; i <= stmts; i++) ast_insert(block, at + n++, unroll_clone(u, body->children[i], iv, 0, 0, 0));
+        }
+        Attribute* t = ast_attr(w, "trip");
+        if (t) t->arg = ast_num(trip / factor);
+    }
+
+    // Copies of one round, each reduction into an accumulator of its own
+    AstNode* ubody = ast_new(AST_BLOCK);
+    AstNode* combine = ast_new(AST_BLOCK);
+    for (long k = 0; k < factor; k++) {
+        u->copy = k + 1;
+        for (int i = 0; i < stmts; i++) {
+            AstNode* s = unroll_clone(u, body->children[i], iv, k * step, 0, 0);
+            int op = k > 0 ? unroll_reduction(u, w, body->children[i], iv) : -1;
+            if (op >= 0) {
+                static const char* ops[] = {"+", "+", "*", "&", "|"};
+                static const long identity[] = {0, 0, 1, -1, 0};
+                char* acc = opt_temp(u->opt, "acc");
+                AstNode* self = s->children[0]->children[0]->type == AST_IDENT &&
+                                !strcmp(s->children[0]->children[0]->name, s->name)
+                                ? s->children[0]->children[0] : s->children[0]->children[1];
+                AstNode* let = ast_let(acc, ast_num(identity[op]));
+                let->ty = self->ty;
+                ast_insert(block, at + n++, let);
+                ast_add(combine, ast_assign(s->name, ast_binop((char*)ops[op], ast_ident(s->name), ast_ident(acc))));
+                self->name = strdup(acc);
+                s->name = strdup(acc);
+            }
+            ast_add(ubody, s);
+        }
+    }
+    ast_add(ubody, ast_assign(iv, ast_binop("+", ast_ident(iv), ast_num(step * factor))));
+
+    AstNode* uloop = w;
+    if (trip < 0) {
+        // Runtime count: the copies run while iv + (factor-1)*step is in range,
+        // then the original loop takes the remaining iterations
+        char* limit = opt_temp(u->opt, "unroll");
+        long reach = (factor - 1) * step;
+        Type* common = type_arith(v->ty, bound->ty ? bound->ty : v->ty);
+        int wide = type_size(common) == 8;
+        AstNode* let = ast_let(limit, ast_binop("-", ast_clone(bound), ast_num(reach)));
+        let->ty = wide ? common : type_int(8);  // Narrow bounds cannot wrap in 64 bits
+        ast_insert(block, at + n++, let);
+        if (wide) {
+            // bound - reach wrapped around: there is no full round to run
+            AstNode* wrapped = ast_new(AST_COMPARE);
+            wrapped->op = strdup(step > 0 ? ">" : "<");
+            ast_add(wrapped, ast_ident(limit));
+            ast_add(wrapped, ast_clone(bound));
+            long edge = type_is_unsigned(common) ? (step > 0 ? 0 : -1) : (step > 0 ? (-9223372036854775807L - 1) : 9223372036854775807L);
+            AstNode* fix = ast_new(AST_IF);
+            ast_add(fix, wrapped);
+            AstNode* then = ast_new(AST_BLOCK);
+            ast_add(then, ast_assign(limit, ast_num(edge)));
+            ast_add(fix, then);
+            ast_insert(block, at + n++, fix);
+        }
+        uloop = ast_new(AST_WHILE);
+        AstNode* ucond = ast_new(AST_COMPARE);
+        ucond->op = strdup(cond->op);
+        ast_add(ucond, ast_ident(iv));
+        ast_add(ucond, ast_ident(limit));
+        ast_add(uloop, ucond);
+        ast_add(uloop, ubody);
+        ast_insert(block, at + n++, uloop);
+    } else {
+        w->children[1] = ubody;
+    }
+    int after = ast_index_of(block, uloop) + 1;
+    for (int i = 0; i < combine->child_count; i++) ast_insert(block, after + i, combine->children[i]);
+    int end = ast_index_of(block, w) + 1;
+    if (uloop == w) end += combine->child_count;
+    return end - at;
+}
+
+// Unroll the innermost loops under n
+static int unroll_walk(Unroller* u, AstNode* n) {
+    int has_loop = 0;
+    for (int i = 0; i < n->child_count; i++) {
+        AstNode* c = n->children[i];
+        int inner = unroll_walk(u, c);
+        has_loop |= inner || c->type == AST_WHILE;
+        if (c->type == AST_WHILE && !inner) i += unroll_loop(u, n, i) - 1;
+    }
+    return has_loop;
+}
+
+void unroll_loops(Optimizer* opt, AstNode* func) {
+    AstNode* body = func->children[func->child_count - 1];
+    Unroller u;
+    memset(&u, 0, sizeof(u));
+    u.opt = opt;
+    u.func = body;
+    collect_function_facts(body, &u.escaped, &u.arrays);
+    unroll_walk(&u, body);
+}
+
+// Optimize loops innermost first, rebuilding the CFG after each rewrite
+void optimize_loops(Optimizer* opt, AstNode* func) {
+    AstNode* body = func->children[func->child_count - 1];
+    for (;;) {
+        Cfg* cfg = cfg_build(body);
+        Loop* next = NULL;
+        for (int i = 0; i < cfg->loop_count; i++) {
+            Loop* l = &cfg->loops[i];
+            int done = !l->node;
+            for (int j = 0; j < opt->done_count && !done; j++) {
+                if (opt->done[j] == l->node) done = 1;
+            }
+            if (!done && (!next || l->depth > next->depth)) next = l;
+        }
+        if (!next) {
+            cfg_free(cfg);
+            return;
+        }
+        opt->done_count++;
+        opt->done = realloc(opt->done, sizeof(AstNode*) * opt->done_count);
+        opt->done[opt->done_count - 1] = next->node;
+        optimize_loop(opt, body, cfg, next);
+        cfg_free(cfg);
+    }
+}
+
+// ==== TAIL RECURSION ====
+// `return x op f(...)` leaves an operation pending in every frame. When op is
+// associative and commutative and x only reads locals, f is split into a
+// wrapper and an accumulator-passing worker whose self calls are all tail
+// calls (which codegen turns into jumps):
+//   fn f(n) { return __acc_f(n, identity); }
+//   fn __acc_f(n, __acc) { ... return __acc_f(n - 1, __acc op x); ... return __acc op base; }
+typedef struct AccScan {
+    char* name;          // Function being scanned
+    char* op;            // Pending operation shared by every recursive return
+    int pending;         // Returns of the form `x op f(...)`
+    int ok;
+} AccScan;
+
+static int calls_named(AstNode* n, char* name) {
+    if (n->type == AST_CALL && !strcmp(n->name, name)) return 1;
+    for (int i = 0; i < n->child_count; i++) {
+        if (calls_named(n->children[i], name)) return 1;
+    }
+    return 0;
+}
+
+// Reads only locals and cannot trap, so it may be evaluated before the call
+static int acc_operand_ok(AstNode* e) {
+    if (e->type == AST_NUMBER) return 1;
+    if (e->type == AST_IDENT) return e->child_count == 0 && !e->is_global;
+    if (e->type == AST_COMPARE || (e->type == AST_BINOP && e->op[0] != '/' && e->op[0] != '%')) {
+        return acc_operand_ok(e->children[0]) && acc_operand_ok(e->children[1]);
+    }
+    return 0;
+}
+
+static int is_self_call(AstNode* e, char* name) {
+    if (e->type != AST_CALL || strcmp(e->name, name)) return 0;
+    for (int i = 0; i < e->child_count; i++) {
+        if (calls_named(e->children[i], name)) return 0;
+    }
+    return 1;
+}
+
+// The recursive call of a pending return, with the other operand in *other
+static AstNode* acc_split(AstNode* e, char* name, AstNode** other) {
+    if (e->type != AST_BINOP || !strchr("+*&|", e->op[0])) return NULL;
+    for (int side = 0; side < 2; side++) {
+        AstNode* call = e->children[side];
+        AstNode* x = e->children[1 - side];
+        if (is_self_call(call, name) && acc_operand_ok(x)) {
+            *other = x;
+            return call;
+        }
+    }
+    return NULL;
+}
+
+static void acc_scan(AccScan* sc, AstNode* n) {
+    if (n->type == AST_ADDR_OF) sc->ok = 0;
+    if (n->type == AST_RETURN && n->child_count > 0) {
+        AstNode* e = n->children[0];
+        AstNode* x;
+        if (acc_split(e, sc->name, &x)) {
+            if (sc->op && strcmp(sc->op, e->op)) sc->ok = 0;
+            sc->op = e->op;
+            sc->pending++;
+            return;
+        }
+        if (!is_self_call(e, sc->name) && calls_named(e, sc->name)) sc->ok = 0;
+        return;
+    }
+    for (int i = 0; i < n->child_count; i++) acc_scan(sc, n->children[i]);
+}
+
+static void acc_rewrite(AstNode* n, char* name, char* worker, char* op) {
+    if (n->type == AST_RETURN) {
+        AstNode* e = n->child_count > 0 ? n->children[0] : ast_num(0);
+        AstNode* acc = ast_ident("__acc");
+        AstNode* x;
+        AstNode* call = acc_split(e, name, &x);
+        if (call) {
+            ast_add(call, ast_binop(op, acc, x));
+        } else if (is_self_call(e, name)) {
+            call = e;
+            ast_add(call, acc);
+        }
+        if (call) {
+            call->name = worker;
+            if (n->child_count == 0) ast_add(n, call);
+            n->children[0] = call;
+        } else {
+            if (n->child_count == 0) ast_add(n, e);
+            n->children[0] = ast_binop(op, acc, e);
+        }
+        return;
+    }
+    for (int i = 0; i < n->child_count; i++) acc_rewrite(n->children[i], name, worker, op);
+}
+
+void accumulate_recursion(AstNode* prog) {
+    int count = prog->child_count;
+    for (int i = 0; i < count; i++) {
+        AstNode* f = prog->children[i];
+        int param_count = f->child_count - 1;
+        if (f->type != AST_FUNCTION || param_count >= 6) continue;
+        AstNode* body = f->children[param_count];
+        AccScan sc = {f->name, NULL, 0, 1};
+        acc_scan(&sc, body);
+        if (!sc.ok || !sc.pending) continue;
+
+        char* worker = malloc(strlen(f->name) + 7);
+        sprintf(worker, "__acc_%s", f->name);
+        AstNode* w = ast_clone(f);
+        w->name = worker;
+        AstNode* wbody = w->children[param_count];
+        AstNode* last = wbody->child_count > 0 ? wbody->children[wbody->child_count - 1] : NULL;
+        if (!last || last->type != AST_RETURN) ast_add(wbody, ast_new(AST_RETURN));  // Falling off returns 0
+        acc_rewrite(wbody, f->name, worker, sc.op);
+        AstNode* acc_param = ast_ident("__acc");
+        acc_param->ty = f->ty;
+        ast_insert(w, param_count, acc_param);
+        ast_add(prog, w);
+
+        long identity = sc.op[0] == '*' ? 1 : sc.op[0] == '&' ? -1 : 0;
+        AstNode* call = ast_new(AST_CALL);
+        call->name = worker;
+        for (int j = 0; j < param_count; j++) ast_add(call, ast_ident(f->children[j]->name));
+        ast_add(call, ast_num(identity));
+        AstNode* ret = ast_new(AST_RETURN);
+        ast_add(ret, call);
+        AstNode* wrapper = ast_new(AST_BLOCK);
+        ast_add(wrapper, ret);
+        f->children[param_count] = wrapper;
+    }
+}
+
+// ==== INLINER ====
+// Calls to small or single-use functions are expanded in the caller. The
+// callee's parameters and locals become fresh `__inN_` locals of the caller.
+// A body that is a lone `return expr;` is substituted as an expression;
+// anything else becomes an AST_INLINE block whose returns jump to its end.
+// @inline forces expansion and @noinline forbids it; recursive functions
+// are never expanded.
+static const int INLINE_SMALL = 24;         // Body size always worth inlining
+static const int INLINE_SINGLE_USE = 400;   // Largest single-call-site callee
+static const int INLINE_CALLER_MAX = 4000;  // Stop growing a caller past this
+
+typedef struct FuncInfo {
+    AstNode* func;
+    int size;            // AST nodes in the body
+    int calls;           // Call sites across the program
+    int recursive;       // Reaches itself through the call graph
+    int state;           // 0 = pending, 1 = inlining into it, 2 = finished
+} FuncInfo;
+
+typedef struct Inliner {
+    Optimizer* opt;
+    FuncInfo* funcs;
+    int count;
+} Inliner;
+
+int ast_size(AstNode* n) {
+    int size = 1;
+    for (int i = 0; i < n->child_count; i++) size += ast_size(n->children[i]);
+    return size;
+}
+
+static FuncInfo* inline_lookup(Inliner* in, char* name) {
+    for (int i = 0; i < in->count; i++) {
+        if (!strcmp(in->funcs[i].func->name, name)) return &in->funcs[i];
+    }
+    return NULL;
+}
+
+static void count_calls(Inliner* in, AstNode* n) {
+    if (n->type == AST_CALL) {
+        FuncInfo* f = inline_lookup(in, n->name);
+        if (f) f->calls++;
+    }
+    for (int i = 0; i < n->child_count; i++) count_calls(in, n->children[i]);
+}
+
+// Can `n` reach the function `target` through calls?
+static int calls_reach(Inliner* in, AstNode* n, char* target, char* seen) {
+    if (n->type == AST_CALL) {
+        if (!strcmp(n->name, target)) return 1;
+        FuncInfo* f = inline_lookup(in, n->name);
+        if (f && !seen[f - in->funcs]) {
+            seen[f - in->funcs] = 1;
+            if (calls_reach(in, f->func, target, seen)) return 1;
+        }
+    }
+    for (int i = 0; i < n->child_count; i++) {
+        if (calls_reach(in, n->children[i], target, seen)) return 1;
+    }
+    return 0;
+}
+
+static int should_inline(FuncInfo* f) {
+    // A @wcet budget is checked on the function's own code
+    if (f->recursive || ast_attr(f->func, "noinline") || ast_attr(f->func, "cold") ||
+        ast_attr(f->func, "wcet") || !strcmp(f->func->name, "main")) return 0;
+    if (ast_attr(f->func, "inline")) return 1;
+    return f->size <= INLINE_SMALL || (f->calls == 1 && f->size <= INLINE_SINGLE_USE);
+}
+
+static void collect_locals(AstNode* n, NameSet* locals) {
+    if (n->type == AST_LET) nameset_add(locals, n->name);
+    for (int i = 0; i < n->child_count; i++) collect_locals(n->children[i], locals);
+}
+
+static void inline_rename(AstNode* n, NameSet* locals, char* prefix) {
+    if ((n->type == AST_IDENT || n->type == AST_ASSIGN || n->type == AST_LET) && nameset_has(locals, n->name)) {
+        char* name = malloc(strlen(prefix) + strlen(n->name) + 1);
+        sprintf(name, "%s%s", prefix, n->name);
+        n->name = name;
+    }
+    for (int i = 0; i < n->child_count; i++) {
+        AstNode* c = n->children[i];
+        // Struct literal fields are named by identifiers that are not variables
+        if (n->type == AST_STRUCT_LITERAL) {
+            for (int j = 0; j < c->child_count; j++) inline_rename(c->children[j], locals, prefix);
+        } else {
+            inline_rename(c, locals, prefix);
+        }
+    }
+}
+
+static void substitute(AstNode* n, char* name, AstNode* value) {
+    if (n->type == AST_IDENT && n->child_count == 0 && !strcmp(n->name, name)) {
+        ast_replace(n, ast_clone(value));
+        return;
+    }
+    for (int i = 0; i < n->child_count; i++) substitute(n->children[i], name, value);
+}
+
+// Is `name` used as the base of an index, field access or address-of?
+static int used_as_base(AstNode* n, char* name) {
+    if ((n->type == AST_INDEX || n->type == AST_FIELD_ACCESS || n->type == AST_ADDR_OF) &&
+        n->children[0]->type == AST_IDENT && !strcmp(n->children[0]->name, name)) return 1;
+    for (int i = 0; i < n->child_count; i++) {
+        if (used_as_base(n->children[i], name)) return 1;
+    }
+    return 0;
+}
+
+// Same value wherever it is evaluated (a global may change across a call)
+static int is_trivial_arg(AstNode* a) {
+    return a->type == AST_NUMBER || a->type == AST_STRING ||
+           (a->type == AST_IDENT && a->child_count == 0 && !a->is_global);
+}
+
+// Replace `call` in place with the body of `callee`; `stmt` when its value is unused
+static void inline_call(Inliner* in, AstNode* call, AstNode* callee, int stmt) {
+    int param_count = callee->child_count - 1;
+    char prefix[32];
+    sprintf(prefix, "__in%d_", in->opt->temp_count++);
+
+    NameSet locals = {0};
+    for (int i = 0; i < param_count; i++) nameset_add(&locals, callee->children[i]->name);
+    collect_locals(callee->children[param_count], &locals);
+    AstNode* body = ast_clone(callee->children[param_count]);
+    inline_rename(body, &locals, prefix);
+
+    char** params = malloc(sizeof(char*) * (param_count + 1));
+    for (int i = 0; i < param_count; i++) {
+        params[i] = malloc(strlen(prefix) + strlen(callee->children[i]->name) + 1);
+        sprintf(params[i], "%s%s", prefix, callee->children[i]->name);
+    }
+
+    // `return expr;` with arguments that can be evaluated where they are used.
+    // A bare expression is no statement: a call statement keeps its body, so
+    // a trap in `expr` still happens.
+    if (!stmt && body->child_count == 1 && body->children[0]->type == AST_RETURN &&
+        body->children[0]->child_count == 1) {
+        AstNode* e = body->children[0]->children[0];
+        // Substitution must not skip a conversion to a parameter or return type,
+        // nor read an argument after a call in `e` may have written it
+        int direct = type_equal(e->ty, callee->ty) && !ast_has_call(e);
+        for (int i = 0; i < param_count && direct; i++) {
+            AstNode* arg = i < call->child_count ? call->children[i] : NULL;
+            if (!arg || used_as_base(e, params[i]) || !type_equal(arg->ty, callee->children[i]->ty)) direct = 0;
+            else if (!is_trivial_arg(arg)) {
+                direct = !ast_has_call(arg) && ast_uses(e, params[i]) <= 1;
+            }
+        }
+        if (direct) {
+            for (int i = 0; i < param_count; i++) substitute(e, params[i], call->children[i]);
+            ast_replace(call, e);
+            free(params);
+            free(locals.names);
+            return;
+        }
+    }
+
+    AstNode* inl = ast_new(AST_INLINE);
+    inl->name = callee->name;
+    inl->ty = callee->ty;
+    for (int i = 0; i < param_count; i++) {
+        AstNode* let = ast_let(params[i], i < call->child_count ? call->children[i] : ast_num(0));
+        // An array argument is passed by address, as in a real call
+        Type* ty = callee->children[i]->ty;
+        let->ty = ty->kind == TY_ARRAY ? type_ptr(ty->base) : ty;
+        let->is_pointer = let->ty->kind == TY_PTR;
+        ast_add(inl, let);
+    }
+    for (int i = 0; i < body->child_count; i++) ast_add(inl, body->children[i]);
+    ast_replace(call, inl);
+    free(params);
+    free(locals.names);
+}
+
+static void inline_walk(Inliner* in, FuncInfo* caller, AstNode* n, int stmt);
+
+// Finish inlining into `f`; callees are finished first so their bodies are final
+static void inline_function(Inliner* in, FuncInfo* f) {
+    if (f->state) return;
+    f->state = 1;
+    inline_walk(in, f, f->func, 0);
+    f->size = ast_size(f->func->children[f->func->child_count - 1]);
+    f->state = 2;
+}
+
+static void inline_walk(Inliner* in, FuncInfo* caller, AstNode* n, int stmt) {
+    // Arguments first, so they are final before being copied into the body
+    int block = n->type == AST_BLOCK || n->type == AST_INLINE;
+    for (int i = 0; i < n->child_count; i++) inline_walk(in, caller, n->children[i], block);
+    if (n->type != AST_CALL) return;
+    FuncInfo* callee = inline_lookup(in, n->name);
+    if (!callee || callee == caller || !should_inline(callee)) return;
+    inline_function(in, callee);
+    if (caller->size + callee->size > INLINE_CALLER_MAX && !ast_attr(callee->func, "inline")) return;
+    caller->size += callee->size;
+    inline_call(in, n, callee->func, stmt);
+}
+
+void inline_functions(Optimizer* opt, AstNode* prog) {
+    Inliner in = {opt, NULL, 0};
+    for (int i = 0; i < prog->child_count; i++) {
+        AstNode* f = prog->children[i];
+        if (f->type != AST_FUNCTION) continue;
+        in.count++;
+        in.funcs = realloc(in.funcs, sizeof(FuncInfo) * in.count);
+        FuncInfo* info = &in.funcs[in.count - 1];
+        memset(info, 0, sizeof(FuncInfo));
+        info->func = f;
+        info->size = ast_size(f->children[f->child_count - 1]);
+    }
+    count_calls(&in, prog);
+    for (int i = 0; i < in.count; i++) {
+        char* seen = calloc(in.count, 1);
+        in.funcs[i].recursive = calls_reach(&in, in.funcs[i].func, in.funcs[i].func->name, seen);
+        free(seen);
+    }
+    for (int i = 0; i < in.count; i++) inline_function(&in, &in.funcs[i]);
+    free(in.funcs);
+}
+
+// ==== DEAD CODE ====
+// Whole-program reachability after inlining: functions main cannot reach
+// (including const fns only ever folded) are dropped before they are
+// optimized or emitted. Codegen emits only the runtime helpers that the
+// remaining code calls.
+static const char* runtime_helpers[][2] = {
+    {"print_int", "__print_int"}, {"strcmp", "__strcmp"}, {"strcpy", "__strcpy"}, {"strlen", "__strlen"},
+};
+
+static void mark_reachable(AstNode* prog, AstNode* n, NameSet* live) {
+    if (n->type == AST_CALL && !nameset_has(live, n->name)) {
+        nameset_add(live, n->name);
+        if (prints_str(n)) nameset_add(live, "strlen");
+        AstNode* f = find_function(prog, n->name);
+        if (f) mark_reachable(prog, f, live);
+    }
+    for (int i = 0; i < n->child_count; i++) mark_reachable(prog, n->children[i], live);
+}
+
+static int program_calls(AstNode* n, const char* name) {
+    if (n->type == AST_CALL && !strcmp(n->name, name)) return 1;
+    for (int i = 0; i < n->child_count; i++) {
+        if (program_calls(n->children[i], name)) return 1;
+    }
+    return 0;
+}
+
+void eliminate_dead_functions(Optimizer* opt, AstNode* prog) {
+    AstNode* entry = find_function(prog, "main");
+    if (!entry) return;  // No entry point: nothing is known to be dead
+    NameSet live = {NULL, 0};
+    nameset_add(&live, "main");
+    mark_reachable(prog, entry, &live);
+
+    int kept = 0, dropped = 0, dropped_size = 0;
+    for (int i = 0; i < prog->child_count; i++) {
+        AstNode* f = prog->children[i];
+        if (f->type != AST_FUNCTION) continue;
+        if (nameset_has(&live, f->name)) {
+            kept++;
+            continue;
+        }
+        if (opt->opts->dead_report) printf("dead code: dropped fn %s (%d AST nodes)\n", f->name, ast_size(f));
+        dropped++;
+        dropped_size += ast_size(f);
+        ast_remove(prog, i--);
+    }
+    if (!opt->opts->dead_report) return;
+    for (int i = 0; i < 4; i++) {
+        if (!nameset_has(&live, (char*)runtime_helpers[i][0])) {
+            printf("dead code: dropped runtime helper %s\n", runtime_helpers[i][1]);
+        }
+    }
+    printf("dead code: kept %d of %d functions, %d AST nodes dropped\n", kept, kept + dropped, dropped_size);
+}
+
+// ==== PURITY ====
+// Interprocedural effect analysis, run before inlining while calls are still
+// calls. A function is pure when it touches nothing but its own locals and
+// consts, readonly when it may also read globals or memory, and noreturn when
+// no path leaves it. A pure call repeated with the same arguments in
+// straight-line code is computed once. A function is speculatable when it is
+// also loop-free and cannot trap: a call statement to one whose value is
+// unused is deleted, and the loop optimizer hoists invariant calls to it.
+typedef enum { EFFECT_PURE, EFFECT_READONLY, EFFECT_WRITES } EffectKind;
+
+static const char* effect_names[] = {"pure", "readonly", "side effects"};
+
+typedef struct FuncEffects {
+    AstNode* func;
+    EffectKind kind;
+    int noreturn;
+    int speculatable;    // Pure, loop-free, no division by a variable: safe to run early
+    int reused;          // Calls this function no longer makes, for the report
+    int hoisted;
+    int deleted;
+} FuncEffects;
+
+typedef struct Effects {
+    AstNode* prog;
+    FuncEffects* funcs;
+    int count;
+    FuncEffects* current;  // Function being rewritten
+} Effects;
+
+static FuncEffects* effects_lookup(Effects* fx, char* name) {
+    for (int i = 0; i < fx->count; i++) {
+        if (!strcmp(fx->funcs[i].func->name, name)) return &fx->funcs[i];
+    }
+    return NULL;
+}
+
+// What calling `name` may do, as far as is known so far
+static EffectKind call_effect(Effects* fx, char* name) {
+    FuncEffects* f = effects_lookup(fx, name);
+    if (f) return f->kind;
+    return !strcmp(name, "strlen") || !strcmp(name, "strcmp") ? EFFECT_READONLY : EFFECT_WRITES;
+}
+
+static int call_noreturn(Effects* fx, char* name) {
+    FuncEffects* f = effects_lookup(fx, name);
+    return f ? f->noreturn : !strcmp(name, "exit");
+}
+
+// The variable an index / field access chain reads, NULL if it goes through a pointer
+static AstNode* access_root(AstNode* e) {
+    while (e->type == AST_INDEX || e->type == AST_FIELD_ACCESS) {
+        if (e->children[0]->ty && e->children[0]->ty->kind == TY_PTR) return NULL;
+        e = e->children[0];
+    }
+    return e->type == AST_IDENT && e->child_count == 0 ? e : NULL;
+}
+
+// Effect of reading (or writing) the object `e` designates: a function's own
+// locals are private to it, consts never change, anything else is memory
+static EffectKind access_effect(Effects* fx, AstNode* func, AstNode* e, int write) {
+    e = access_root(e);
+    if (!e) return write ? EFFECT_WRITES : EFFECT_READONLY;
+    if (e->is_global) {
+        AstNode* g = find_global(fx->prog, e->name);
+        if (write) return EFFECT_WRITES;
+        return g && !strcmp(g->op, "const") ? EFFECT_PURE : EFFECT_READONLY;
+    }
+    // An array parameter is the caller's array
+    for (int i = 0; i < func->child_count - 1; i++) {
+        AstNode* param = func->children[i];
+        if (!strcmp(param->name, e->name) && param->ty && param->ty->kind == TY_ARRAY) {
+            return write ? EFFECT_WRITES : EFFECT_READONLY;
+        }
+    }
+    return EFFECT_PURE;
+}
+
+static EffectKind scan_effects(Effects* fx, AstNode* func, AstNode* n) {
+    EffectKind k = EFFECT_PURE;
+    switch (n->type) {
+    case AST_CALL:
+        k = call_effect(fx, n->name);
+        break;
+    case AST_IDENT:
+        // Identifiers with a child name struct literal fields, not variables
+        if (n->child_count == 0) k = access_effect(fx, func, n, 0);
+        break;
+    case AST_INDEX:
+    case AST_FIELD_ACCESS:
+        k = access_effect(fx, func, n, 0);
+        break;
+    case AST_DEREF:
+        k = EFFECT_READONLY;
+        break;
+    case AST_ASSIGN:
+        if (n->is_global) k = EFFECT_WRITES;
+        break;
+    case AST_STORE:
+        k = access_effect(fx, func, n->children[0], 1);
+        break;
+    default:
+        break;
+    }
+    for (int i = 0; i < n->child_count && k != EFFECT_WRITES; i++) {
+        EffectKind c = scan_effects(fx, func, n->children[i]);
+        if (c > k) k = c;
+    }
+    return k;
+}
+
+static int has_return(AstNode* n) {
+    if (n->type == AST_RETURN) return 1;
+    if (n->type == AST_INLINE) return 0;  // Its returns end the inlined body
+    for (int i = 0; i < n->child_count; i++) {
+        if (has_return(n->children[i])) return 1;
+    }
+    return 0;
+}
+
+// Does `n` contain a break out of the loop it is the body of?
+static int has_break(AstNode* n) {
+    if (n->type == AST_BREAK) return 1;
+    if (n->type == AST_WHILE || n->type == AST_FOR) return 0;
+    for (int i = 0; i < n->child_count; i++) {
+        if (has_break(n->children[i])) return 1;
+    }
+    return 0;
+}
+
+// Can control run past the end of statement `s`?
+static int falls_through(Effects* fx, AstNode* s) {
+    long v;
+    switch (s->type) {
+    case AST_BLOCK:
+        for (int i = 0; i < s->child_count; i++) {
+            if (!falls_through(fx, s->children[i])) return 0;
+        }
+        return 1;
+    case AST_CALL:
+        return !call_noreturn(fx, s->name);
+    case AST_IF:
+        return s->child_count < 3 || falls_through(fx, s->children[1]) || falls_through(fx, s->children[2]);
+    case AST_WHILE:
+        return !(ast_is_num(s->children[0], &v) && v != 0) || has_break(s->children[1]);
+    case AST_RETURN:
+    case AST_BREAK:
+    case AST_CONTINUE:
+        return 0;
+    default:
+        return 1;
+    }
+}
+
+// Cannot trap or run forever wherever it is evaluated. Callees must already
+// be known speculatable, so recursion never is.
+static int speculatable(Effects* fx, AstNode* n) {
+    long v;
+    switch (n->type) {
+    case AST_WHILE:
+    case AST_FOR:
+    case AST_VECTOR_LOOP:
+        return 0;
+    case AST_BINOP:
+        if ((n->op[0] == '/' || n->op[0] == '%') && !(ast_is_num(n->children[1], &v) && v != 0 && v != -1)) {
+            return 0;
+        }
+        break;
+    case AST_INDEX:
+        // Even a local array read past its end may fault
+        if (!ast_is_num(n->children[1], NULL)) return 0;
+        break;
+    case AST_CALL: {
+        FuncEffects* f = effects_lookup(fx, n->name);
+        if (!f || !f->speculatable) return 0;
+        break;
+    }
+    default:
+        break;
+    }
+    for (int i = 0; i < n->child_count; i++) {
+        if (!speculatable(fx, n->children[i])) return 0;
+    }
+    return 1;
+}
+
+Effects* analyze_effects(AstNode* prog) {
+    Effects* fx = calloc(1, sizeof(Effects));
+    fx->prog = prog;
+    for (int i = 0; i < prog->child_count; i++) {
+        if (prog->children[i]->type != AST_FUNCTION) continue;
+        fx->count++;
+        fx->funcs = realloc(fx->funcs, sizeof(FuncEffects) * fx->count);
+        memset(&fx->funcs[fx->count - 1], 0, sizeof(FuncEffects));
+        fx->funcs[fx->count - 1].func = prog->children[i];
+    }
+    // Effects only grow and noreturn only gets set, so both settle
+    for (int changed = 1; changed;) {
+        changed = 0;
+        for (int i = 0; i < fx->count; i++) {
+            FuncEffects* f = &fx->funcs[i];
+            AstNode* body = f->func->children[f->func->child_count - 1];
+            EffectKind k = scan_effects(fx, f->func, body);
+            int noreturn = !has_return(body) && !falls_through(fx, body);
+            if (k != f->kind || noreturn != f->noreturn) changed = 1;
+            f->kind = k;
+            f->noreturn = noreturn;
+        }
+    }
+    for (int changed = 1; changed;) {
+        changed = 0;
+        for (int i = 0; i < fx->count; i++) {
+            FuncEffects* f = &fx->funcs[i];
+            if (f->speculatable || f->kind != EFFECT_PURE) continue;
+            f->speculatable = speculatable(fx, f->func->children[f->func->child_count - 1]);
+            changed |= f->speculatable;
+        }
+    }
+    return fx;
+}
+
+int call_known_readonly(Effects* fx, AstNode* call) {
+    FuncEffects* f = fx ? effects_lookup(fx, call->name) : NULL;
+    return f && f->kind != EFFECT_WRITES;
+}
+
+int call_hoistable(Effects* fx, AstNode* call) {
+    FuncEffects* f = fx ? effects_lookup(fx, call->name) : NULL;
+    return f && f->speculatable && call->ty && call->ty->kind == TY_INT;
+}
+
+void effects_note_hoist(Effects* fx, AstNode* e) {
+    if (!fx || !fx->current) return;
+    if (e->type == AST_CALL) fx->current->hoisted++;
+    for (int i = 0; i < e->child_count; i++) effects_note_hoist(fx, e->children[i]);
+}
+
+// ---- Call simplification ----
+typedef struct CallCse {
+    Optimizer* opt;
+    Effects* fx;
+    AstNode* func;
+    NameSet escaped;     // Locals whose address is taken: pointers may change them
+    NameSet arrays;
+} CallCse;
+
+static int cse_candidate(CallCse* cs, AstNode* e);
+
+// Reads only unescaped scalar locals, so it keeps its value until one is assigned
+static int cse_stable(CallCse* cs, AstNode* e) {
+    switch (e->type) {
+    case AST_NUMBER:
+        return 1;
+    case AST_IDENT:
+        return e->child_count == 0 && !e->is_global && e->ty &&
+               (e->ty->kind == TY_INT || e->ty->kind == TY_PTR) && !nameset_has(&cs->escaped, e->name);
+    case AST_BINOP:
+    case AST_COMPARE:
+        return cse_stable(cs, e->children[0]) && cse_stable(cs, e->children[1]);
+    case AST_CALL:
+        return cse_candidate(cs, e);
+    default:
+        return 0;
+    }
+}
+
+static int cse_candidate(CallCse* cs, AstNode* e) {
+    if (e->type != AST_CALL || !e->ty || e->ty->kind != TY_INT) return 0;
+    FuncEffects* f = effects_lookup(cs->fx, e->name);
+    if (!f || f->kind != EFFECT_PURE || f->noreturn) return 0;
+    for (int i = 0; i < e->child_count; i++) {
+        if (!cse_stable(cs, e->children[i])) return 0;
+    }
+    return 1;
+}
+
+// Leading children of `s` evaluated once, before any statement nested in it
+static int stmt_heads(AstNode* s) {
+    switch (s->type) {
+    case AST_LET:
+    case AST_ASSIGN:
+    case AST_RETURN:
+    case AST_STORE:
+    case AST_CALL:
+        return s->child_count;
+    case AST_IF:
+    case AST_MATCH:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+static int count_equal(AstNode* n, AstNode* e) {
+    if (ast_equal(n, e)) return 1;
+    int count = 0;
+    for (int i = 0; i < n->child_count; i++) count += count_equal(n->children[i], e);
+    return count;
+}
+
+static int heads_count_equal(AstNode* s, AstNode* e) {
+    int count = 0;
+    for (int i = 0; i < stmt_heads(s); i++) count += count_equal(s->children[i], e);
+    return count;
+}
+
+static int assigns(AstNode* n, char* name) {
+    if ((n->type == AST_ASSIGN || n->type == AST_LET) && !strcmp(n->name, name)) return 1;
+    for (int i = 0; i < n->child_count; i++) {
+        if (assigns(n->children[i], name)) return 1;
+    }
+    return 0;
+}
+
+// Does statement `s` assign a variable that `e` reads?
+static int kills(AstNode* s, AstNode* e) {
+    if (e->type == AST_IDENT && e->child_count == 0) return assigns(s, e->name);
+    for (int i = 0; i < e->child_count; i++) {
+        if (kills(s, e->children[i])) return 1;
+    }
+    return 0;
+}
+
+// Is the call `e` in statement `at` of `block` evaluated again with the same value?
+static int cse_repeats(AstNode* block, int at, AstNode* e) {
+    if (heads_count_equal(block->children[at], e) > 1) return 1;
+    if (kills(block->children[at], e)) return 0;
+    for (int i = at + 1; i < block->child_count; i++) {
+        if (heads_count_equal(block->children[i], e) > 0) return 1;
+        if (kills(block->children[i], e)) return 0;
+    }
+    return 0;
+}
+
+// Values computed so far and the variables holding them
+typedef struct Available {
+    AstNode** exprs;
+    char** vars;
+    int count;
+} Available;
+
+static void avail_add(Available* av, AstNode* e, char* var) {
+    av->count++;
+    av->exprs = realloc(av->exprs, sizeof(AstNode*) * av->count);
+    av->vars = realloc(av->vars, sizeof(char*) * av->count);
+    av->exprs[av->count - 1] = e;
+    av->vars[av->count - 1] = var;
+}
+
+static char* avail_find(Available* av, AstNode* e) {
+    for (int i = 0; i < av->count; i++) {
+        if (ast_equal(av->exprs[i], e)) return av->vars[i];
+    }
+    return NULL;
+}
+
+// Compute `e` into a fresh temp declared before statement `at` of `block`
+static void avail_temp(Optimizer* opt, Available* av, AstNode* block, int* at, AstNode* e, const char* prefix) {
+    char* name = opt_temp(opt, prefix);
+    AstNode* init = ast_clone(e);
+    ast_insert(block, (*at)++, ast_let(name, init));
+    avail_add(av, init, name);
+    ast_replace(e, ast_ident(name));
+}
+
+static void cse_expr(CallCse* cs, Available* av, AstNode* block, int* at, AstNode* e) {
+    if (cse_candidate(cs, e)) {
+        char* var = avail_find(av, e);
+        if (var) {
+            ast_replace(e, ast_ident(var));
+            cs->fx->current->reused++;
+            return;
+        }
+        if (cse_repeats(block, *at, e)) {
+            avail_temp(cs->opt, av, block, at, e, "cse");
+            return;
+        }
+    }
+    for (int i = 0; i < e->child_count; i++) cse_expr(cs, av, block, at, e->children[i]);
+}
+
+// A call statement that only computes a value nobody uses, and is sure to
+// return without trapping
+static int call_is_dead(CallCse* cs, AstNode* s) {
+    return s->type == AST_CALL && scan_effects(cs->fx, cs->func, s) != EFFECT_WRITES && speculatable(cs->fx, s);
+}
+
+static void simplify_block(CallCse* cs, AstNode* block);
+
+// Blocks nested in a statement start with nothing computed
+static void simplify_nested(CallCse* cs, AstNode* s) {
+    for (int i = 0; i < s->child_count; i++) {
+        AstNode* c = s->children[i];
+        if (c->type == AST_BLOCK) simplify_block(cs, c);
+        else if (c->type == AST_IF || c->type == AST_WHILE || c->type == AST_MATCH_ARM) simplify_nested(cs, c);
+    }
+}
+
+static void simplify_block(CallCse* cs, AstNode* block) {
+    Available av = {NULL, NULL, 0};
+    for (int i = 0; i < block->child_count; i++) {
+        AstNode* s = block->children[i];
+        if (call_is_dead(cs, s)) {
+            ast_remove(block, i--);
+            cs->fx->current->deleted++;
+            continue;
+        }
+        for (int h = 0; h < stmt_heads(s); h++) cse_expr(cs, &av, block, &i, s->children[h]);
+        int n = 0;
+        for (int j = 0; j < av.count; j++) {
+            if (kills(s, av.exprs[j])) continue;
+            av.exprs[n] = av.exprs[j];
+            av.vars[n++] = av.vars[j];
+        }
+        av.count = n;
+        if (s->type == AST_BLOCK) simplify_block(cs, s);
+        else simplify_nested(cs, s);
+        // Nothing after a call that never returns can run
+        if (s->type == AST_CALL && call_noreturn(cs->fx, s->name)) block->child_count = i + 1;
+    }
+    free(av.exprs);
+    free(av.vars);
+}
+
+void simplify_calls(Optimizer* opt, AstNode* func) {
+    CallCse cs;
+    memset(&cs, 0, sizeof(cs));
+    cs.opt = opt;
+    cs.fx = opt->effects;
+    cs.func = func;
+    AstNode* body = func->children[func->child_count - 1];
+    collect_function_facts(body, &cs.escaped, &cs.arrays);
+    simplify_block(&cs, body);
+}
+
+void effects_report(Effects* fx) {
+    for (int i = 0; i < fx->count; i++) {
+        FuncEffects* f = &fx->funcs[i];
+        printf("purity: fn %s: %s%s", f->func->name, effect_names[f->kind], f->noreturn ? ", noreturn" : "");
+        if (f->reused || f->hoisted || f->deleted) {
+            printf(" (calls: %d reused, %d hoisted, %d deleted)", f->reused, f->hoisted, f->deleted);
+        }
+        printf("\n");
+    }
+}
+
+// ==== VALUE NUMBERING ====
+// Runs last, after the loop rewrites, and reuses values in straight-line
+// code and in the blocks it dominates. An arithmetic expression or load that
+// was already computed is replaced by the variable holding it. That is
+// either the `let` it initialized or a fresh `__gvn` temp made at its first
+// use. The value is dropped when one of its operands is assigned, or when a
+// store or call may write the memory it loads.
+typedef struct ValueNumbering {
+    Optimizer* opt;
+    NameSet escaped;     // Address taken, global or passed on as an array: pointers reach it
+    NameSet arrays;
+} ValueNumbering;
+
+// Arrays named anywhere but as the base of an index decay to pointers
+static void collect_array_escapes(AstNode* n, NameSet* escaped) {
+    if (n->type == AST_IDENT && n->child_count == 0 && n->ty && n->ty->kind == TY_ARRAY) {
+        nameset_add(escaped, n->name);
+    }
+    for (int i = 0; i < n->child_count; i++) {
+        AstNode* c = n->children[i];
+        if (i == 0 && n->type == AST_INDEX && c->type == AST_IDENT) continue;
+        collect_array_escapes(c, escaped);
+    }
+}
+
+static int vn_is_load(AstNode* e) {
+    return e->type == AST_INDEX || e->type == AST_FIELD_ACCESS || e->type == AST_DEREF;
+}
+
+// Its value only changes when a variable it reads is assigned or memory it
+// loads is written
+static int vn_stable(ValueNumbering* vn, AstNode* e) {
+    AstNode* base;
+    switch (e->type) {
+    case AST_NUMBER:
+        return 1;
+    case AST_IDENT:
+        return e->child_count == 0 && !e->is_global && e->ty && (e->ty->kind == TY_INT || e->ty->kind == TY_PTR) &&
+               !nameset_has(&vn->escaped, e->name);
+    case AST_BINOP:
+    case AST_COMPARE:
+        return vn_stable(vn, e->children[0]) && vn_stable(vn, e->children[1]);
+    case AST_INDEX:
+    case AST_FIELD_ACCESS:
+        // Arrays and structs are read in place, pointers by value
+        base = e->children[0];
+        if (!(base->type == AST_IDENT && base->child_count == 0 && base->ty &&
+              (base->ty->kind == TY_ARRAY || base->ty->kind == TY_STRUCT)) && !vn_stable(vn, base)) return 0;
+        return e->type == AST_FIELD_ACCESS || vn_stable(vn, e->children[1]);
+    case AST_DEREF:
+        return vn_stable(vn, e->children[0]);
+    default:
+        return 0;
+    }
+}
+
+// Costs more to recompute than to reload: a load, multiply or divide
+static int vn_worth(AstNode* e) {
+    if (vn_is_load(e) || (e->type == AST_BINOP && strchr("*/%", e->op[0]))) return 1;
+    for (int i = 0; i < e->child_count; i++) {
+        if (vn_worth(e->children[i])) return 1;
+    }
+    return 0;
+}
+
+// Comparisons stay in place so branches and cmov test the flags directly
+static int vn_candidate(ValueNumbering* vn, AstNode* e) {
+    return (e->type == AST_BINOP || vn_is_load(e)) && e->ty && (e->ty->kind == TY_INT || e->ty->kind == TY_PTR) &&
+           vn_stable(vn, e) && vn_worth(e);
+}
+
+// Pointers may reach the object under `root` (NULL: reached through a pointer)
+static int vn_aliased(ValueNumbering* vn, AstNode* root) {
+    return !root || root->is_global || nameset_has(&vn->escaped, root->name);
+}
+
+// Does `e` read variable `name`, or load memory that writing it changes?
+static int vn_reads(ValueNumbering* vn, AstNode* e, char* name, int aliased) {
+    if (e->type == AST_IDENT && e->child_count == 0 && !strcmp(e->name, name)) return 1;
+    if (vn_is_load(e)) {
+        AstNode* root = access_root(e);
+        if (root ? !strcmp(root->name, name) : aliased) return 1;
+    }
+    for (int i = 0; i < e->child_count; i++) {
+        if (vn_reads(vn, e->children[i], name, aliased)) return 1;
+    }
+    return 0;
+}
+
+// Does `e` load memory that a store to `target` or a call may write
+// (`target` NULL: anything pointers reach)?
+static int vn_loads_aliased(ValueNumbering* vn, AstNode* e, AstNode* target) {
+    if (vn_is_load(e)) {
+        AstNode* root = access_root(e);
+        AstNode* troot = target ? access_root(target) : NULL;
+        if (!target) {
+            if (vn_aliased(vn, root)) return 1;
+        } else if (root && troot) {
+            if (!strcmp(root->name, troot->name)) return 1;
+        } else if (vn_aliased(vn, root ? root : troot)) {
+            return 1;
+        }
+    }
+    for (int i = 0; i < e->child_count; i++) {
+        if (vn_loads_aliased(vn, e->children[i], target)) return 1;
+    }
+    return 0;
+}
+
+static int vn_call_writes(Effects* fx, AstNode* call) {
+    if (!strcmp(call->name, "print") || !strcmp(call->name, "println") || !strcmp(call->name, "print_int") ||
+        !strcmp(call->name, "exit")) return 0;
+    return call_effect(fx, call->name) == EFFECT_WRITES;
+}
+
+// Can running `n` change the value of `e` or reassign `var`, its holder?
+static int vn_kills(ValueNumbering* vn, AstNode* n, AstNode* e, char* var) {
+    switch (n->type) {
+    case AST_LET:
+    case AST_ASSIGN:
+        if ((var && !strcmp(n->name, var)) ||
+            vn_reads(vn, e, n->name, n->is_global || nameset_has(&vn->escaped, n->name))) return 1;
+        break;
+    case AST_STORE:
+        if (vn_loads_aliased(vn, e, n->children[0])) return 1;
+        break;
+    case AST_CALL:
+        if (vn_call_writes(vn->opt->effects, n) && vn_loads_aliased(vn, e, NULL)) return 1;
+        break;
+    case AST_VECTOR_LOOP:
+        return 1;
+    default:
+        break;
+    }
+    for (int i = 0; i < n->child_count; i++) {
+        if (vn_kills(vn, n->children[i], e, var)) return 1;
+    }
+    return 0;
+}
+
+// Uses of the value of `e` in `n` (`target`: n is assigned or has its address taken)
+static int vn_count(AstNode* n, AstNode* e, int target) {
+    if (!target && ast_equal(n, e)) return 1;
+    int count = 0;
+    for (int i = 0; i < n->child_count; i++) count += vn_count(n->children[i], e, n->type == AST_ADDR_OF);
+    return count;
+}
+
+static int vn_head_count(AstNode* s, AstNode* e) {
+    int count = 0;
+    for (int i = 0; i < stmt_heads(s); i++) count += vn_count(s->children[i], e, s->type == AST_STORE && i == 0);
+    return count;
+}
+
+// Is `e`, first used in statement `at` of `block`, used again before it changes?
+static int vn_repeats(ValueNumbering* vn, AstNode* block, int at, AstNode* e) {
+    AstNode* s = block->children[at];
+    if (vn_head_count(s, e) > 1) return 1;
+    if ((s->type == AST_IF || s->type == AST_MATCH) && vn_count(s, e, 0) > 1) return 1;
+    if (vn_kills(vn, s, e, NULL)) return 0;
+    for (int i = at + 1; i < block->child_count; i++) {
+        AstNode* next = block->children[i];
+        if (vn_head_count(next, e) > 0) return 1;
+        // Later uses in an if or a loop that leaves it alone are dominated by this one
+        int kill = vn_kills(vn, next, e, NULL);
+        if ((next->type == AST_IF || next->type == AST_MATCH || (next->type == AST_WHILE && !kill)) &&
+            vn_count(next, e, 0) > 0) return 1;
+        if (kill) return 0;
+    }
+    return 0;
+}
+
+static void vn_expr(ValueNumbering* vn, Available* av, AstNode* block, int* at, AstNode* e, int target) {
+    if (e->type == AST_INLINE) return;  // Its statements are numbered on their own
+    if (!target && vn_candidate(vn, e)) {
+        char* var = avail_find(av, e);
+        if (var) {
+            ast_replace(e, ast_ident(var));
+            return;
+        }
+        // The temp is computed ahead of the statement: nothing in it may change the value first
+        int safe = 1;
+        AstNode* s = block->children[*at];
+        for (int i = 0; i < stmt_heads(s) && safe; i++) safe = !vn_kills(vn, s->children[i], e, NULL);
+        if (safe && vn_repeats(vn, block, *at, e)) {
+            avail_temp(vn->opt, av, block, at, e, "gvn");
+            return;
+        }
+    }
+    for (int i = 0; i < e->child_count; i++) vn_expr(vn, av, block, at, e->children[i], e->type == AST_ADDR_OF);
+}
+
+// Keep the values `n` cannot change
+static void vn_filter(ValueNumbering* vn, Available* av, AstNode* n) {
+    int kept = 0;
+    for (int i = 0; i < av->count; i++) {
+        if (vn_kills(vn, n, av->exprs[i], av->vars[i])) continue;
+        av->exprs[kept] = av->exprs[i];
+        av->vars[kept++] = av->vars[i];
+    }
+    av->count = kept;
+}
+
+static void vn_block(ValueNumbering* vn, AstNode* block, Available* outer);
+
+// Blocks nested in `s` start with the values known where they begin
+static void vn_nested(ValueNumbering* vn, AstNode* s, Available* av) {
+    for (int i = 0; i < s->child_count; i++) {
+        AstNode* c = s->children[i];
+        if (c->type == AST_BLOCK) {
+            vn_block(vn, c, av);
+        } else if (c->type == AST_IF) {
+            // else if: its condition runs first
+            Available inner = {NULL, NULL, 0};
+            for (int j = 0; j < av->count; j++) avail_add(&inner, av->exprs[j], av->vars[j]);
+            vn_filter(vn, &inner, c->children[0]);
+            vn_nested(vn, c, &inner);
+            free(inner.exprs);
+            free(inner.vars);
+        } else if (c->type == AST_MATCH_ARM) {
+            vn_nested(vn, c, av);
+        }
+    }
+}
+
+static void vn_block(ValueNumbering* vn, AstNode* block, Available* outer) {
+    Available av = {NULL, NULL, 0};
+    for (int i = 0; outer && i < outer->count; i++) avail_add(&av, outer->exprs[i], outer->vars[i]);
+    for (int i = 0; i < block->child_count; i++) {
+        AstNode* s = block->children[i];
+        // The scalar loop after a vector kernel shares expressions with it
+        if (s->type == AST_VECTOR_LOOP) {
+            av.count = 0;
+            i++;
+            continue;
+        }
+        // A call in the statement may write memory before any value is used
+        for (int h = 0; h < stmt_heads(s); h++) vn_filter(vn, &av, s->children[h]);
+        for (int h = 0; h < stmt_heads(s); h++) vn_expr(vn, &av, block, &i, s->children[h], s->type == AST_STORE && h == 0);
+        if (s->type == AST_WHILE) {
+            Available inner = {NULL, NULL, 0};
+            for (int j = 0; j < av.count; j++) avail_add(&inner, av.exprs[j], av.vars[j]);
+            vn_filter(vn, &inner, s);
+            vn_block(vn, s->children[1], &inner);
+            free(inner.exprs);
+            free(inner.vars);
+        } else if (s->type == AST_BLOCK) {
+            vn_block(vn, s, &av);
+        } else if (s->type == AST_IF || s->type == AST_MATCH) {
+            vn_nested(vn, s, &av);
+        }
+        vn_filter(vn, &av, s);
+        // `let v = e` holds e for later uses
+        if (s->type == AST_LET && s->child_count == 1 && s->ty && type_equal(s->ty, s->children[0]->ty) &&
+            !nameset_has(&vn->escaped, s->name) && vn_candidate(vn, s->children[0]) &&
+            !vn_reads(vn, s->children[0], s->name, 0)) {
+            avail_add(&av, s->children[0], s->name);
+        }
+    }
+    free(av.exprs);
+    free(av.vars);
+}
+
+void number_values(Optimizer* opt, AstNode* func) {
+    ValueNumbering vn;
+    memset(&vn, 0, sizeof(vn));
+    vn.opt = opt;
+    AstNode* body = func->children[func->child_count - 1];
+    collect_function_facts(body, &vn.escaped, &vn.arrays);
+    collect_array_escapes(body, &vn.escaped);
+    for (int i = 0; i < func->child_count - 1; i++) {
+        // Array parameters are the caller's arrays
+        AstNode* param = func->children[i];
+        if (param->ty && param->ty->kind == TY_ARRAY) nameset_add(&vn.escaped, param->name);
+    }
+    vn_block(&vn, body, NULL);
+}
+
+void optimize(Optimizer* opt, AstNode* prog) {
+    if (opt->opts->opt_level < 1) return;
+    accumulate_recursion(prog);
+    opt->effects = analyze_effects(prog);
+    for (int i = 0; i < prog->child_count; i++) {
+        if (prog->children[i]->type != AST_FUNCTION) continue;
+        opt->effects->current = effects_lookup(opt->effects, prog->children[i]->name);
+        simplify_calls(opt, prog->children[i]);
+    }
+    inline_functions(opt, prog);
+    eliminate_dead_functions(opt, prog);
+    for (int i = 0; i < prog->child_count; i++) {
+        if (prog->children[i]->type != AST_FUNCTION) continue;
+        opt->effects->current = effects_lookup(opt->effects, prog->children[i]->name);
+        if (opt->opts->vectorize) vectorize_loops(prog->children[i]);
+        unroll_loops(opt, prog->children[i]);
+        optimize_loops(opt, prog->children[i]);
+        number_values(opt, prog->children[i]);
+    }
+    if (opt->opts->purity_report) effects_report(opt->effects);
+}
+
+// ==== CODEGEN ====
+void emit(Codegen* cg, const char* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+
+    va_list args_copy;
+    va_copy(args_copy, args);
+    int needed = vsnprintf(NULL, 0, fmt, args_copy);
+    va_end(args_copy);
 
     while (cg->code_len + needed + 1 > cg->code_cap) {
         cg->code_cap = cg->code_cap ? cg->code_cap * 2 : 4096;
         cg->code_buf = realloc(cg->code_buf, cg->code_cap);
     }
 
-    vsnprintf(cg->code_buf + cg->code_len, needed + 1, fmt, args);
-    cg->code_len += needed;
+    vsnprintf(cg->code_buf + cg->code_len, needed + 1, fmt, args);
+    cg->code_len += needed;
+
+    va_end(args);
+}
+
+int new_label(Codegen* cg) { return cg->label_count++; }
+
+// Loop tops start a 16-byte fetch block (cold code stays compact)
+static void gen_loop_align(Codegen* cg) {
+    if (cg->opts->opt_level >= 1 && !cg->in_unlikely) emit(cg, "    align 16\n");
+}
+
+static void gen_loop_bound(Codegen* cg, int label, long bound, int line) {
+    cg->loops = realloc(cg->loops, sizeof(LoopBound) * (cg->loop_count + 1));
+    cg->loops[cg->loop_count++] = (LoopBound){label, bound, line};
+}
+
+// Expression temporaries go through these so calls know how far rsp is off
+// its 16-byte alignment
+static void gen_push(Codegen* cg) {
+    emit(cg, "    push rax\n");
+    cg->pushes++;
+}
+
+static void gen_pop(Codegen* cg, const char* reg) {
+    emit(cg, "    pop %s\n", reg);
+    cg->pushes--;
+}
+
+void gen_expr(Codegen* cg, AstNode* n);
+void gen_stmt(Codegen* cg, AstNode* n);
+
+// A variable of the function being generated, or a global
+Symbol* cg_lookup(Codegen* cg, char* name) {
+    Symbol* sym = cg->symtab ? symtab_lookup_symbol(cg->symtab, name) : NULL;
+    return sym ? sym : symtab_lookup_symbol(cg->globals, name);
+}
+
+// Memory operand (without brackets) `disp` bytes into a variable: a frame
+// slot, or a global's label addressed RIP-relative
+char* var_addr(Symbol* sym, int disp, char* buf) {
+    if (!sym->label) sprintf(buf, "rbp%d", sym->offset + disp);
+    else if (disp) sprintf(buf, "rel %s+%d", sym->label, disp);
+    else sprintf(buf, "rel %s", sym->label);
+    return buf;
+}
+
+// Load the value of type `ty` stored at [addr] into rax (eax if narrow);
+// arrays and structs evaluate to the address itself
+void gen_load(Codegen* cg, Type* ty, const char* addr) {
+    int size = type_size(ty);
+    if (type_is_aggregate(ty)) emit(cg, "    lea rax, [%s]\n", addr);
+    else if (size < 4) {
+        emit(cg, "    %s eax, %s [%s]\n", type_is_unsigned(ty) ? "movzx" : "movsx",
+             size == 1 ? "byte" : "word", addr);
+    }
+    else if (type_is_narrow(ty)) emit(cg, "    mov eax, [%s]\n", addr);
+    else emit(cg, "    mov rax, [%s]\n", addr);
+}
+
+void gen_store(Codegen* cg, Type* ty, const char* addr) {
+    int size = type_size(ty);
+    const char* reg = size == 1 ? "al" : size == 2 ? "ax" : size == 4 ? "eax" : "rax";
+    emit(cg, "    mov [%s], %s\n", addr, reg);
+}
+
+// Evaluate `n` converted to `target`: signed narrow values are sign-extended
+// when the target needs a full register (NULL target = 64-bit); unsigned ones
+// already are zero-extended. Truncation is left to the store.
+void gen_expr_as(Codegen* cg, AstNode* n, Type* target) {
+    gen_expr(cg, n);
+    if (type_is_narrow(n->ty) && !type_is_unsigned(n->ty) && !type_is_narrow(target)) {
+        emit(cg, "    movsxd rax, eax\n");
+    }
+}
+
+// A sub-32-bit value that stays in a register (a return value) must be
+// truncated and re-extended there, as no store will do it
+void gen_expr_value(Codegen* cg, AstNode* n, Type* target) {
+    gen_expr_as(cg, n, target);
+    int size = type_size(target);
+    if (target && target->kind == TY_INT && size < 4 && !type_equal(n->ty, target)) {
+        emit(cg, "    %s eax, %s\n", target->is_unsigned ? "movzx" : "movsx", size == 1 ? "al" : "ax");
+    }
+}
+
+// Evaluate a condition and set ZF when it is false
+void gen_cond(Codegen* cg, AstNode* n) {
+    gen_expr(cg, n);
+    emit(cg, type_is_narrow(n->ty) ? "    test eax, eax\n" : "    test rax, rax\n");
+}
+
+
+// rax = rbx + rax * size
+static void gen_scale_index(Codegen* cg, int size) {
+    if (size == 1 || size == 2 || size == 4 || size == 8) {
+        emit(cg, "    lea rax, [rbx+rax*%d]\n", size);
+    } else {
+        emit(cg, "    imul rax, rax, %d\n    add rax, rbx\n", size);
+    }
+}
+
+// rax = address of base[index] for elements `size` bytes apart, plus `disp`
+static void gen_element_addr(Codegen* cg, AstNode* base, AstNode* index, int size, int disp) {
+    gen_expr_as(cg, index, NULL);
+    Symbol* sym = base->type == AST_IDENT ? cg_lookup(cg, base->name) : NULL;
+    char addr[64];
+    if (sym && !sym->label && sym->ty->kind == TY_ARRAY && (size == 1 || size == 2 || size == 4 || size == 8)) {
+        emit(cg, "    lea rax, [rbp%d+rax*%d]\n", sym->offset + disp, size);
+        return;
+    }
+    if (sym && sym->ty->kind == TY_PTR) {
+        emit(cg, "    mov rbx, [%s]\n", var_addr(sym, 0, addr));
+    } else if (sym) {
+        // An array's address, displacement included
+        emit(cg, "    lea rbx, [%s]\n", var_addr(sym, disp, addr));
+        disp = 0;
+    } else {
+        gen_push(cg);
+        gen_expr(cg, base);  // Pointers load, arrays decay to their address
+        emit(cg, "    mov rbx, rax\n");
+        gen_pop(cg, "rax");
+    }
+    gen_scale_index(cg, size);
+    if (disp) emit(cg, "    add rax, %d\n", disp);
+}
+
+// Compute the address of an lvalue into rax
+void gen_addr(Codegen* cg, AstNode* n) {
+    if (n->type == AST_IDENT) {
+        char addr[64];
+        emit(cg, "    lea rax, [%s]\n", var_addr(cg_lookup(cg, n->name), 0, addr));
+    } else if (n->type == AST_INDEX) {
+        if (type_is_soa(n->ty)) {
+            type_error("an element of a @soa %s array is only reachable through its fields", n->ty->name);
+        }
+        gen_element_addr(cg, n->children[0], n->children[1], type_size(n->ty), 0);
+    } else if (n->type == AST_DEREF) {
+        gen_expr(cg, n->children[0]);
+    } else if (n->type == AST_FIELD_ACCESS) {
+        AstNode* obj = n->children[0];
+        StructField* f = typetab_field(cg->types, obj->ty->name, n->name);
+        if (obj->type == AST_INDEX && type_is_soa(obj->ty)) {
+            // arr[i].f of a @soa array is element i of f's own array
+            AstNode* arr = obj->children[0];
+            gen_element_addr(cg, arr, obj->children[1], type_size(f->ty),
+                             soa_field_offset(obj->ty->st, f, arr->ty->length));
+            return;
+        }
+        if (obj->type == AST_DEREF) gen_expr(cg, obj->children[0]);
+        else gen_addr(cg, obj);
+        if (f->offset) emit(cg, "    add rax, %d\n", f->offset);
+    } else {
+        gen_expr(cg, n);  // A struct-valued call: its result's address
+    }
+}
+
+// Copy `size` bytes from [rax] to [rbx] (r10/r11 are free outside vector kernels)
+static void gen_copy(Codegen* cg, int size) {
+    int off = 0;
+    if (size > 64) {
+        int loop = new_label(cg);
+        gen_loop_bound(cg, loop, size / 8, 0);
+        emit(cg, "    xor r10, r10\n.L%d:\n", loop);
+        emit(cg, "    mov r11, [rax+r10]\n    mov [rbx+r10], r11\n");
+        emit(cg, "    add r10, 8\n    cmp r10, %d\n    jb .L%d\n", size / 8 * 8, loop);
+        off = size / 8 * 8;
+    }
+    for (; off + 8 <= size; off += 8) emit(cg, "    mov r11, [rax+%d]\n    mov [rbx+%d], r11\n", off, off);
+    for (; off + 4 <= size; off += 4) emit(cg, "    mov r11d, [rax+%d]\n    mov [rbx+%d], r11d\n", off, off);
+    for (; off + 2 <= size; off += 2) emit(cg, "    mov r11w, [rax+%d]\n    mov [rbx+%d], r11w\n", off, off);
+    for (; off < size; off++) emit(cg, "    mov r11b, [rax+%d]\n    mov [rbx+%d], r11b\n", off, off);
+}
+
+// Initialize the object of type `ty` at [rbp+off] (a local), or at [addr+off]
+// with addr on top of the stack, from `value`. Struct and array literals are
+// written field by field; other aggregates are copied.
+static void gen_init(Codegen* cg, Type* ty, AstNode* value, int on_stack, int off) {
+    if (value->type == AST_STRUCT_LITERAL) {
+        for (int i = 0; i < value->child_count; i++) {
+            StructField* f = typetab_field(cg->types, value->struct_type, value->children[i]->name);
+            gen_init(cg, f->ty, value->children[i]->children[0], on_stack, off + f->offset);
+        }
+        return;
+    }
+    if (value->type == AST_ARRAY_LITERAL) {
+        Type* elem = ty->base;
+        for (int i = 0; i < value->child_count; i++) {
+            gen_init(cg, elem, value->children[i], on_stack, off + i * type_size(elem));
+        }
+        return;
+    }
+    char addr[32];
+    gen_expr_as(cg, value, ty);
+    if (on_stack) {
+        emit(cg, "    mov rbx, [rsp]\n");
+        snprintf(addr, sizeof(addr), "rbx+%d", off);
+    } else {
+        snprintf(addr, sizeof(addr), "rbp%d", off);
+    }
+    if (type_is_aggregate(ty)) {
+        emit(cg, "    lea rbx, [%s]\n", addr);
+        gen_copy(cg, type_size(ty));
+    } else {
+        gen_store(cg, ty, addr);
+    }
+}
+
+static const char* arg_regs[] = {"rdi", "rsi", "rdx", "rcx", "r8", "r9"};
+static const char* arg_regs32[] = {"edi", "esi", "edx", "ecx", "r8d", "r9d"};
+static const char* arg_regs16[] = {"di", "si", "dx", "cx", "r8w", "r9w"};
+static const char* arg_regs8[] = {"dil", "sil", "dl", "cl", "r8b", "r9b"};
+
+// Argument register i sized for spilling a parameter of type `ty`
+static const char* param_reg(int i, Type* ty) {
+    int size = type_size(ty);
+    if (type_is_aggregate(ty)) size = 8;
+    return size == 1 ? arg_regs8[i] : size == 2 ? arg_regs16[i] : size == 4 ? arg_regs32[i] : arg_regs[i];
+}
+
+// ---- Struct passing ----
+// SysV classification for structs of integer fields: up to 16 bytes with
+// every field at its natural alignment, a struct travels in one general
+// register per eightbyte (rdi:rsi ... as an argument, rax:rdx as a result).
+// Anything else is passed as a copy on the stack, and returned through a
+// hidden pointer the caller passes in rdi and the callee hands back in rax.
+static int struct_fields_aligned(StructType* st) {
+    for (int i = 0; i < st->field_count; i++) {
+        Type* ty = st->fields[i].ty;
+        if (st->fields[i].offset % type_align(ty)) return 0;
+        if (ty->kind == TY_STRUCT && !struct_fields_aligned(ty->st)) return 0;
+    }
+    return 1;
+}
+
+// Registers a struct value travels in: 1 or 2, or 0 for memory
+static int struct_regs(Type* t) {
+    if (!t || t->kind != TY_STRUCT || t->st->size == 0 || t->st->size > 16) return 0;
+    return struct_fields_aligned(t->st) ? (t->st->size + 7) / 8 : 0;
+}
+
+static int returns_in_memory(Type* t) {
+    return t && t->kind == TY_STRUCT && !struct_regs(t);
+}
+
+static const char* reg_names[][4] = {
+    {"rax", "eax", "ax", "al"}, {"rbx", "ebx", "bx", "bl"}, {"rcx", "ecx", "cx", "cl"},
+    {"rdx", "edx", "dx", "dl"}, {"rsi", "esi", "si", "sil"}, {"rdi", "edi", "di", "dil"},
+    {"r8", "r8d", "r8w", "r8b"}, {"r9", "r9d", "r9w", "r9b"}, {"r11", "r11d", "r11w", "r11b"},
+};
+
+// The low `bytes` (1, 2, 4 or 8) of 64-bit register `reg`
+static const char* reg_part(const char* reg, int bytes) {
+    int i = 0;
+    while (strcmp(reg_names[i][0], reg)) i++;
+    return reg_names[i][bytes == 8 ? 0 : bytes == 4 ? 1 : bytes == 2 ? 2 : 3];
+}
+
+// Load the `bytes` (1-8) at [base+off] into `dst`, zero-extended, without
+// reading past them. Odd sizes are assembled in r11 from the top piece down.
+static void gen_load_bytes(Codegen* cg, const char* dst, const char* base, int off, int bytes) {
+    static const char* widths[] = {"", "byte", "word", "", "dword"};
+    if (bytes == 8) {
+        emit(cg, "    mov %s, [%s%+d]\n", dst, base, off);
+        return;
+    }
+    const char* acc = (bytes & (bytes - 1)) ? "r11" : dst;
+    int at = bytes;
+    for (int p = 1; p <= 4; p *= 2) {
+        if (!(bytes & p)) continue;
+        at -= p;
+        const char* piece = at + p == bytes ? acc : dst;
+        if (p == 4) emit(cg, "    mov %s, [%s%+d]\n", reg_part(piece, 4), base, off + at);
+        else emit(cg, "    movzx %s, %s [%s%+d]\n", reg_part(piece, 4), widths[p], base, off + at);
+        if (piece != acc) emit(cg, "    shl r11, %d\n    or r11, %s\n", p * 8, dst);
+    }
+    if (acc != dst) emit(cg, "    mov %s, r11\n", dst);
+}
+
+// Store the low `bytes` (1-8) of `src` to [base+off]
+static void gen_store_bytes(Codegen* cg, const char* src, const char* base, int off, int bytes) {
+    if (!(bytes & (bytes - 1))) {
+        emit(cg, "    mov [%s%+d], %s\n", base, off, reg_part(src, bytes));
+        return;
+    }
+    emit(cg, "    mov r11, %s\n", src);
+    for (int p = 4; p >= 1; p /= 2) {
+        if (!(bytes & p)) continue;
+        emit(cg, "    mov [%s%+d], %s\n", base, off, reg_part("r11", p));
+        if (p > 1 && (bytes & (p - 1))) emit(cg, "    shr r11, %d\n", p * 8);
+        off += p;
+    }
+}
+
+// Copy `size` bytes from [src+src_off] to [dst+dst_off] through rax
+static void gen_move_bytes(Codegen* cg, const char* dst, int dst_off, const char* src, int src_off, int size) {
+    for (int at = 0; at < size;) {
+        int p = size - at >= 8 ? 8 : size - at >= 4 ? 4 : size - at >= 2 ? 2 : 1;
+        emit(cg, "    mov %s, [%s%+d]\n", reg_part("rax", p), src, src_off + at);
+        emit(cg, "    mov [%s%+d], %s\n", dst, dst_off + at, reg_part("rax", p));
+        at += p;
+    }
+}
+
+// Where each argument of a call to (or parameter of) a function goes: an
+// argument register index in regs[i], or -1 and a byte offset into the stack
+// arguments in offs[i]. Returns the bytes of stack arguments.
+static int assign_args(Type** types, int count, int hidden_ret, int* regs, int* offs) {
+    int next = hidden_ret ? 1 : 0;
+    int stack = 0;
+    for (int i = 0; i < count; i++) {
+        Type* ty = types[i];
+        int need = ty && ty->kind == TY_STRUCT ? struct_regs(ty) : 1;
+        regs[i] = -1;
+        if (need && next + need <= 6) {
+            regs[i] = next;
+            next += need;
+            continue;
+        }
+        int size = ty && ty->kind == TY_STRUCT ? type_size(ty) : 8;
+        if (ty && type_align(ty) > 8) stack = (stack + 15) & ~15;
+        offs[i] = stack;
+        stack += (size + 7) & ~7;
+    }
+    return stack;
+}
+
+// Evaluating `n` may overwrite argument registers: it calls out, or
+// divides (rdx)
+static int clobbers_arg_regs(AstNode* n) {
+    if (n->type == AST_CALL || n->type == AST_INLINE) return 1;
+    if (n->type == AST_BINOP && (n->op[0] == '/' || n->op[0] == '%')) return 1;
+    for (int i = 0; i < n->child_count; i++) {
+        if (clobbers_arg_regs(n->children[i])) return 1;
+    }
+    return 0;
+}
+
+// SysV argument passing: scalars and small structs in rdi, rsi, rdx, rcx,
+// r8 and r9 while they last, everything else in stack slots at [rsp] upward.
+// Arguments are evaluated left to right. If a later one would clobber
+// registers already loaded, the register arguments are first kept as
+// temporaries on the stack and popped into place at the end. `ret_to` is
+// where a struct returned in memory goes (passed in rdi). rsp is 16-byte
+// aligned at the call. Returns the bytes of stack the caller releases after it.
+int gen_call_args(Codegen* cg, AstNode* n, const char* ret_to) {
+    int staged = 0;
+    for (int i = 1; i < n->child_count; i++) {
+        if (clobbers_arg_regs(n->children[i])) staged = 1;
+    }
+    AstNode* callee = find_function(cg->prog, n->name);
+    Type** types = malloc(sizeof(Type*) * (n->child_count + 1));
+    int* regs = malloc(sizeof(int) * (n->child_count + 1));
+    int* offs = malloc(sizeof(int) * (n->child_count + 1));
+    for (int i = 0; i < n->child_count; i++) {
+        Type* param = callee && i < callee->child_count - 1 ? callee->children[i]->ty : NULL;
+        types[i] = param ? param : n->children[i]->ty;
+    }
+    int stack = assign_args(types, n->child_count, ret_to != NULL, regs, offs);
+    int reserve = stack + (cg->pushes * 8 + stack) % 16;
+    if (reserve) emit(cg, "    sub rsp, %d\n", reserve);
+    cg->pushes += reserve / 8;
+
+    int temps = 0;
+    int temp_regs[6];
+    for (int i = 0; i < n->child_count; i++) {
+        Type* ty = types[i];
+        int is_struct = ty && ty->kind == TY_STRUCT;
+        gen_expr_as(cg, n->children[i], callee ? ty : NULL);
+        if (regs[i] < 0 && is_struct) {
+            emit(cg, "    lea rbx, [rsp+%d]\n", 8 * temps + offs[i]);
+            gen_copy(cg, type_size(ty));
+        } else if (regs[i] < 0) {
+            emit(cg, "    mov [rsp+%d], rax\n", 8 * temps + offs[i]);
+        } else if (is_struct) {
+            // One register per eightbyte, read from the struct's address
+            int size = type_size(ty);
+            if (staged) emit(cg, "    mov rbx, rax\n");
+            for (int k = 0; k * 8 < size; k++) {
+                int bytes = size - k * 8 < 8 ? size - k * 8 : 8;
+                if (!staged) {
+                    gen_load_bytes(cg, arg_regs[regs[i] + k], "rax", k * 8, bytes);
+                    continue;
+                }
+                gen_load_bytes(cg, "rax", "rbx", k * 8, bytes);
+                gen_push(cg);
+                temp_regs[temps++] = regs[i] + k;
+            }
+        } else if (staged) {
+            gen_push(cg);
+            temp_regs[temps++] = regs[i];
+        } else if (type_is_narrow(ty) && callee) {
+            emit(cg, "    mov %s, eax\n", arg_regs32[regs[i]]);
+        } else {
+            emit(cg, "    mov %s, rax\n", arg_regs[regs[i]]);
+        }
+    }
+    while (temps > 0) {
+        temps--;
+        gen_pop(cg, arg_regs[temp_regs[temps]]);
+    }
+    if (ret_to) emit(cg, "    lea rdi, [%s]\n", ret_to);
+    free(types);
+    free(regs);
+    free(offs);
+    return reserve;
+}
+
+// Call `n`, which returns a struct, leaving the struct at [dest] (a frame
+// address) and dest in rax
+static void gen_call_into(Codegen* cg, AstNode* n, const char* dest) {
+    int memory = returns_in_memory(n->ty);
+    int release = gen_call_args(cg, n, memory ? dest : NULL);
+    emit(cg, "    call %s\n", n->name);
+    if (release) emit(cg, "    add rsp, %d\n", release);
+    cg->pushes -= release / 8;
+    if (memory) return;
+    int size = type_size(n->ty);
+    gen_store_bytes(cg, "rax", dest, 0, size < 8 ? size : 8);
+    if (size > 8) gen_store_bytes(cg, "rdx", dest, 8, size - 8);
+    emit(cg, "    lea rax, [%s]\n", dest);
+}
 
-    va_end(args);
+// A call to a function of this file that returns a struct
+static int is_struct_call(Codegen* cg, AstNode* n) {
+    return n->type == AST_CALL && n->ty && n->ty->kind == TY_STRUCT && find_function(cg->prog, n->name);
 }
 
-int new_label(Codegen* cg) { return cg->label_count++; }
+// Whether `name` is ever the root of an operand of & in `n`
+static int address_taken(AstNode* n, char* name) {
+    if (n->type == AST_ADDR_OF) {
+        AstNode* root = n->children[0];
+        while (root->type == AST_FIELD_ACCESS || root->type == AST_INDEX) root = root->children[0];
+        if (root->type == AST_IDENT && !strcmp(root->name, name)) return 1;
+    }
+    for (int i = 0; i < n->child_count; i++) {
+        if (address_taken(n->children[i], name)) return 1;
+    }
+    return 0;
+}
 
-void gen_expr(Codegen* cg, AstNode* n);
+// `name = value` with a struct call as the value can hand the callee the
+// local itself as its destination, unless the call could see the local
+// being overwritten
+static int gen_struct_call_into(Codegen* cg, char* name, AstNode* value) {
+    Symbol* sym = symtab_lookup_symbol(cg->symtab, name);
+    if (!sym || !is_struct_call(cg, value) || !type_equal(sym->ty, value->ty)) return 0;
+    if (ast_uses(value, name) || address_taken(cg->func, name)) return 0;
+    char dest[32];
+    snprintf(dest, sizeof(dest), "rbp%d", sym->offset);
+    gen_call_into(cg, value, dest);
+    return 1;
+}
+
+// Left operand in rax, right in rbx, both 32-bit unless `wide`. A constant
+// or scalar local is loaded straight into rbx instead of going through the stack.
+static void gen_operands(Codegen* cg, AstNode* n, int wide) {
+    AstNode* right = n->children[1];
+    Type* as = wide ? NULL : type_int(4);
+    gen_expr_as(cg, n->children[0], as);
+    Symbol* sym = right->type == AST_IDENT && right->child_count == 0 ? cg_lookup(cg, right->name) : NULL;
+    if (sym && type_is_aggregate(sym->ty)) sym = NULL;
+    int size = sym ? type_size(sym->ty) : 0;
+    int sign_extend = wide && !type_is_unsigned(sym ? sym->ty : NULL);
+    char addr[64];
+    if (sym) var_addr(sym, 0, addr);
+    if (right->type == AST_NUMBER) {
+        emit(cg, wide ? "    mov rbx, %s\n" : "    mov ebx, %s\n", right->value);
+    } else if (sym && !type_is_narrow(sym->ty)) {
+        emit(cg, "    mov rbx, [%s]\n", addr);
+    } else if (sym && size == 4) {
+        emit(cg, sign_extend ? "    movsxd rbx, dword [%s]\n" : "    mov ebx, [%s]\n", addr);
+    } else if (sym) {
+        emit(cg, "    %s %s, %s [%s]\n", type_is_unsigned(sym->ty) ? "movzx" : "movsx",
+             sign_extend ? "rbx" : "ebx", size == 1 ? "byte" : "word", addr);
+    } else {
+        gen_push(cg);
+        gen_expr_as(cg, right, as);
+        emit(cg, "    mov rbx, rax\n");
+        gen_pop(cg, "rax");
+    }
+}
+
+// Write string `s` to stdout. A literal leaves its length in rbx; any other
+// string is measured at run time.
+static void gen_write(Codegen* cg, AstNode* s) {
+    gen_expr(cg, s);
+    if (s->type == AST_STRING) {
+        emit(cg, "    mov rsi, rax\n    mov rdx, rbx\n");
+    } else {
+        emit(cg, "    mov rdi, rax\n    call __strlen\n");
+        emit(cg, "    mov rsi, rdi\n    mov rdx, rax\n");
+    }
+    emit(cg, "    mov rdi, 1\n    mov rax, 1\n    syscall\n");
+}
 
 void gen_expr(Codegen* cg, AstNode* n) {
     if (n->type == AST_NUMBER) {
-        emit(cg, "    mov rax, %s\n", n->value);
+        emit(cg, type_is_narrow(n->ty) ? "    mov eax, %s\n" : "    mov rax, %s\n", n->value);
     } else if (n->type == AST_STRING) {
         char* label = strtab_add(cg->strtab, n->value, strlen(n->value));
         emit(cg, "    mov rax, %s\n", label);
         emit(cg, "    mov rbx, %d\n", (int)strlen(n->value));
     } else if (n->type == AST_IDENT) {
-        int off = symtab_lookup(cg->symtab, n->name);
-        if (off) emit(cg, "    mov rax, [rbp%d]\n", off);
-        else emit(cg, "    mov rax, 0  ; unknown var %s\n", n->name);
+        Symbol* sym = cg_lookup(cg, n->name);
+        char addr[64];
+        gen_load(cg, sym->ty, var_addr(sym, 0, addr));
     } else if (n->type == AST_ADDR_OF) {
-        // Address-of: &variable
-        AstNode* var = n->children[0];
-        if (var->type == AST_IDENT) {
-            int off = symtab_lookup(cg->symtab, var->name);
-            if (off) {
-                emit(cg, "    lea rax, [rbp%d]\n", off);
-            }
-        }
+        // Address-of: &variable, &arr[i], &*ptr, &s.field
+        gen_addr(cg, n->children[0]);
+    } else if (n->type == AST_STORE && type_is_aggregate(n->children[0]->ty)) {
+        // Whole struct: address first, then copy or fill it in place
+        gen_addr(cg, n->children[0]);
+        gen_push(cg);
+        gen_init(cg, n->children[0]->ty, n->children[1], 1, 0);
+        gen_pop(cg, "rax");
+    } else if (n->type == AST_STORE) {
+        AstNode* lvalue = n->children[0];
+        gen_expr_as(cg, n->children[1], lvalue->ty);
+        gen_push(cg);
+        gen_addr(cg, lvalue);
+        emit(cg, "    mov rbx, rax\n");
+        gen_pop(cg, "rax");
+        gen_store(cg, lvalue->ty, "rbx");
     } else if (n->type == AST_DEREF) {
         // Dereference: *ptr
         gen_expr(cg, n->children[0]);
-        emit(cg, "    mov rax, [rax]\n");  // Load value at address in rax
+        gen_load(cg, n->ty, "rax");
     } else if (n->type == AST_ASSIGN) {
-        gen_expr(cg, n->children[0]);
-        int off = symtab_lookup(cg->symtab, n->name);
-        if (off) emit(cg, "    mov [rbp%d], rax\n", off);
+        // Look up after the value: an inlined call in it may grow the symbol table
+        Symbol* sym = cg_lookup(cg, n->name);
+        Type* ty = sym->ty;
+        char addr[64];
+        if (type_is_aggregate(ty) && sym->label) {
+            emit(cg, "    lea rax, [%s]\n", var_addr(sym, 0, addr));
+            gen_push(cg);
+            gen_init(cg, ty, n->children[0], 1, 0);
+            gen_pop(cg, "rax");
+            return;
+        }
+        if (type_is_aggregate(ty)) {
+            if (!gen_struct_call_into(cg, n->name, n->children[0])) gen_init(cg, ty, n->children[0], 0, sym->offset);
+            return;
+        }
+        gen_expr_as(cg, n->children[0], ty);
+        gen_store(cg, ty, var_addr(cg_lookup(cg, n->name), 0, addr));
     } else if (n->type == AST_BINOP) {
-        gen_expr(cg, n->children[0]);
-        emit(cg, "    push rax\n");
-        gen_expr(cg, n->children[1]);
-        emit(cg, "    mov rbx, rax\n    pop rax\n");
-        if (n->op[0] == '+') emit(cg, "    add rax, rbx\n");
-        else if (n->op[0] == '-') emit(cg, "    sub rax, rbx\n");
-        else if (n->op[0] == '*') emit(cg, "    imul rax, rbx\n");
-        else if (n->op[0] == '/') emit(cg, "    xor rdx, rdx\n    idiv rbx\n");
+        // i32 arithmetic wraps at 32 bits; anything involving i64 or a
+        // pointer is done in full registers
+        int wide = !type_is_narrow(n->ty);
+        gen_operands(cg, n, wide);
+        const char* a = wide ? "rax" : "eax";
+        const char* b = wide ? "rbx" : "ebx";
+        const char* d = wide ? "rdx" : "edx";
+        // Unsigned division zero-extends the dividend into rdx, signed sign-extends it
+        char div[48];
+        if (type_is_unsigned(n->ty)) snprintf(div, sizeof(div), "xor edx, edx\n    div %s", b);
+        else snprintf(div, sizeof(div), "%s\n    idiv %s", wide ? "cqo" : "cdq", b);
+        if (n->op[0] == '+') emit(cg, "    add %s, %s\n", a, b);
+        else if (n->op[0] == '-') emit(cg, "    sub %s, %s\n", a, b);
+        else if (n->op[0] == '*') emit(cg, "    imul %s, %s\n", a, b);
+        else if (n->op[0] == '/') emit(cg, "    %s\n", div);
+        else if (n->op[0] == '%') emit(cg, "    %s\n    mov %s, %s\n", div, a, d);
+        else if (n->op[0] == '&') emit(cg, "    and %s, %s\n", a, b);
+        else if (n->op[0] == '|') emit(cg, "    or %s, %s\n", a, b);
     } else if (n->type == AST_COMPARE) {
-        gen_expr(cg, n->children[0]);
-        emit(cg, "    push rax\n");
-        gen_expr(cg, n->children[1]);
-        emit(cg, "    mov rbx, rax\n    pop rax\n");
-        emit(cg, "    cmp rax, rbx\n");
+        Type* common = type_arith(n->children[0]->ty, n->children[1]->ty);
+        int wide = !type_is_narrow(common);
+        int u = type_is_unsigned(common);
+        gen_operands(cg, n, wide);
+        emit(cg, wide ? "    cmp rax, rbx\n" : "    cmp eax, ebx\n");
         if (!strcmp(n->op, "==")) emit(cg, "    sete al\n");
         else if (!strcmp(n->op, "!=")) emit(cg, "    setne al\n");
-        else if (!strcmp(n->op, "<")) emit(cg, "    setl al\n");
-        else if (!strcmp(n->op, ">")) emit(cg, "    setg al\n");
-        else if (!strcmp(n->op, "<=")) emit(cg, "    setle al\n");
-        else if (!strcmp(n->op, ">=")) emit(cg, "    setge al\n");
-        emit(cg, "    movzx rax, al\n");
+        else if (!strcmp(n->op, "<")) emit(cg, u ? "    setb al\n" : "    setl al\n");
+        else if (!strcmp(n->op, ">")) emit(cg, u ? "    seta al\n" : "    setg al\n");
+        else if (!strcmp(n->op, "<=")) emit(cg, u ? "    setbe al\n" : "    setle al\n");
+        else if (!strcmp(n->op, ">=")) emit(cg, u ? "    setae al\n" : "    setge al\n");
+        emit(cg, "    movzx eax, al\n");
     } else if (n->type == AST_CALL) {
         // Builtins
         if (!strcmp(n->name, "print")) {
-            if (n->child_count > 0) {
-                gen_expr(cg, n->children[0]);
-                emit(cg, "    mov rsi, rax\n    mov rdx, rbx\n");
-                emit(cg, "    mov rdi, 1\n    mov rax, 1\n    syscall\n");
-            }
+            if (n->child_count > 0) gen_write(cg, n->children[0]);
         } else if (!strcmp(n->name, "println")) {
-            if (n->child_count > 0) {
-                gen_expr(cg, n->children[0]);
-                emit(cg, "    mov rsi, rax\n    mov rdx, rbx\n");
-                emit(cg, "    mov rdi, 1\n    mov rax, 1\n    syscall\n");
-            }
-            emit(cg, "    mov byte [rbp-256], 10\n");
-            emit(cg, "    lea rsi, [rbp-256]\n");
+            if (n->child_count > 0) gen_write(cg, n->children[0]);
+            if (!cg->newline) cg->newline = strtab_add(cg->strtab, "\n", 1);
+            emit(cg, "    mov rsi, %s\n", cg->newline);
             emit(cg, "    mov rdi, 1\n    mov rdx, 1\n    mov rax, 1\n    syscall\n");
         } else if (!strcmp(n->name, "print_int")) {
             if (n->child_count > 0) {
-                gen_expr(cg, n->children[0]);
+                gen_expr_as(cg, n->children[0], NULL);
                 emit(cg, "    call __print_int\n");
             }
         } else if (!strcmp(n->name, "exit")) {
             if (n->child_count > 0) {
-                gen_expr(cg, n->children[0]);
+                gen_expr_as(cg, n->children[0], NULL);
                 emit(cg, "    mov rdi, rax\n");
             } else {
                 emit(cg, "    xor rdi, rdi\n");
             }
+            if (cg->opts->profile_generate) emit(cg, "    call __prof_dump\n");
             emit(cg, "    mov rax, 60\n    syscall\n");
         } else if (!strcmp(n->name, "strcmp")) {
             // strcmp(s1, s2) -> 0 if equal, !=0 otherwise
             if (n->child_count >= 2) {
                 gen_expr(cg, n->children[0]);  // s1 in rax
-                emit(cg, "    push rax\n");
+                gen_push(cg);
                 gen_expr(cg, n->children[1]);  // s2 in rax
                 emit(cg, "    mov rsi, rax\n");
-                emit(cg, "    pop rdi\n");      // s1 in rdi, s2 in rsi
+                gen_pop(cg, "rdi");            // s1 in rdi, s2 in rsi
                 emit(cg, "    call __strcmp\n");
             }
         } else if (!strcmp(n->name, "strcpy")) {
             // strcpy(dest, src) -> dest
             if (n->child_count >= 2) {
                 gen_expr(cg, n->children[0]);  // dest in rax
-                emit(cg, "    push rax\n");
+                gen_push(cg);
                 gen_expr(cg, n->children[1]);  // src in rax
                 emit(cg, "    mov rsi, rax\n");
-                emit(cg, "    pop rdi\n");      // dest in rdi, src in rsi
+                gen_pop(cg, "rdi");            // dest in rdi, src in rsi
                 emit(cg, "    call __strcpy\n");
             }
         } else if (!strcmp(n->name, "strlen")) {
@@ -787,179 +5425,1185 @@ void gen_expr(Codegen* cg, AstNode* n) {
                 emit(cg, "    call __strlen\n");
             }
         } else {
-            // Regular function call
-            const char* regs[] = {"rdi", "rsi", "rdx", "rcx", "r8", "r9"};
-            for (int i = 0; i < n->child_count && i < 6; i++) {
-                gen_expr(cg, n->children[i]);
-                emit(cg, "    mov %s, rax\n", regs[i]);
+            // Regular function call; one defined elsewhere is declared extern
+            if (!find_function(cg->prog, n->name)) nameset_add(cg->externs, n->name);
+            if (is_struct_call(cg, n)) {
+                // The result lands in a hidden local, like a literal
+                char name[32], dest[32];
+                snprintf(name, sizeof(name), "__ret%d", new_label(cg));
+                snprintf(dest, sizeof(dest), "rbp%d", symtab_add(cg->symtab, name, n->ty));
+                gen_call_into(cg, n, dest);
+                return;
             }
+            int release = gen_call_args(cg, n, NULL);
             emit(cg, "    call %s\n", n->name);
+            if (release) emit(cg, "    add rsp, %d\n", release);
+            cg->pushes -= release / 8;
         }
-    } else if (n->type == AST_ARRAY_LITERAL) {
-        emit(cg, "    ; array literal\n");
-        if (cg->symtab && cg->symtab->count > 0) {
-            Symbol* sym = &cg->symtab->symbols[cg->symtab->count - 1];
-            for (int i = 0; i < n->child_count; i++) {
-                gen_expr(cg, n->children[i]);
-                int elem_off = sym->offset + (i * 8);
-                emit(cg, "    mov [rbp%d], rax\n", elem_off);
-            }
-            emit(cg, "    lea rax, [rbp%d]\n", sym->offset);
-        }
+    } else if (n->type == AST_INLINE) {
+        // Inlined call: the value of whichever return runs is left in rax
+        int saved_exit = cg->inline_exit;
+        Type* saved_ret = cg->ret_ty;
+        cg->inline_exit = new_label(cg);
+        cg->ret_ty = n->ty;
+        emit(cg, "    ; inlined %s\n", n->name);
+        for (int i = 0; i < n->child_count; i++) gen_stmt(cg, n->children[i]);
+        AstNode* last = n->child_count > 0 ? n->children[n->child_count - 1] : NULL;
+        if (!last || last->type != AST_RETURN) emit(cg, "    xor eax, eax\n");
+        emit(cg, ".L%d:\n", cg->inline_exit);
+        cg->inline_exit = saved_exit;
+        cg->ret_ty = saved_ret;
+    } else if (n->type == AST_ARRAY_LITERAL || n->type == AST_STRUCT_LITERAL) {
+        // A literal used as a value (not an initializer) lives in a hidden local
+        char name[32];
+        snprintf(name, sizeof(name), "__lit%d", new_label(cg));
+        int off = symtab_add(cg->symtab, name, n->ty);
+        gen_init(cg, n->ty, n, 0, off);
+        emit(cg, "    lea rax, [rbp%d]\n", off);
     } else if (n->type == AST_INDEX) {
         AstNode* arr = n->children[0];
-        Symbol* sym = symtab_lookup_symbol(cg->symtab, arr->name);
-        if (sym) {
-            gen_expr(cg, n->children[1]);
-            emit(cg, "    imul rax, 8\n");
-            emit(cg, "    mov rbx, rax\n");
-            emit(cg, "    mov rax, [rbp%d+rbx]\n", sym->offset);
-        }
-    } else if (n->type == AST_STRUCT_LITERAL) {
-        emit(cg, "    ; struct literal %s\n", n->struct_type);
-        if (cg->symtab && cg->symtab->count > 0) {
-            Symbol* sym = &cg->symtab->symbols[cg->symtab->count - 1];
-            for (int i = 0; i < n->child_count; i++) {
-                AstNode* field_assign = n->children[i];
-                char* field_name = field_assign->name;
-                AstNode* field_value = field_assign->children[0];
-
-                int field_off = typetab_field_offset(cg->types, n->struct_type, field_name);
-                gen_expr(cg, field_value);
-                emit(cg, "    mov [rbp%d], rax\n", sym->offset + field_off);
-            }
-            emit(cg, "    lea rax, [rbp%d]\n", sym->offset);
+        Symbol* sym = arr->type == AST_IDENT ? cg_lookup(cg, arr->name) : NULL;
+        int size = type_size(n->ty);
+        if (sym && sym->ty->kind == TY_ARRAY && !type_is_aggregate(n->ty) &&
+            (size == 1 || size == 2 || size == 4 || size == 8)) {
+            char addr[64];
+            gen_expr_as(cg, n->children[1], NULL);
+            // Look up again: an inlined call in the index may grow the symbol table
+            sym = cg_lookup(cg, arr->name);
+            int base = sym->offset;
+            // RIP-relative operands take no index register
+            if (sym->label) emit(cg, "    lea rbx, [rel %s]\n", sym->label);
+            if (sym->label) snprintf(addr, sizeof(addr), "rbx+rax*%d", size);
+            else snprintf(addr, sizeof(addr), "rbp%d+rax*%d", base, size);
+            gen_load(cg, n->ty, addr);
+        } else {
+            gen_addr(cg, n);
+            gen_load(cg, n->ty, "rax");
         }
     } else if (n->type == AST_FIELD_ACCESS) {
-        AstNode* obj = n->children[0];
-        char* field_name = n->name;
-
-        // Check if object is a dereference (pointer access)
-        if (obj->type == AST_DEREF) {
-            // ptr->field case (already desugared)
-            AstNode* ptr = obj->children[0];
-            Symbol* sym = symtab_lookup_symbol(cg->symtab, ptr->name);
-            if (sym && sym->is_pointer && sym->type_name) {
-                int field_off = typetab_field_offset(cg->types, sym->type_name, field_name);
-                if (field_off >= 0) {
-                    emit(cg, "    mov rax, [rbp%d]\n", sym->offset);  // Load pointer
-                    emit(cg, "    mov rax, [rax+%d]\n", field_off);   // Access field
-                }
-            }
+        gen_addr(cg, n);
+        gen_load(cg, n->ty, "rax");
+    }
+}
+
+// Condition code (the suffix of jcc, setcc and cmovcc) under which
+// comparison `n` is `when`
+static const char* compare_cc(AstNode* n, int when) {
+    static const char* ops[] = {"==", "!=", "<", ">=", ">", "<=", "<", ">=", ">", "<="};
+    static const char* ccs[] = {"e", "ne", "l", "ge", "g", "le", "b", "ae", "a", "be"};
+    int k = 0;
+    while (strcmp(ops[k], n->op)) k++;
+    if (k >= 2 && type_is_unsigned(type_arith(n->children[0]->ty, n->children[1]->ty))) k += 4;
+    if (!when) k ^= 1;  // Each code is paired with its negation
+    return ccs[k];
+}
+
+// Evaluate comparison `n` into the flags
+static void gen_compare_flags(Codegen* cg, AstNode* n) {
+    int wide = !type_is_narrow(type_arith(n->children[0]->ty, n->children[1]->ty));
+    gen_operands(cg, n, wide);
+    emit(cg, wide ? "    cmp rax, rbx\n" : "    cmp eax, ebx\n");
+}
+
+// Jump to `label` when condition `n` is `when` (1 = true, 0 = false). A
+// comparison branches on its own flags instead of materializing 0 or 1.
+void gen_branch(Codegen* cg, AstNode* n, int when, int label) {
+    long v;
+    if (ast_is_num(n, &v)) {
+        if ((v != 0) == when) emit(cg, "    jmp .L%d\n", label);
+        return;
+    }
+    if (n->type != AST_COMPARE) {
+        gen_cond(cg, n);
+        emit(cg, "    %s .L%d\n", when ? "jnz" : "jz", label);
+        return;
+    }
+    gen_compare_flags(cg, n);
+    emit(cg, "    j%s .L%d\n", compare_cc(n, when), label);
+}
+
+// ---- If-conversion ----
+// `if (c) { x = a; } else { x = b; }` and `if (c) { x = a; }` on a scalar x
+// compute both values and pick one with cmov, so there is no branch to
+// mispredict and both paths take the same time. The values must be small
+// and unable to fault: no calls or division, and loads only of what the
+// condition reads anyway. `if (c) { n = n + 1; }` adds the setcc result.
+static const int SELECT_MAX_VALUE = 8;  // AST nodes on each side
+
+static int ast_contains(AstNode* n, AstNode* e) {
+    if (ast_equal(n, e)) return 1;
+    for (int i = 0; i < n->child_count; i++) {
+        if (ast_contains(n->children[i], e)) return 1;
+    }
+    return 0;
+}
+
+// Safe to evaluate whether or not `cond` holds
+static int select_value_ok(AstNode* e, AstNode* cond) {
+    switch (e->type) {
+    case AST_NUMBER:
+        return 1;
+    case AST_IDENT:
+        return e->child_count == 0;
+    case AST_BINOP:
+        if (e->op[0] == '/' || e->op[0] == '%') return 0;
+        // fallthrough
+    case AST_COMPARE:
+        return select_value_ok(e->children[0], cond) && select_value_ok(e->children[1], cond);
+    case AST_INDEX:
+    case AST_DEREF:
+    case AST_FIELD_ACCESS:
+        return ast_contains(cond, e);
+    default:
+        return 0;
+    }
+}
+
+// If-convert the AST_IF `n`; 0 if it has to keep its branch
+static int gen_select(Codegen* cg, AstNode* n) {
+    AstNode* cond = n->children[0];
+    AstNode* then = n->children[1];
+    AstNode* other = n->child_count > 2 && n->children[2]->child_count > 0 ? n->children[2] : NULL;
+    long v;
+    if (cg->opts->opt_level < 1 || ast_is_num(cond, &v)) return 0;
+    if (then->child_count != 1 || then->children[0]->type != AST_ASSIGN) return 0;
+    if (other && (other->child_count != 1 || other->children[0]->type != AST_ASSIGN ||
+                  strcmp(other->children[0]->name, then->children[0]->name))) return 0;
+    Symbol* sym = cg_lookup(cg, then->children[0]->name);
+    if (type_is_aggregate(sym->ty)) return 0;
+
+    // Copied out: an inlined call in the condition may grow the symbol table
+    Type* ty = sym->ty;
+    AstNode* x = ast_ident(sym->name);
+    x->ty = ty;
+    AstNode* yes = then->children[0]->children[0];
+    AstNode* no = other ? other->children[0]->children[0] : x;
+    char addr[64];
+    var_addr(sym, 0, addr);
+
+    // Conditional increment or decrement: x += (c)
+    long one;
+    if (!other && yes->type == AST_BINOP && (yes->op[0] == '+' || yes->op[0] == '-') &&
+        ast_equal(yes->children[0], x) && ast_is_num(yes->children[1], &one) && one == 1) {
+        emit(cg, "    ; branchless %s\n", x->name);
+        if (cond->type == AST_COMPARE) {
+            gen_compare_flags(cg, cond);
+            emit(cg, "    set%s cl\n", compare_cc(cond, 1));
         } else {
-            // Regular struct field access
-            Symbol* sym = symtab_lookup_symbol(cg->symtab, obj->name);
-            if (sym && sym->type_name) {
-                int field_off = typetab_field_offset(cg->types, sym->type_name, field_name);
-                if (field_off >= 0) {
-                    emit(cg, "    mov rax, [rbp%d]\n", sym->offset + field_off);
-                }
-            }
+            gen_cond(cg, cond);
+            emit(cg, "    setnz cl\n");
+        }
+        emit(cg, "    movzx ecx, cl\n");
+        gen_load(cg, ty, addr);
+        emit(cg, "    %s rax, rcx\n", yes->op[0] == '+' ? "add" : "sub");
+        gen_store(cg, ty, addr);
+        return 1;
+    }
+
+    if (ast_size(yes) > SELECT_MAX_VALUE || ast_size(no) > SELECT_MAX_VALUE) return 0;
+    if (!select_value_ok(yes, cond) || !select_value_ok(no, cond) || clobbers_arg_regs(cond)) return 0;
+    emit(cg, "    ; branchless %s\n", x->name);
+
+    // min/max: the values are the compared operands, already in rax and rbx.
+    // Operands compared in 32 bits would still need extending to a wider x.
+    if (cond->type == AST_COMPARE) {
+        AstNode* l = cond->children[0];
+        AstNode* r = cond->children[1];
+        int wide = !type_is_narrow(type_arith(l->ty, r->ty));
+        int keep_left = ast_equal(yes, l) && ast_equal(no, r);
+        if ((keep_left || (ast_equal(yes, r) && ast_equal(no, l))) && (wide || type_is_narrow(ty))) {
+            gen_compare_flags(cg, cond);
+            emit(cg, "    cmov%s rax, rbx\n", compare_cc(cond, !keep_left));
+            gen_store(cg, ty, addr);
+            return 1;
+        }
+    }
+
+    gen_expr_as(cg, yes, ty);
+    emit(cg, "    mov rcx, rax\n");
+    gen_expr_as(cg, no, ty);
+    emit(cg, "    mov rdx, rax\n");
+    if (cond->type == AST_COMPARE) {
+        gen_compare_flags(cg, cond);
+        emit(cg, "    cmov%s rcx, rdx\n", compare_cc(cond, 0));
+    } else {
+        gen_cond(cg, cond);
+        emit(cg, "    cmovz rcx, rdx\n");
+    }
+    emit(cg, "    mov rax, rcx\n");
+    gen_store(cg, ty, addr);
+    return 1;
+}
+
+// ==== VECTOR CODEGEN ====
+// Kernels keep the induction variable in r11 and the last vector start in
+// r10, and the address of each global array in a scratch register. Invariant
+// operands, the iota vector and reduction accumulators are pinned to vector
+// registers; expression temporaries use the rest.
+typedef struct VecGen {
+    Codegen* cg;
+    int avx2;            // VEX ymm kernel vs SSE2 xmm kernel
+    int width;           // Bytes per lane: 4 (i32) or 8 (i64)
+    int dry;             // Planning pass: count registers, emit nothing
+    int next_reg;
+    int max_reg;
+    AstNode* scalars[16];
+    int scalar_regs[16];
+    int scalar_count;
+    int iota_reg;        // i, i+1, ... for the current chunk; -1 if unused
+    int iota_step_reg;
+    int acc_regs[16];
+    Symbol* bases[6];    // Global arrays, held in vec_base_regs
+    int base_count;
+} VecGen;
+
+static const char* vec_base_regs[] = {"rsi", "rdi", "rcx", "rdx", "r8", "r9"};
+
+static void vemit(VecGen* vg, const char* fmt, ...) {
+    if (vg->dry) return;
+    char buf[256];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+    emit(vg->cg, "%s", buf);
+}
+
+static int vec_alloc(VecGen* vg) {
+    int r = vg->next_reg++;
+    if (vg->next_reg > vg->max_reg) vg->max_reg = vg->next_reg;
+    return r;
+}
+
+static const char* vec_reg_name(VecGen* vg) { return vg->avx2 ? "ymm" : "xmm"; }
+
+static int vec_uses_iv(AstNode* e, char* iv) {
+    return ast_uses(e, iv) > 0;
+}
+
+// Broadcast rax (eax for 32-bit lanes) into every lane of register r
+static void vec_broadcast_rax(VecGen* vg, int r) {
+    if (vg->width == 4) {
+        if (vg->avx2) vemit(vg, "    vmovd xmm%d, eax\n    vpbroadcastd ymm%d, xmm%d\n", r, r, r);
+        else vemit(vg, "    movd xmm%d, eax\n    pshufd xmm%d, xmm%d, 0\n", r, r, r);
+    } else if (vg->avx2) {
+        vemit(vg, "    vmovq xmm%d, rax\n    vpbroadcastq ymm%d, xmm%d\n", r, r, r);
+    } else {
+        vemit(vg, "    movq xmm%d, rax\n    punpcklqdq xmm%d, xmm%d\n", r, r, r);
+    }
+}
+
+// d = a op b lane-wise; `w` selects xmm/ymm naming on the VEX path
+static void vec_op(VecGen* vg, const char* w, const char* op, int d, int a, int b) {
+    int dword = vg->width == 4;
+    const char* sse = !strcmp(op, "+") ? (dword ? "paddd" : "paddq") :
+                      !strcmp(op, "-") ? (dword ? "psubd" : "psubq") :
+                      !strcmp(op, "&") ? "pand" : !strcmp(op, "|") ? "por" : NULL;
+    if (sse) {
+        if (vg->avx2) vemit(vg, "    v%s %s%d, %s%d, %s%d\n", sse, w, d, w, a, w, b);
+        else {
+            if (d != a) vemit(vg, "    movdqa xmm%d, xmm%d\n", d, a);
+            vemit(vg, "    %s xmm%d, xmm%d\n", sse, d, b);
+        }
+    } else if (dword && !strcmp(op, "*") && vg->avx2) {
+        vemit(vg, "    vpmulld %s%d, %s%d, %s%d\n", w, d, w, a, w, b);
+    } else if (dword && !strcmp(op, "*")) {
+        // SSE2 has no pmulld: multiply even and odd lanes separately, then interleave
+        int t1 = vec_alloc(vg);
+        int t2 = vec_alloc(vg);
+        vemit(vg, "    pshufd xmm%d, xmm%d, 0xF5\n    pshufd xmm%d, xmm%d, 0xF5\n    pmuludq xmm%d, xmm%d\n", t1, a, t2, b, t1, t2);
+        vemit(vg, "    movdqa xmm%d, xmm%d\n    pmuludq xmm%d, xmm%d\n", t2, a, t2, b);
+        vemit(vg, "    pshufd xmm%d, xmm%d, 0x08\n    pshufd xmm%d, xmm%d, 0x08\n", t2, t2, t1, t1);
+        vemit(vg, "    punpckldq xmm%d, xmm%d\n    movdqa xmm%d, xmm%d\n", t2, t1, d, t2);
+        vg->next_reg -= 2;
+    } else if (dword) {
+        // min/max (AVX2 only)
+        vemit(vg, "    %s %s%d, %s%d, %s%d\n", !strcmp(op, "min") ? "vpminsd" : "vpmaxsd", w, d, w, a, w, b);
+    } else if (!strcmp(op, "*")) {
+        // No 64-bit lane multiply before AVX-512: combine 32x32 partial products
+        int t1 = vec_alloc(vg);
+        int t2 = vec_alloc(vg);
+        if (vg->avx2) {
+            vemit(vg, "    vpsrlq %s%d, %s%d, 32\n    vpmuludq %s%d, %s%d, %s%d\n", w, t1, w, a, w, t1, w, t1, w, b);
+            vemit(vg, "    vpsrlq %s%d, %s%d, 32\n    vpmuludq %s%d, %s%d, %s%d\n", w, t2, w, b, w, t2, w, t2, w, a);
+            vemit(vg, "    vpaddq %s%d, %s%d, %s%d\n    vpsllq %s%d, %s%d, 32\n", w, t1, w, t1, w, t2, w, t1, w, t1);
+            vemit(vg, "    vpmuludq %s%d, %s%d, %s%d\n    vpaddq %s%d, %s%d, %s%d\n", w, d, w, a, w, b, w, d, w, d, w, t1);
+        } else {
+            vemit(vg, "    movdqa xmm%d, xmm%d\n    psrlq xmm%d, 32\n    pmuludq xmm%d, xmm%d\n", t1, a, t1, t1, b);
+            vemit(vg, "    movdqa xmm%d, xmm%d\n    psrlq xmm%d, 32\n    pmuludq xmm%d, xmm%d\n", t2, b, t2, t2, a);
+            vemit(vg, "    paddq xmm%d, xmm%d\n    psllq xmm%d, 32\n", t1, t2, t1);
+            if (d != a) vemit(vg, "    movdqa xmm%d, xmm%d\n", d, a);
+            vemit(vg, "    pmuludq xmm%d, xmm%d\n    paddq xmm%d, xmm%d\n", d, b, d, t1);
+        }
+        vg->next_reg -= 2;
+    } else {
+        // min/max (AVX2 only): select b where the signed compare says so
+        int t = vec_alloc(vg);
+        if (!strcmp(op, "min")) vemit(vg, "    vpcmpgtq %s%d, %s%d, %s%d\n", w, t, w, a, w, b);
+        else vemit(vg, "    vpcmpgtq %s%d, %s%d, %s%d\n", w, t, w, b, w, a);
+        vemit(vg, "    vpblendvb %s%d, %s%d, %s%d, %s%d\n", w, d, w, a, w, b, w, t);
+        vg->next_reg--;
+    }
+}
+
+// Frame offset of element 0 of the array a vector access walks
+// Give every global array the kernel touches a base register; 0 if they run out
+static int vec_collect_bases(VecGen* vg, AstNode* e) {
+    AstNode* arr = vec_access_array(e);
+    Symbol* sym = arr ? cg_lookup(vg->cg, arr->name) : NULL;
+    if (sym && sym->label) {
+        for (int i = 0; i < vg->base_count; i++) {
+            if (vg->bases[i] == sym) return 1;
+        }
+        if (vg->base_count == 6) return 0;
+        vg->bases[vg->base_count++] = sym;
+        return 1;
+    }
+    for (int i = 0; i < e->child_count; i++) {
+        if (!vec_collect_bases(vg, e->children[i])) return 0;
+    }
+    return 1;
+}
+
+// Memory operand of the current chunk of an array access
+static char* vec_access_addr(VecGen* vg, AstNode* e, char* buf) {
+    AstNode* arr = vec_access_array(e);
+    Symbol* sym = cg_lookup(vg->cg, arr->name);
+    int disp = sym->label ? 0 : sym->offset;
+    if (e->type == AST_FIELD_ACCESS) {
+        StructType* st = e->children[0]->ty->st;
+        disp += soa_field_offset(st, typetab_field(vg->cg->types, st->name, e->name), arr->ty->length);
+    }
+    if (!sym->label) {
+        sprintf(buf, "rbp%d+r11*%d", disp, vg->width);
+        return buf;
+    }
+    int b = 0;
+    while (vg->bases[b] != sym) b++;
+    if (disp) sprintf(buf, "%s+%d+r11*%d", vec_base_regs[b], disp, vg->width);
+    else sprintf(buf, "%s+r11*%d", vec_base_regs[b], vg->width);
+    return buf;
+}
+
+static int vec_expr(VecGen* vg, AstNode* e, char* iv) {
+    if (!vec_uses_iv(e, iv)) {
+        for (int i = 0; i < vg->scalar_count; i++) {
+            if (ast_equal(vg->scalars[i], e)) return vg->scalar_regs[i];
+        }
+    }
+    if (e->type == AST_IDENT) return vg->iota_reg;
+    if (vec_access_array(e)) {
+        int r = vec_alloc(vg);
+        char addr[64];
+        vec_access_addr(vg, e, addr);
+        if (vg->avx2) vemit(vg, "    vmovdqu ymm%d, [%s]\n", r, addr);
+        else vemit(vg, "    movdqu xmm%d, [%s]\n", r, addr);
+        return r;
+    }
+    int a = vec_expr(vg, e->children[0], iv);
+    int b = vec_expr(vg, e->children[1], iv);
+    int d = vec_alloc(vg);
+    vec_op(vg, vec_reg_name(vg), e->op, d, a, b);
+    return d;
+}
+
+// Pin invariant operands (largest subtrees not touching the induction variable)
+static void vec_collect_scalars(VecGen* vg, AstNode* e, char* iv) {
+    if (vec_access_array(e)) return;  // Loaded per chunk
+    if (!vec_uses_iv(e, iv)) {
+        for (int i = 0; i < vg->scalar_count; i++) {
+            if (ast_equal(vg->scalars[i], e)) return;
+        }
+        if (vg->scalar_count < 16) vg->scalars[vg->scalar_count++] = e;
+        return;
+    }
+    if (e->type == AST_IDENT) {
+        vg->iota_reg = 0;  // Assigned for real once pinned registers are counted
+        return;
+    }
+    for (int i = 0; i < e->child_count; i++) vec_collect_scalars(vg, e->children[i], iv);
+}
+
+static long vec_identity(const char* op, int width) {
+    if (!strcmp(op, "*")) return 1;
+    if (!strcmp(op, "&")) return -1;
+    if (!strcmp(op, "min")) return width == 4 ? 0x7fffffffL : 0x7fffffffffffffffL;
+    if (!strcmp(op, "max")) return width == 4 ? -0x7fffffffL - 1 : -0x7fffffffffffffffL - 1;
+    return 0;
+}
+
+// Emit one kernel; returns 0 (emitting nothing) if it needs too many registers
+static int gen_vector_kernel(Codegen* cg, AstNode* n, int avx2) {
+    char* iv = n->name;
+    AstNode* body = n->children[1];
+    int width = type_size(n->ty);
+    int lanes = (avx2 ? 32 : 16) / width;
+
+    VecGen vg;
+    memset(&vg, 0, sizeof(vg));
+    vg.cg = cg;
+    vg.avx2 = avx2;
+    vg.width = width;
+    vg.iota_reg = -1;
+    for (int i = 0; i < body->child_count; i++) {
+        AstNode* s = body->children[i];
+        vec_collect_scalars(&vg, s->type == AST_STORE ? s->children[1] : s->children[0], iv);
+        char* var = s->type == AST_STORE ? vec_access_array(s->children[0])->name : s->name;
+        if (!cg_lookup(cg, var) || !vec_collect_bases(&vg, s)) return 0;
+    }
+    if (!symtab_lookup_symbol(cg->symtab, iv)) return 0;
+    int pinned = 0;
+    for (int i = 0; i < vg.scalar_count; i++) vg.scalar_regs[i] = pinned++;
+    if (vg.iota_reg >= 0) {
+        vg.iota_reg = pinned++;
+        vg.iota_step_reg = pinned++;
+    }
+    for (int i = 0; i < body->child_count; i++) {
+        if (body->children[i]->type == AST_ASSIGN) vg.acc_regs[i] = pinned++;
+    }
+
+    // Plan: find the deepest statement's register need
+    vg.dry = 1;
+    vg.max_reg = pinned;
+    for (int i = 0; i < body->child_count; i++) {
+        AstNode* s = body->children[i];
+        vg.next_reg = pinned;
+        int r = vec_expr(&vg, s->type == AST_STORE ? s->children[1] : s->children[0], iv);
+        if (s->type == AST_ASSIGN) vec_op(&vg, vec_reg_name(&vg), s->op[0] == '-' ? "-" : s->op, vg.acc_regs[i], vg.acc_regs[i], r);
+    }
+    if (vg.max_reg > 16) return 0;
+    vg.dry = 0;
+
+    int loop_lab = new_label(cg);
+    int end_lab = new_label(cg);
+    const char* w = vec_reg_name(&vg);
+
+    for (int i = 0; i < vg.scalar_count; i++) {
+        gen_expr_as(cg, vg.scalars[i], n->ty);
+        vec_broadcast_rax(&vg, vg.scalar_regs[i]);
+    }
+    for (int i = 0; i < body->child_count; i++) {
+        if (body->children[i]->type != AST_ASSIGN) continue;
+        emit(cg, "    mov rax, %ld\n", vec_identity(body->children[i]->op, width));
+        vec_broadcast_rax(&vg, vg.acc_regs[i]);
+    }
+    // r10 = first i that no longer starts a full vector; r11 = i
+    gen_expr_as(cg, n->children[0], NULL);
+    if (!strcmp(n->op, "<=")) emit(cg, "    add rax, 1\n");
+    emit(cg, "    sub rax, %d\n    mov r10, rax\n", lanes - 1);
+    gen_expr_as(cg, n->children[2], NULL);
+    emit(cg, "    mov r11, rax\n");
+    for (int i = 0; i < vg.base_count; i++) emit(cg, "    lea %s, [rel %s]\n", vec_base_regs[i], vg.bases[i]->label);
+    if (vg.iota_reg >= 0 && width == 4) {
+        // 0, 1, 2, 3 (and 4..7 in the high half), then + i
+        int t = vg.iota_step_reg;
+        int r = vg.iota_reg;
+        const char* v = avx2 ? "v" : "";
+        emit(cg, "    mov rax, 0x100000000\n    %smovq xmm%d, rax\n", v, r);
+        emit(cg, "    mov rax, 0x300000002\n    %smovq xmm%d, rax\n", v, t);
+        if (avx2) {
+            emit(cg, "    vpunpcklqdq xmm%d, xmm%d, xmm%d\n", r, r, t);
+            emit(cg, "    mov eax, 4\n    vmovd xmm%d, eax\n    vpbroadcastd xmm%d, xmm%d\n", t, t, t);
+            emit(cg, "    vpaddd xmm%d, xmm%d, xmm%d\n    vinserti128 ymm%d, ymm%d, xmm%d, 1\n", t, t, r, r, r, t);
+        } else {
+            emit(cg, "    punpcklqdq xmm%d, xmm%d\n", r, t);
+        }
+        emit(cg, "    mov eax, r11d\n");
+        vec_broadcast_rax(&vg, t);
+        emit(cg, avx2 ? "    vpaddd ymm%d, ymm%d, ymm%d\n" : "    paddd xmm%d, xmm%d\n", r, avx2 ? r : t, t);
+        emit(cg, "    mov rax, %d\n", lanes);
+        vec_broadcast_rax(&vg, t);
+    } else if (vg.iota_reg >= 0) {
+        int t = vg.iota_step_reg;
+        int r = vg.iota_reg;
+        if (avx2) {
+            emit(cg, "    mov rax, 1\n    vmovq xmm%d, rax\n    vpslldq xmm%d, xmm%d, 8\n", r, r, r);
+            emit(cg, "    mov rax, 2\n    vmovq xmm%d, rax\n    vpbroadcastq xmm%d, xmm%d\n", t, t, t);
+            emit(cg, "    vpaddq xmm%d, xmm%d, xmm%d\n    vinserti128 ymm%d, ymm%d, xmm%d, 1\n", t, t, r, r, r, t);
+            emit(cg, "    vmovq xmm%d, r11\n    vpbroadcastq ymm%d, xmm%d\n    vpaddq ymm%d, ymm%d, ymm%d\n", t, t, t, r, r, t);
+        } else {
+            emit(cg, "    mov rax, 1\n    movq xmm%d, rax\n    pslldq xmm%d, 8\n", r, r);
+            emit(cg, "    movq xmm%d, r11\n    punpcklqdq xmm%d, xmm%d\n    paddq xmm%d, xmm%d\n", t, t, t, r, t);
+        }
+        emit(cg, "    mov rax, %d\n", lanes);
+        vec_broadcast_rax(&vg, t);
+    }
+
+    // Bottom-tested, like scalar loops
+    Attribute* most = ast_attr(n, "max_trip");
+    long trips = -1;
+    if (most && !ast_is_num(most->arg, &trips)) trips = -1;
+    gen_loop_bound(cg, loop_lab, trips < 0 ? -1 : trips / lanes + 1, n->line);
+    emit(cg, "    cmp r11, r10\n    jge .L%d\n", end_lab);
+    gen_loop_align(cg);
+    emit(cg, ".L%d:\n", loop_lab);
+    for (int i = 0; i < body->child_count; i++) {
+        AstNode* s = body->children[i];
+        vg.next_reg = pinned;
+        if (s->type == AST_STORE) {
+            int r = vec_expr(&vg, s->children[1], iv);
+            char addr[64];
+            vec_access_addr(&vg, s->children[0], addr);
+            if (avx2) emit(cg, "    vmovdqu [%s], ymm%d\n", addr, r);
+            else emit(cg, "    movdqu [%s], xmm%d\n", addr, r);
+        } else {
+            int r = vec_expr(&vg, s->children[0], iv);
+            vec_op(&vg, w, s->op[0] == '-' ? "-" : s->op, vg.acc_regs[i], vg.acc_regs[i], r);
+        }
+    }
+    emit(cg, "    add r11, %d\n", lanes);
+    if (vg.iota_reg >= 0) vec_op(&vg, w, "+", vg.iota_reg, vg.iota_reg, vg.iota_step_reg);
+    emit(cg, "    cmp r11, r10\n    jl .L%d\n.L%d:\n", loop_lab, end_lab);
+
+    // Fold each accumulator's lanes and combine with the scalar variable
+    Symbol* ivsym = symtab_lookup_symbol(cg->symtab, iv);
+    char ivaddr[32];
+    snprintf(ivaddr, sizeof(ivaddr), "rbp%d", ivsym->offset);
+    emit(cg, "    mov rax, r11\n");
+    gen_store(cg, ivsym->ty, ivaddr);
+    for (int i = 0; i < body->child_count; i++) {
+        AstNode* s = body->children[i];
+        if (s->type != AST_ASSIGN) continue;
+        const char* op = s->op[0] == '-' ? "+" : s->op;  // acc - e lanes hold 0 - sum(e)
+        int acc = vg.acc_regs[i];
+        vg.next_reg = pinned;
+        int t = vec_alloc(&vg);
+        if (avx2) {
+            emit(cg, "    vextracti128 xmm%d, ymm%d, 1\n", t, acc);
+            vec_op(&vg, "xmm", op, acc, acc, t);
+            emit(cg, "    vpshufd xmm%d, xmm%d, 0x4E\n", t, acc);
+        } else {
+            emit(cg, "    pshufd xmm%d, xmm%d, 0x4E\n", t, acc);
+        }
+        vec_op(&vg, "xmm", op, acc, acc, t);
+        if (width == 4) {
+            emit(cg, avx2 ? "    vpshufd xmm%d, xmm%d, 0xB1\n" : "    pshufd xmm%d, xmm%d, 0xB1\n", t, acc);
+            vec_op(&vg, "xmm", op, acc, acc, t);
+            emit(cg, avx2 ? "    vmovd eax, xmm%d\n" : "    movd eax, xmm%d\n", acc);
+        } else {
+            emit(cg, avx2 ? "    vmovq rax, xmm%d\n" : "    movq rax, xmm%d\n", acc);
         }
+        Symbol* sym = symtab_lookup_symbol(cg->symtab, s->name);
+        const char* a = width == 4 ? "eax" : "rax";
+        const char* b = width == 4 ? "ebx" : "rbx";
+        emit(cg, "    mov %s, [rbp%d]\n", b, sym->offset);
+        if (!strcmp(op, "+")) emit(cg, "    add %s, %s\n", a, b);
+        else if (!strcmp(op, "*")) emit(cg, "    imul %s, %s\n", a, b);
+        else if (!strcmp(op, "&")) emit(cg, "    and %s, %s\n", a, b);
+        else if (!strcmp(op, "|")) emit(cg, "    or %s, %s\n", a, b);
+        else if (!strcmp(op, "min")) emit(cg, "    cmp %s, %s\n    cmovl %s, %s\n", b, a, a, b);
+        else if (!strcmp(op, "max")) emit(cg, "    cmp %s, %s\n    cmovg %s, %s\n", b, a, a, b);
+        emit(cg, "    mov [rbp%d], %s\n", sym->offset, a);
     }
+    if (avx2) emit(cg, "    vzeroupper\n");
+    return 1;
+}
+
+static int vec_needs_avx2(AstNode* n) {
+    AstNode* body = n->children[1];
+    for (int i = 0; i < body->child_count; i++) {
+        AstNode* s = body->children[i];
+        if (s->type == AST_ASSIGN && (!strcmp(s->op, "min") || !strcmp(s->op, "max"))) return 1;
+    }
+    return 0;
+}
+
+// Vector kernel(s) for an AST_VECTOR_LOOP; the scalar loop that follows it
+// runs the remaining iterations.
+void gen_vector_loop(Codegen* cg, AstNode* n) {
+    int sse2 = cg->opts->vec_isa != VEC_AVX2 && !vec_needs_avx2(n);
+    int avx2 = cg->opts->vec_isa != VEC_SSE2;
+    emit(cg, "    ; vectorized loop over %s\n", n->name);
+    if (sse2 && avx2) {
+        int sse_lab = new_label(cg);
+        int done_lab = new_label(cg);
+        cg->uses_cpu_check = 1;
+        emit(cg, "    cmp qword [__has_avx2], 0\n    je .L%d\n", sse_lab);
+        gen_vector_kernel(cg, n, 1);
+        emit(cg, "    jmp .L%d\n.L%d:\n", done_lab, sse_lab);
+        gen_vector_kernel(cg, n, 0);
+        emit(cg, ".L%d:\n", done_lab);
+    } else if (avx2 && cg->opts->vec_isa == VEC_AUTO) {
+        int done_lab = new_label(cg);
+        cg->uses_cpu_check = 1;
+        emit(cg, "    cmp qword [__has_avx2], 0\n    je .L%d\n", done_lab);
+        gen_vector_kernel(cg, n, 1);
+        emit(cg, ".L%d:\n", done_lab);
+    } else if (avx2 || sse2) {
+        gen_vector_kernel(cg, n, avx2);
+    }
+}
+
+// Sets __has_avx2 when the CPU and OS support 256-bit integer vectors
+void gen_cpu_check(Codegen* cg) {
+    emit(cg, "\n__cpu_init:\n");
+    emit(cg, "    push rbx\n");
+    emit(cg, "    mov eax, 1\n    cpuid\n");
+    emit(cg, "    and ecx, 0x18000000\n    cmp ecx, 0x18000000\n    jne .no_avx2\n");  // OSXSAVE + AVX
+    emit(cg, "    xor ecx, ecx\n    xgetbv\n");
+    emit(cg, "    and eax, 6\n    cmp eax, 6\n    jne .no_avx2\n");  // OS saves XMM + YMM state
+    emit(cg, "    mov eax, 7\n    xor ecx, ecx\n    cpuid\n");
+    emit(cg, "    test ebx, 32\n    jz .no_avx2\n");  // AVX2
+    emit(cg, "    mov qword [__has_avx2], 1\n");
+    emit(cg, ".no_avx2:\n");
+    emit(cg, "    pop rbx\n    ret\n");
 }
 
 void gen_stmt(Codegen* cg, AstNode* n);
 
-void gen_stmt(Codegen* cg, AstNode* n) {
-    if (n->type == AST_RETURN) {
-        if (n->child_count > 0) gen_expr(cg, n->children[0]);
-        else emit(cg, "    xor rax, rax\n");
-        emit(cg, "    leave\n    ret\n");
-    } else if (n->type == AST_LET) {
-        int size = 1;
-        char* type_name = NULL;
-
-        if (n->child_count > 0) {
-            if (n->children[0]->type == AST_ARRAY_LITERAL) {
-                size = n->children[0]->array_size;
-            } else if (n->children[0]->type == AST_STRUCT_LITERAL) {
-                type_name = n->children[0]->struct_type;
-                StructType* st = typetab_lookup(cg->types, type_name);
-                if (st) {
-                    int off = symtab_add_struct(cg->symtab, n->name, type_name, st->size);
-                    gen_expr(cg, n->children[0]);
-                    return;
-                }
-            }
+// rbx is callee-saved but scratch to us. These markers become its save at
+// entry and restore at each exit, or vanish if the function leaves it alone.
+static const char RBX_SAVE[] = "    ;@save\n";
+static const char RBX_RESTORE[] = "    ;@restore\n";
+
+// Tear down the frame before ret or a tail jump. A realigned frame keeps the
+// stack pointer from before the realignment in its first slot.
+static void gen_leave(Codegen* cg) {
+    emit(cg, "%s", RBX_RESTORE);
+    if (cg->frameless) return;
+    if (cg->realign) emit(cg, "    mov rsp, [rbp-8]\n    pop rbp\n");
+    else emit(cg, "    leave\n");
+}
+
+// `return f(...)` outside an inlined body: a self call reloads the
+// parameters and jumps back to the top, any other call reuses our return
+// address by jumping after `leave`.
+static int gen_tail_call(Codegen* cg, AstNode* call) {
+    if (cg->opts->opt_level < 1 || cg->inline_exit >= 0 || call->type != AST_CALL ||
+        is_builtin(call->name) || call->child_count > 6) return 0;
+    // Struct arguments or results do not map one to one onto registers
+    if (type_is_aggregate(call->ty) || type_is_aggregate(cg->ret_ty)) return 0;
+    for (int i = 0; i < call->child_count; i++) {
+        if (type_is_aggregate(call->children[i]->ty)) return 0;
+    }
+    int param_count = cg->func->child_count - 1;
+    int self = !strcmp(call->name, cg->func->name);
+    if (self && call->child_count != param_count) return 0;
+
+    cg->pushes -= gen_call_args(cg, call, NULL) / 8;  // The frame goes away with it
+    if (self) {
+        for (int i = 0; i < param_count; i++) {
+            AstNode* param = cg->func->children[i];
+            int off = symtab_lookup(cg->symtab, param->name);
+            emit(cg, "    mov [rbp%d], %s\n", off, param_reg(i, param->ty));
         }
+        emit(cg, "    jmp .L%d\n", cg->tail_label);
+    } else {
+        gen_leave(cg);
+        emit(cg, "    jmp %s\n", call->name);
+    }
+    return 1;
+}
 
-        // Check if pointer type
-        if (n->is_pointer) {
-            int off = symtab_add_pointer(cg->symtab, n->name);
-            if (n->child_count > 0) {
-                gen_expr(cg, n->children[0]);
-                emit(cg, "    mov [rbp%d], rax\n", off);
+// ---- match ----
+// Every cluster of cases gets the cheapest dispatch that fits it: a bit test
+// when at most 3 arms share a span of under 64 values, a jump table in
+// .rodata when the cases are dense, compares when only a few are left, and
+// otherwise a binary split at the middle case. The subject stays in rax;
+// rcx and rdx are scratch.
+static const int MATCH_TABLE_MIN = 4;               // Fewer cases are cheaper to compare
+static const unsigned long MATCH_TABLE_MAX = 4096;  // Entries in the largest table
+
+typedef struct MatchGen {
+    MatchCase* cases;
+    int* arm_labels;     // Label of each arm's body, by child index
+    int fallback;        // Label taken when no pattern matches
+    int is_unsigned;
+} MatchGen;
+
+// cmp only takes a sign-extended 32-bit immediate
+static void gen_cmp_imm(Codegen* cg, const char* reg, long v) {
+    if (v == (int)v) emit(cg, "    cmp %s, %ld\n", reg, v);
+    else emit(cg, "    mov rdx, %ld\n    cmp %s, rdx\n", v, reg);
+}
+
+// rcx = rax - lo, leaving for the fallback unless it is at most span
+static void gen_match_bias(Codegen* cg, MatchGen* mg, long lo, long span) {
+    emit(cg, "    mov rcx, rax\n");
+    if (lo != (int)lo) emit(cg, "    mov rdx, %ld\n    sub rcx, rdx\n", lo);
+    else if (lo) emit(cg, "    sub rcx, %ld\n", lo);
+    gen_cmp_imm(cg, "rcx", span);
+    emit(cg, "    ja .L%d\n", mg->fallback);
+}
+
+static void gen_match_cases(Codegen* cg, MatchGen* mg, int first, int count) {
+    MatchCase* c = mg->cases + first;
+    unsigned long span = (unsigned long)c[count - 1].hi - (unsigned long)c[0].lo;
+    unsigned long covered = 0;
+    int arms[4];
+    int arm_count = 0;
+    int compares = 0;
+    for (int i = 0; i < count; i++) {
+        covered += (unsigned long)c[i].hi - (unsigned long)c[i].lo + 1;
+        compares += c[i].lo == c[i].hi ? 1 : 2;
+        int seen = 0;
+        for (int j = 0; j < arm_count; j++) seen |= arms[j] == c[i].arm;
+        if (!seen && arm_count < 4) arms[arm_count++] = c[i].arm;
+    }
+
+    // Bit test: one `bt` against a 64-bit mask per arm
+    if (span < 64 && arm_count <= 3 && compares >= (arm_count == 1 ? 3 : arm_count == 2 ? 5 : 6)) {
+        gen_match_bias(cg, mg, c[0].lo, span);
+        for (int j = 0; j < arm_count; j++) {
+            unsigned long mask = 0;
+            for (int i = 0; i < count; i++) {
+                if (c[i].arm != arms[j]) continue;
+                for (unsigned long b = c[i].lo - c[0].lo; b <= (unsigned long)(c[i].hi - c[0].lo); b++) mask |= 1UL << b;
             }
-            return;
+            emit(cg, "    mov rdx, 0x%lx\n    bt rdx, rcx\n    jc .L%d\n", mask, mg->arm_labels[arms[j]]);
         }
+        emit(cg, "    jmp .L%d\n", mg->fallback);
+        return;
+    }
 
-        int off = symtab_add(cg->symtab, n->name, size);
-        if (n->child_count > 0) {
-            gen_expr(cg, n->children[0]);
-            if (n->children[0]->type != AST_ARRAY_LITERAL) {
-                emit(cg, "    mov [rbp%d], rax\n", off);
-            }
+    // Jump table: at least 40% of its entries lead to an arm
+    if (count >= MATCH_TABLE_MIN && span < MATCH_TABLE_MAX && (span + 1) * 2 <= covered * 5) {
+        int table = new_label(cg);
+        gen_match_bias(cg, mg, c[0].lo, span);
+        emit(cg, "    lea rdx, [rel .L%d]\n    jmp qword [rdx+rcx*8]\n", table);
+        emit(cg, "section .rodata\n    align 8\n.L%d:\n", table);
+        int at = 0;
+        for (unsigned long v = 0; v <= span; v++) {
+            while ((unsigned long)(c[at].hi - c[0].lo) < v) at++;
+            int target = (unsigned long)(c[at].lo - c[0].lo) <= v ? mg->arm_labels[c[at].arm] : mg->fallback;
+            emit(cg, v % 8 == 0 ? "    dq .L%d" : ", .L%d", target);
+            if (v % 8 == 7 || v == span) emit(cg, "\n");
         }
-    } else if (n->type == AST_IF) {
-        int else_lab = new_label(cg);
-        int end_lab = new_label(cg);
-        gen_expr(cg, n->children[0]);
-        emit(cg, "    test rax, rax\n    jz .L%d\n", else_lab);
-        for (int i = 0; i < n->children[1]->child_count; i++)
-            gen_stmt(cg, n->children[1]->children[i]);
-        emit(cg, "    jmp .L%d\n.L%d:\n", end_lab, else_lab);
-        if (n->child_count > 2) {
-            for (int i = 0; i < n->children[2]->child_count; i++)
-                gen_stmt(cg, n->children[2]->children[i]);
+        emit(cg, "section .text\n");
+        return;
+    }
+
+    if (count <= 3) {
+        for (int i = 0; i < count; i++) {
+            if (c[i].lo == c[i].hi) {
+                gen_cmp_imm(cg, "rax", c[i].lo);
+                emit(cg, "    je .L%d\n", mg->arm_labels[c[i].arm]);
+                continue;
+            }
+            emit(cg, "    mov rcx, rax\n");
+            if (c[i].lo != (int)c[i].lo) emit(cg, "    mov rdx, %ld\n    sub rcx, rdx\n", c[i].lo);
+            else if (c[i].lo) emit(cg, "    sub rcx, %ld\n", c[i].lo);
+            gen_cmp_imm(cg, "rcx", c[i].hi - c[i].lo);
+            emit(cg, "    jbe .L%d\n", mg->arm_labels[c[i].arm]);
         }
+        emit(cg, "    jmp .L%d\n", mg->fallback);
+        return;
+    }
+
+    int mid = count / 2;
+    int right = new_label(cg);
+    gen_cmp_imm(cg, "rax", c[mid].lo);
+    emit(cg, "    %s .L%d\n", mg->is_unsigned ? "jae" : "jge", right);
+    gen_match_cases(cg, mg, first, mid);
+    emit(cg, ".L%d:\n", right);
+    gen_match_cases(cg, mg, first + mid, count - mid);
+}
+
+void gen_match(Codegen* cg, AstNode* n) {
+    MatchGen mg;
+    int count = match_cases(n, &mg.cases);
+    int end_lab = new_label(cg);
+    mg.arm_labels = malloc(sizeof(int) * n->child_count);
+    mg.fallback = end_lab;
+    mg.is_unsigned = type_is_unsigned(n->children[0]->ty);
+    for (int i = 1; i < n->child_count; i++) {
+        mg.arm_labels[i] = new_label(cg);
+        if (n->children[i]->child_count == 1) mg.fallback = mg.arm_labels[i];
+    }
+
+    gen_expr_as(cg, n->children[0], NULL);
+    if (count > 0) gen_match_cases(cg, &mg, 0, count);
+    else emit(cg, "    jmp .L%d\n", mg.fallback);
+
+    for (int i = 1; i < n->child_count; i++) {
+        AstNode* body = n->children[i]->children[n->children[i]->child_count - 1];
+        emit(cg, ".L%d:\n", mg.arm_labels[i]);
+        for (int j = 0; j < body->child_count; j++) gen_stmt(cg, body->children[j]);
+        if (i + 1 < n->child_count) emit(cg, "    jmp .L%d\n", end_lab);
+    }
+    emit(cg, ".L%d:\n", end_lab);
+    free(mg.cases);
+    free(mg.arm_labels);
+}
+
+// Return struct `value` from the function: in rax:rdx, or copied out
+// through the hidden pointer, which goes back in rax
+static void gen_return_struct(Codegen* cg, AstNode* value) {
+    int size = type_size(cg->ret_ty);
+    gen_expr(cg, value);
+    if (returns_in_memory(cg->ret_ty)) {
+        int ret_ptr = symtab_lookup(cg->symtab, "__ret_ptr");
+        emit(cg, "    mov rbx, [rbp%d]\n", ret_ptr);
+        gen_copy(cg, size);
+        emit(cg, "    mov rax, [rbp%d]\n", ret_ptr);
+        return;
+    }
+    emit(cg, "    mov rbx, rax\n");
+    if (size > 8) gen_load_bytes(cg, "rdx", "rbx", 8, size - 8);
+    gen_load_bytes(cg, "rax", "rbx", 0, size < 8 ? size : 8);
+}
+
+// --profile-generate: count one of n's events
+static void gen_prof_count(Codegen* cg, AstNode* n, int k) {
+    if (cg->opts->profile_generate && n->prof) {
+        emit(cg, "    inc qword [rel __prof_counts+%d]\n", (n->prof - 1 + k) * 8);
+    }
+}
+
+// ---- Block layout ----
+// Each side of an if is placed by how often it runs: as counted by
+// --profile-use, or else guessed (a side that calls exit or a @cold
+// function is rare). The more frequent side falls through. A less frequent
+// side with nothing to follow (an if without else) moves past the
+// function's ret; a rare one moves to .text.unlikely, with the functions
+// that are @cold or never ran in the profile.
+typedef enum { HEAT_NORMAL, HEAT_UNLIKELY, HEAT_RARE } Heat;
+
+static const char TEXT_UNLIKELY[] = "section .text.unlikely progbits alloc exec nowrite align=16\n";
+
+static int calls_rare(Codegen* cg, AstNode* n) {
+    if (n->type == AST_CALL) {
+        AstNode* f = find_function(cg->prog, n->name);
+        if (!strcmp(n->name, "exit") || (f && ast_attr(f, "cold"))) return 1;
+    }
+    for (int i = 0; i < n->child_count; i++) {
+        if (calls_rare(cg, n->children[i])) return 1;
+    }
+    return 0;
+}
+
+static Heat side_heat(long runs, long reached) {
+    if (runs * 8 < reached) return HEAT_RARE;
+    return runs * 2 < reached ? HEAT_UNLIKELY : HEAT_NORMAL;
+}
+
+static void if_heat(Codegen* cg, AstNode* n, Heat* then_heat, Heat* else_heat) {
+    long reached = profile_count(cg->profile, n, 0);
+    long taken = profile_count(cg->profile, n, 1);
+    if (reached > 0) {
+        *then_heat = side_heat(taken, reached);
+        *else_heat = side_heat(reached - taken, reached);
+    } else {
+        *then_heat = calls_rare(cg, n->children[1]) ? HEAT_RARE : HEAT_NORMAL;
+        *else_heat = n->child_count > 2 && calls_rare(cg, n->children[2]) ? HEAT_RARE : HEAT_NORMAL;
+        if (*then_heat == *else_heat) *then_heat = *else_heat = HEAT_NORMAL;
+    }
+}
+
+// Cut the code from `at` on and append it to an out-of-line buffer
+static void code_move(Codegen* cg, int at, char** to) {
+    int len = cg->code_len - at;
+    int have = *to ? strlen(*to) : 0;
+    *to = realloc(*to, have + len + 1);
+    memcpy(*to + have, cg->code_buf + at, len);
+    (*to)[have + len] = '\0';
+    cg->code_len = at;
+    cg->code_buf[at] = '\0';
+}
+
+// Does the code emitted so far end in a jump or ret?
+static int code_ends_in_jump(Codegen* cg) {
+    char* last = cg->code_buf + cg->code_len - 1;
+    while (last > cg->code_buf && last[-1] != '\n') last--;
+    return !strncmp(last, "    jmp ", 8) || !strncmp(last, "    ret", 7);
+}
+
+static void gen_if(Codegen* cg, AstNode* n) {
+    Heat then_heat, else_heat;
+    if_heat(cg, n, &then_heat, &else_heat);
+    AstNode* else_block = n->child_count > 2 ? n->children[2] : NULL;
+    int invert = then_heat > else_heat;
+    AstNode* first = invert ? else_block : n->children[1];
+    AstNode* second = invert ? n->children[1] : else_block;
+    Heat heat = invert ? then_heat : else_heat;
+    int second_lab = new_label(cg);
+    int end_lab = new_label(cg);
+
+    gen_branch(cg, n->children[0], invert, second_lab);
+    if (!invert) gen_prof_count(cg, n, 1);
+    for (int i = 0; first && i < first->child_count; i++)
+        gen_stmt(cg, first->children[i]);
+    if (!second) {
+        emit(cg, ".L%d:\n", second_lab);
+        return;
+    }
+    int out_of_line = heat == HEAT_RARE || (heat == HEAT_UNLIKELY && !first);
+    int at = -1;
+    if (out_of_line) {
+        emit(cg, ".L%d:\n", end_lab);
+        at = cg->code_len;
+        emit(cg, ".L%d:\n", second_lab);
+    } else {
+        emit(cg, "    jmp .L%d\n.L%d:\n", end_lab, second_lab);
+    }
+    if (invert) gen_prof_count(cg, n, 1);
+    int outer_unlikely = cg->in_unlikely;
+    if (heat == HEAT_RARE) cg->in_unlikely = 1;
+    for (int i = 0; i < second->child_count; i++)
+        gen_stmt(cg, second->children[i]);
+    cg->in_unlikely = outer_unlikely;
+    if (!out_of_line) {
         emit(cg, ".L%d:\n", end_lab);
+        return;
+    }
+    // No way back needed after a return or a break
+    if (!code_ends_in_jump(cg)) emit(cg, "    jmp .L%d\n", end_lab);
+    code_move(cg, at, heat == HEAT_RARE ? &cg->unlikely : &cg->cold);
+}
+
+void gen_stmt(Codegen* cg, AstNode* n) {
+    if (n->type == AST_RETURN) {
+        if (n->child_count > 0 && gen_tail_call(cg, n->children[0])) return;
+        if (n->child_count > 0 && cg->inline_exit < 0 && cg->ret_ty->kind == TY_STRUCT) {
+            gen_return_struct(cg, n->children[0]);
+        } else if (n->child_count > 0) {
+            gen_expr_value(cg, n->children[0], cg->ret_ty);
+        } else {
+            emit(cg, "    xor eax, eax\n");
+        }
+        if (cg->inline_exit >= 0) emit(cg, "    jmp .L%d\n", cg->inline_exit);
+        else {
+            gen_leave(cg);
+            emit(cg, "    ret\n");
+        }
+    } else if (n->type == AST_LET) {
+        // A name declared again (one flat scope per function) keeps its first slot
+        Symbol* sym = symtab_lookup_symbol(cg->symtab, n->name);
+        Type* ty = sym ? sym->ty : n->ty;
+        int off = sym ? sym->offset : symtab_add(cg->symtab, n->name, n->ty);
+        if (n->child_count > 0 && !gen_struct_call_into(cg, n->name, n->children[0])) {
+            gen_init(cg, ty, n->children[0], 0, off);
+        }
+    } else if (n->type == AST_IF) {
+        // Instrumented ifs keep their branches, to count them
+        if (!cg->opts->profile_generate && gen_select(cg, n)) return;
+        gen_prof_count(cg, n, 0);
+        gen_if(cg, n);
     } else if (n->type == AST_WHILE) {
-        int start_lab = new_label(cg);
+        // Bottom-tested: one compare-and-branch per iteration. The entry
+        // jump to the test is skipped when the trip count is known nonzero.
+        int body_lab = new_label(cg);
+        int test_lab = new_label(cg);
         int end_lab = new_label(cg);
-        emit(cg, ".L%d:\n", start_lab);
-        gen_expr(cg, n->children[0]);
-        emit(cg, "    test rax, rax\n    jz .L%d\n", end_lab);
+        Attribute* trip = ast_attr(n, "trip");
+        long trips = 0;
+        if (!trip || !ast_is_num(trip->arg, &trips) || trips == 0) emit(cg, "    jmp .L%d\n", test_lab);
+        Attribute* most = trip ? trip : ast_attr(n, "max_trip");
+        long bound = -1;
+        if (most && !ast_is_num(most->arg, &bound)) bound = -1;
+        gen_loop_bound(cg, body_lab, bound, n->line);
+        gen_loop_bound(cg, test_lab, bound, n->line);
+        gen_loop_align(cg);
+        emit(cg, ".L%d:\n", body_lab);
+        int outer_break = cg->break_label, outer_continue = cg->continue_label;
+        cg->break_label = end_lab;
+        cg->continue_label = test_lab;
         for (int i = 0; i < n->children[1]->child_count; i++)
             gen_stmt(cg, n->children[1]->children[i]);
-        emit(cg, "    jmp .L%d\n.L%d:\n", start_lab, end_lab);
-    } else if (n->type == AST_CALL || n->type == AST_ASSIGN) {
+        cg->break_label = outer_break;
+        cg->continue_label = outer_continue;
+        emit(cg, ".L%d:\n", test_lab);
+        gen_branch(cg, n->children[0], 1, body_lab);
+        emit(cg, ".L%d:\n", end_lab);
+    } else if (n->type == AST_BREAK) {
+        emit(cg, "    jmp .L%d\n", cg->break_label);
+    } else if (n->type == AST_CONTINUE) {
+        emit(cg, "    jmp .L%d\n", cg->continue_label);
+    } else if (n->type == AST_CALL || n->type == AST_ASSIGN || n->type == AST_STORE || n->type == AST_INLINE) {
         gen_expr(cg, n);
+    } else if (n->type == AST_VECTOR_LOOP) {
+        gen_vector_loop(cg, n);
+    } else if (n->type == AST_MATCH) {
+        gen_match(cg, n);
     }
 }
 
-void gen_func(Codegen* cg, AstNode* n) {
-    emit(cg, "\n%s:\n", n->name);
-    emit(cg, "    push rbp\n    mov rbp, rsp\n");
+// Calls nothing that could use the stack below us (syscall-only builtins are fine)
+static int is_leaf(AstNode* n) {
+    if (n->type == AST_CALL && strcmp(n->name, "print") && strcmp(n->name, "println") &&
+        strcmp(n->name, "exit")) return 0;
+    if (prints_str(n)) return 0;
+    for (int i = 0; i < n->child_count; i++) {
+        if (!is_leaf(n->children[i])) return 0;
+    }
+    return 1;
+}
+
+// Largest alignment any local needs
+static int max_local_align(AstNode* n) {
+    int align = n->type == AST_LET ? type_align(n->ty) : 1;
+    for (int i = 0; i < n->child_count; i++) {
+        int a = max_local_align(n->children[i]);
+        if (a > align) align = a;
+    }
+    return align;
+}
+
+// Whether assembly `code` touches rbx under any of its names
+static int code_uses_rbx(char* code) {
+    static const char* names[] = {"rbx", "ebx", "bx", "bl", "bh"};
+    for (char* p = code; *p; p++) {
+        if (isalnum((unsigned char)p[-1])) continue;
+        for (int i = 0; i < 5; i++) {
+            int len = strlen(names[i]);
+            if (!strncmp(p, names[i], len) && !isalnum((unsigned char)p[len])) return 1;
+        }
+    }
+    return 0;
+}
+
+// Replace the rbx markers in the code emitted since `from`
+static void patch_rbx(Codegen* cg, int from, const char* save, const char* restore) {
+    char* code = strdup(cg->code_buf + from);
+    cg->code_len = from;
+    for (char* p = code; *p;) {
+        char* line_end = strchr(p, '\n') + 1;
+        int len = line_end - p;
+        if (!strncmp(p, RBX_SAVE, len)) emit(cg, "%s", save);
+        else if (!strncmp(p, RBX_RESTORE, len)) emit(cg, "%s", restore);
+        else emit(cg, "%.*s", len, p);
+        p = line_end;
+    }
+    free(code);
+}
+
+static int has_locals(AstNode* n) {
+    if (n->type == AST_LET) return 1;
+    for (int i = 0; i < n->child_count; i++) {
+        if (has_locals(n->children[i])) return 1;
+    }
+    return 0;
+}
 
+void gen_func(Codegen* cg, AstNode* n) {
     int param_count = n->child_count - 1;
-    const char* regs[] = {"rdi", "rsi", "rdx", "rcx", "r8", "r9"};
+    AstNode* body = n->children[param_count];
+    int optimize = cg->opts->opt_level >= 1;
+
+    // A leaf with no parameters or locals never touches rbp
+    cg->frameless = optimize && param_count == 0 && is_leaf(body) && !has_locals(body);
+
+    // rbp is only 16-byte aligned; @align(32+) locals need it rounded down
+    int align = cg->frameless ? 1 : max_local_align(body);
+    cg->realign = align > 16;
+
+    int func_at = cg->code_len;
+    if (optimize && !cg->in_unlikely) emit(cg, "\n    align 16");
+    emit(cg, "\n%s:\n", n->name);
+    if (cg->realign) {
+        emit(cg, "    push rbp\n    mov r11, rsp\n    and rsp, -%d\n    mov rbp, rsp\n", align);
+    } else if (!cg->frameless) {
+        emit(cg, "    push rbp\n    mov rbp, rsp\n");
+    }
 
     SymbolTable* old_symtab = cg->symtab;
     cg->symtab = symtab_new();
+    if (cg->realign) {
+        int off = symtab_add(cg->symtab, "__saved_sp", type_int(8));
+        emit(cg, "    mov [rbp%d], r11\n", off);
+    }
+    cg->func = n;
+    cg->ret_ty = n->ty;
+    cg->tail_label = new_label(cg);
+    cg->break_label = cg->continue_label = -1;
 
-    for (int i = 0; i < param_count && i < 6; i++) {
-        int off;
-        if (n->children[i]->is_pointer) {
-            off = symtab_add_pointer(cg->symtab, n->children[i]->name);
+    // Parameters in registers are spilled to their slots; the rest were
+    // passed above the return address (read through the saved rsp when
+    // the frame is realigned)
+    int hidden_ret = returns_in_memory(n->ty);
+    if (hidden_ret) emit(cg, "    mov [rbp%d], rdi\n", symtab_add(cg->symtab, "__ret_ptr", type_int(8)));
+    Type** types = malloc(sizeof(Type*) * (param_count + 1));
+    int* regs = malloc(sizeof(int) * (param_count + 1));
+    int* offs = malloc(sizeof(int) * (param_count + 1));
+    for (int i = 0; i < param_count; i++) types[i] = n->children[i]->ty;
+    assign_args(types, param_count, hidden_ret, regs, offs);
+    for (int i = 0; i < param_count; i++) {
+        AstNode* param = n->children[i];
+        // An array parameter arrives as the caller's array address: its slot is
+        // a pointer, loaded before indexing
+        Type* ty = param->ty->kind == TY_ARRAY ? type_ptr(param->ty->base) : param->ty;
+        int off = symtab_add(cg->symtab, param->name, ty);
+        int size = type_size(param->ty);
+        char addr[32];
+        snprintf(addr, sizeof(addr), "rbp%d", off);
+        if (regs[i] >= 0 && param->ty->kind == TY_STRUCT) {
+            for (int k = 0; k * 8 < size; k++) {
+                gen_store_bytes(cg, arg_regs[regs[i] + k], "rbp", off + k * 8, size - k * 8 < 8 ? size - k * 8 : 8);
+            }
+        } else if (regs[i] >= 0) {
+            emit(cg, "    mov [rbp%d], %s\n", off, param_reg(regs[i], ty));
         } else {
-            off = symtab_add(cg->symtab, n->children[i]->name, 1);
+            if (cg->realign) emit(cg, "    mov r11, [rbp-8]\n");
+            const char* base = cg->realign ? "r11" : "rbp";
+            if (param->ty->kind == TY_STRUCT) gen_move_bytes(cg, "rbp", off, base, 16 + offs[i], size);
+            else if (type_is_aggregate(param->ty)) emit(cg, "    mov rax, [%s+%d]\n    mov [rbp%d], rax\n", base, 16 + offs[i], off);
+            else {
+                emit(cg, "    mov rax, [%s+%d]\n", base, 16 + offs[i]);
+                gen_store(cg, param->ty, addr);
+            }
         }
-        emit(cg, "    mov [rbp%d], %s\n", off, regs[i]);
     }
+    free(types);
+    free(regs);
+    free(offs);
 
-    emit(cg, "    sub rsp, 256\n");  // Increased for pointers
+    // Frame size is patched in once all locals (including optimizer temps) are known
+    int frame_at = cg->code_len;
+    if (!cg->frameless) emit(cg, "    sub rsp, %-10d\n", 0);
+    gen_prof_count(cg, n, 0);
+    emit(cg, "%s.L%d:\n", RBX_SAVE, cg->tail_label);
+    gen_loop_bound(cg, cg->tail_label, -1, -1);  // Self tail calls jump back here
 
-    AstNode* body = n->children[param_count];
     for (int i = 0; i < body->child_count; i++)
         gen_stmt(cg, body->children[i]);
 
-    emit(cg, "    xor rax, rax\n    leave\n    ret\n");
+    emit(cg, "    xor rax, rax\n");
+    gen_leave(cg);
+    emit(cg, "    ret\n");
+    if (cg->cold) {
+        emit(cg, "%s", cg->cold);
+        free(cg->cold);
+        cg->cold = NULL;
+    }
+    if (cg->unlikely) {
+        if (!cg->in_unlikely) emit(cg, "%s", TEXT_UNLIKELY);
+        emit(cg, "%s", cg->unlikely);
+        if (!cg->in_unlikely) emit(cg, "section .text\n");
+        free(cg->unlikely);
+        cg->unlikely = NULL;
+    }
+
+    char save[48] = "", restore[48] = "";
+    if (code_uses_rbx(cg->code_buf + func_at)) {
+        if (cg->frameless) {
+            strcpy(save, "    push rbx\n");
+            strcpy(restore, "    pop rbx\n");
+        } else {
+            int off = symtab_add(cg->symtab, "__saved_rbx", type_int(8));
+            sprintf(save, "    mov [rbp%d], rbx\n", off);
+            sprintf(restore, "    mov rbx, [rbp%d]\n", off);
+        }
+    }
+
+    if (!cg->frameless) {
+        int frame = (cg->symtab->stack_size + 15) & ~15;
+        char patch[32];
+        int patch_len = sprintf(patch, "    sub rsp, %-10d", frame);
+        // Locals of a body that neither pushes nor calls fit in the 128-byte red zone
+        char* code = cg->code_buf + frame_at;
+        if (optimize && frame <= 128 && !strstr(code, "    push ") && !strstr(code, "    call ")) {
+            patch_len = sprintf(patch, "    ; red zone %-8d", frame);
+        }
+        memcpy(cg->code_buf + frame_at, patch, patch_len);
+    }
+    patch_rbx(cg, func_at, save, restore);
 
     cg->symtab = old_symtab;
+    cg->frameless = 0;
+    cg->realign = 0;
 }
 
-void gen_helpers(Codegen* cg) {
+static void gen_print_int(Codegen* cg) {
     emit(cg, "\n__print_int:\n");
     emit(cg, "    push rbp\n    mov rbp, rsp\n");
     emit(cg, "    sub rsp, 32\n");
@@ -1003,10 +6647,12 @@ void gen_helpers(Codegen* cg) {
 
     emit(cg, ".done:\n");
     emit(cg, "    leave\n    ret\n");
+}
 
-    // __strcmp: Compare two strings
-    // Input: rdi = s1, rsi = s2
-    // Output: rax = 0 if equal, -1 if s1 < s2, 1 if s1 > s2
+// __strcmp: Compare two strings
+// Input: rdi = s1, rsi = s2
+// Output: rax = 0 if equal, -1 if s1 < s2, 1 if s1 > s2
+static void gen_strcmp(Codegen* cg) {
     emit(cg, "\n__strcmp:\n");
     emit(cg, "    push rbp\n    mov rbp, rsp\n");
     emit(cg, ".strcmp_loop:\n");
@@ -1027,10 +6673,12 @@ void gen_helpers(Codegen* cg) {
     emit(cg, "    movzx rbx, bl\n");
     emit(cg, "    sub rax, rbx\n");
     emit(cg, "    leave\n    ret\n");
+}
 
-    // __strcpy: Copy string from src to dest
-    // Input: rdi = dest, rsi = src
-    // Output: rax = dest
+// __strcpy: Copy string from src to dest
+// Input: rdi = dest, rsi = src
+// Output: rax = dest
+static void gen_strcpy(Codegen* cg) {
     emit(cg, "\n__strcpy:\n");
     emit(cg, "    push rbp\n    mov rbp, rsp\n");
     emit(cg, "    mov rax, rdi\n");  // Save dest for return
@@ -1044,10 +6692,12 @@ void gen_helpers(Codegen* cg) {
     emit(cg, "    jmp .strcpy_loop\n");
     emit(cg, ".strcpy_done:\n");
     emit(cg, "    leave\n    ret\n");
+}
 
-    // __strlen: Get string length
-    // Input: rdi = s
-    // Output: rax = length
+// __strlen: Get string length
+// Input: rdi = s
+// Output: rax = length
+static void gen_strlen(Codegen* cg) {
     emit(cg, "\n__strlen:\n");
     emit(cg, "    push rbp\n    mov rbp, rsp\n");
     emit(cg, "    xor rax, rax\n");
@@ -1060,45 +6710,248 @@ void gen_helpers(Codegen* cg) {
     emit(cg, "    leave\n    ret\n");
 }
 
+// Runtime helpers, each only if something calls it
+void gen_helpers(Codegen* cg) {
+    if (program_calls(cg->prog, "print_int")) gen_print_int(cg);
+    if (program_calls(cg->prog, "strcmp")) gen_strcmp(cg);
+    if (program_calls(cg->prog, "strcpy")) gen_strcpy(cg);
+    if (program_calls(cg->prog, "strlen") || prints_str(cg->prog)) gen_strlen(cg);
+}
+
+// @align(N): N must be a power of two
+static int align_attr(AstNode* n, char* what) {
+    Attribute* a = ast_attr(n, "align");
+    if (!a) return 0;
+    long v = 0;
+    if (!a->arg || !ast_is_num(a->arg, &v) || v < 1 || (v & (v - 1)) || v > 4096) {
+        fprintf(stderr, "Error: @align on %s needs a power of two up to 4096\n", what);
+        exit(1);
+    }
+    return (int)v;
+}
+
 void build_type_table(TypeTable* tt, AstNode* ast) {
     for (int i = 0; i < ast->child_count; i++) {
         if (ast->children[i]->type == AST_STRUCT_DEF) {
             AstNode* struct_def = ast->children[i];
             typetab_add(tt, struct_def->name);
+            StructType* st = typetab_lookup(tt, struct_def->name);
+            st->packed = ast_attr(struct_def, "packed") != NULL;
+            st->reorder = ast_attr(struct_def, "reorder") != NULL;
+            st->align_attr = align_attr(struct_def, struct_def->name);
+            st->soa = ast_attr(struct_def, "soa") != NULL;
 
             for (int j = 0; j < struct_def->child_count; j++) {
-                typetab_add_field(tt, struct_def->name, struct_def->children[j]->name);
+                AstNode* field = struct_def->children[j];
+                typetab_add_field(tt, struct_def->name, field->name, field->ty);
+                st->fields[st->field_count - 1].align_attr = align_attr(field, field->name);
+            }
+        }
+    }
+    for (int i = 0; i < tt->count; i++) typetab_layout(tt, &tt->types[i]);
+}
+
+// Lay out the constant initializer `e` of an object of type `ty` at img+off;
+// string pointers are recorded in `strs` and emitted as relocations
+static void global_image(Codegen* cg, AstNode* g, Type* ty, AstNode* e, unsigned char* img, char** strs, int off) {
+    if (e->type == AST_STRUCT_LITERAL) {
+        for (int i = 0; i < e->child_count; i++) {
+            StructField* f = typetab_field(cg->types, e->struct_type, e->children[i]->name);
+            global_image(cg, g, f->ty, e->children[i]->children[0], img, strs, off + f->offset);
+        }
+        return;
+    }
+    if (e->type == AST_ARRAY_LITERAL) {
+        Type* elem = ty->base;
+        if (e->child_count > ty->length) {
+            fprintf(stderr, "Error: %d initializers for %s of %d elements\n", e->child_count, g->name, ty->length);
+            exit(1);
+        }
+        for (int i = 0; i < e->child_count; i++) {
+            AstNode* c = e->children[i];
+            if (!type_is_soa(elem) || c->type != AST_STRUCT_LITERAL) {
+                global_image(cg, g, elem, c, img, strs, off + i * type_size(elem));
+                continue;
+            }
+            // Element i of a @soa array is scattered over the field arrays
+            for (int j = 0; j < c->child_count; j++) {
+                StructField* f = typetab_field(cg->types, c->struct_type, c->children[j]->name);
+                int at = soa_field_offset(elem->st, f, ty->length) + i * type_size(f->ty);
+                global_image(cg, g, f->ty, c->children[j]->children[0], img, strs, off + at);
+            }
+        }
+        return;
+    }
+    long v;
+    if (e->type == AST_STRING && ty->kind == TY_STR) {
+        strs[off] = strtab_add(cg->strtab, e->value, strlen(e->value));
+    } else if (!type_is_aggregate(ty) && const_value(cg->prog, e, &v)) {
+        for (int i = 0; i < type_size(ty); i++) img[off + i] = (unsigned char)(v >> (8 * i));
+    } else {
+        fprintf(stderr, "Error: initializer of %s is not a constant\n", g->name);
+        exit(1);
+    }
+}
+
+// Globals: consts in .rodata, initialized variables in .data, the rest
+// zero-filled in .bss, where they cost nothing in the executable
+static void gen_global_data(Codegen* cg, FILE* out) {
+    const char* sections[] = {".rodata", ".data", ".bss"};
+    for (int sec = 0; sec < 3; sec++) {
+        int started = 0;
+        for (int i = 0; i < cg->prog->child_count; i++) {
+            AstNode* g = cg->prog->children[i];
+            if (g->type != AST_GLOBAL) continue;
+            int in = g->child_count == 0 ? 2 : !strcmp(g->op, "const") ? 0 : 1;
+            if (in != sec) continue;
+            if (!started) fprintf(out, "section %s\n", sections[sec]);
+            started = 1;
+            Symbol* sym = symtab_lookup_symbol(cg->globals, g->name);
+            int size = type_size(g->ty);
+            if (sec == 2) {
+                fprintf(out, "alignb %d\n%s: resb %d\n", type_align(g->ty), sym->label, size);
+                continue;
+            }
+            unsigned char* img = calloc(size, 1);
+            char** strs = calloc(size, sizeof(char*));
+            global_image(cg, g, g->ty, g->children[0], img, strs, 0);
+            fprintf(out, "align %d\n%s:\n", type_align(g->ty), sym->label);
+            for (int off = 0; off < size;) {
+                int zeros = 0;
+                while (off + zeros < size && !img[off + zeros] && !strs[off + zeros]) zeros++;
+                if (strs[off]) {
+                    fprintf(out, "    dq %s\n", strs[off]);
+                    off += 8;
+                } else if (zeros >= 16 || off + zeros == size) {
+                    fprintf(out, "    times %d db 0\n", zeros);
+                    off += zeros;
+                } else {
+                    fprintf(out, "    db ");
+                    for (int n = 0; n < 16 && off < size && !strs[off]; n++, off++) {
+                        fprintf(out, n ? ", %d" : "%d", img[off]);
+                    }
+                    fprintf(out, "\n");
+                }
             }
+            free(img);
+            free(strs);
         }
     }
 }
 
-void codegen(AstNode* ast, const char* file, StringTable* strtab, TypeTable* types) {
+// Exit hook of an instrumented program (exit status in rdi): adds the counts
+// of earlier runs if the file holds a profile of this program, then writes
+// the sums back
+static void gen_prof_dump(Codegen* cg) {
+    int bytes = cg->profile->count * 8;
+    char* path = strtab_add(cg->strtab, cg->opts->profile_generate, strlen(cg->opts->profile_generate));
+    int write_lab = new_label(cg), add_lab = new_label(cg), done_lab = new_label(cg);
+    emit(cg, "\n__prof_dump:\n    push rdi\n");
+    emit(cg, "    mov rax, 2\n    mov rdi, %s\n    xor esi, esi\n    syscall\n", path);  // open(path, O_RDONLY)
+    emit(cg, "    test rax, rax\n    js .L%d\n    mov r8, rax\n", write_lab);
+    emit(cg, "    xor eax, eax\n    mov rdi, r8\n    lea rsi, [rel __prof_buf]\n    mov rdx, %d\n    syscall\n", 16 + bytes);
+    emit(cg, "    mov r9, rax\n    mov rax, 3\n    mov rdi, r8\n    syscall\n");
+    emit(cg, "    cmp r9, %d\n    jne .L%d\n", 16 + bytes, write_lab);
+    for (int k = 0; k < 16; k += 8) {
+        emit(cg, "    mov rax, [rel __prof_buf+%d]\n    cmp rax, [rel __prof_header+%d]\n    jne .L%d\n", k, k, write_lab);
+    }
+    emit(cg, "    lea rsi, [rel __prof_buf+16]\n    lea rdi, [rel __prof_counts]\n    xor ecx, ecx\n");
+    gen_loop_bound(cg, add_lab, cg->profile->count, 0);
+    emit(cg, ".L%d:\n    mov rax, [rsi+rcx*8]\n    add [rdi+rcx*8], rax\n", add_lab);
+    emit(cg, "    inc rcx\n    cmp rcx, %d\n    jb .L%d\n", cg->profile->count, add_lab);
+    // open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)
+    emit(cg, ".L%d:\n    mov rax, 2\n    mov rdi, %s\n    mov esi, 577\n    mov edx, 420\n    syscall\n", write_lab, path);
+    emit(cg, "    test rax, rax\n    js .L%d\n    mov r8, rax\n", done_lab);
+    emit(cg, "    mov rax, 1\n    mov rdi, r8\n    lea rsi, [rel __prof_header]\n    mov rdx, 16\n    syscall\n");
+    emit(cg, "    mov rax, 1\n    mov rdi, r8\n    lea rsi, [rel __prof_counts]\n    mov rdx, %d\n    syscall\n", bytes);
+    emit(cg, "    mov rax, 3\n    mov rdi, r8\n    syscall\n");
+    emit(cg, ".L%d:\n    pop rdi\n    ret\n", done_lab);
+}
+
+void wcet_analyze(Codegen* cg);
+void stack_analyze(Codegen* cg);
+
+void codegen(AstNode* ast, const char* file, StringTable* strtab, TypeTable* types, Options* opts,
+             Profile* profile) {
     Codegen cg;
     cg.out = NULL;
+    cg.opts = opts;
+    cg.uses_cpu_check = 0;
     cg.label_count = 0;
+    cg.inline_exit = -1;
+    cg.prog = ast;
+    cg.func = NULL;
+    cg.ret_ty = NULL;
+    cg.tail_label = -1;
+    cg.frameless = 0;
+    cg.pushes = 0;
+    NameSet externs = {NULL, 0};
+    cg.externs = &externs;
+    cg.newline = NULL;
     cg.symtab = NULL;
+    cg.globals = symtab_new();
     cg.strtab = strtab;
     cg.types = types;
+    cg.profile = profile;
+    cg.cold = NULL;
+    cg.unlikely = NULL;
+    cg.in_unlikely = 0;
+    cg.loops = NULL;
+    cg.loop_count = 0;
     cg.code_buf = NULL;
     cg.code_len = 0;
     cg.code_cap = 0;
 
-    emit(&cg, "\nsection .text\n    global _start\n\n");
-    emit(&cg, "_start:\n    call main\n    mov rdi, rax\n");
-    emit(&cg, "    mov rax, 60\n    syscall\n");
+    for (int i = 0; i < ast->child_count; i++) {
+        AstNode* g = ast->children[i];
+        if (g->type != AST_GLOBAL) continue;
+        symtab_add(cg.globals, g->name, g->ty);
+        Symbol* sym = &cg.globals->symbols[cg.globals->count - 1];
+        sym->label = malloc(strlen(g->name) + 5);
+        sprintf(sym->label, "__g_%s", g->name);
+    }
+
+    emit(&cg, "\nsection .text\n    global _start\n");
 
     gen_helpers(&cg);
 
-    for (int i = 0; i < ast->child_count; i++) {
-        if (ast->children[i]->type == AST_FUNCTION) {
-            gen_func(&cg, ast->children[i]);
+    // @cold functions and those the profile never saw called go to .text.unlikely
+    for (int cold = 0; cold < 2; cold++) {
+        for (int i = 0; i < ast->child_count; i++) {
+            AstNode* f = ast->children[i];
+            if (f->type != AST_FUNCTION) continue;
+            if ((ast_attr(f, "cold") || profile_count(profile, f, 0) == 0) != cold) continue;
+            if (cold && !cg.in_unlikely) emit(&cg, "\n%s", TEXT_UNLIKELY);
+            cg.in_unlikely = cold;
+            gen_func(&cg, f);
         }
     }
+    if (cg.in_unlikely) emit(&cg, "\nsection .text\n");
+    cg.in_unlikely = 0;
+
+    // Entry point last: it only probes the CPU if a kernel dispatches on it
+    if (cg.uses_cpu_check) gen_cpu_check(&cg);
+    if (opts->profile_generate) gen_prof_dump(&cg);
+    emit(&cg, "\n_start:\n");
+    if (cg.uses_cpu_check) emit(&cg, "    call __cpu_init\n");
+    emit(&cg, "    call main\n    mov rdi, rax\n");
+    if (opts->profile_generate) emit(&cg, "    call __prof_dump\n");
+    emit(&cg, "    mov rax, 60\n    syscall\n");
+    wcet_analyze(&cg);
+    stack_analyze(&cg);
 
     cg.out = fopen(file, "w");
     fprintf(cg.out, "; CHRONOS v0.10 - String Operations\n\n");
+    gen_global_data(&cg, cg.out);
+    if (opts->profile_generate) {
+        fprintf(cg.out, "section .bss\nalignb 8\n__prof_counts: resq %d\n", profile->count);
+        fprintf(cg.out, "__prof_buf: resq %d\n", profile->count + 2);
+    }
     fprintf(cg.out, "section .data\n");
+    if (opts->profile_generate) {
+        fprintf(cg.out, "__prof_header: dd %u, %u, %d, %u\n", PROFILE_MAGIC, PROFILE_VERSION,
+                profile->count, profile->checksum);
+    }
 
     for (int i = 0; i < strtab->count; i++) {
         fprintf(cg.out, "%s: db ", strtab->strings[i].label);
@@ -1108,17 +6961,1030 @@ void codegen(AstNode* ast, const char* file, StringTable* strtab, TypeTable* typ
         }
         fprintf(cg.out, "0\n");  // Null terminator
     }
+    if (cg.uses_cpu_check) fprintf(cg.out, "__has_avx2: dq 0\n");
 
+    for (int i = 0; i < externs.count; i++) fprintf(cg.out, "extern %s\n", externs.names[i]);
     fprintf(cg.out, "%s", cg.code_buf);
 
     fclose(cg.out);
     free(cg.code_buf);
 }
 
+// ==== LOOP BOUNDS ====
+// The most times each loop body can run, as a max_trip attribute that only
+// the WCET analysis and the loop report read. A for loop with constant
+// bounds already has its trip count. A while loop gets one inferred when it
+// counts: the condition compares a local with a constant, the local starts
+// at a constant set earlier in the block, and the body's only write to it is
+// a top-level `v = v + k` (or - k) that no continue can skip.
+//
+// @bound(N) on a loop declares a bound, taken when it is constant and no
+// smaller than what is known. @bound(expr) is evaluated each time the loop
+// starts; with checks on (-fbound-check, or -O0), a counter stops the
+// program when the body runs more times than that.
+// A continue of this loop (not of one nested in it) somewhere in `n`
+static int continues(AstNode* n) {
+    if (n->type == AST_CONTINUE) return 1;
+    for (int i = 0; i < n->child_count; i++) {
+        if (n->children[i]->type != AST_WHILE && continues(n->children[i])) return 1;
+    }
+    return 0;
+}
+
+// A constant, or a local the function sets once, to a constant, and never
+// lends out
+static int fixed_value(AstNode* prog, AstNode* func, AstNode* e, long* value) {
+    if (const_value(prog, e, value)) return 1;
+    if (e->type != AST_IDENT || e->child_count > 0 || find_global(prog, e->name) ||
+        address_taken(func, e->name) || count_writes(func, e->name) != 1) return 0;
+    AstNode* body = func->children[func->child_count - 1];
+    for (int i = 0; i < body->child_count; i++) {
+        AstNode* s = body->children[i];
+        if (s->type == AST_LET && !strcmp(s->name, e->name)) {
+            return s->child_count == 1 && const_value(prog, s->children[0], value);
+        }
+    }
+    return 0;
+}
+
+static long while_bound(AstNode* prog, AstNode* func, AstNode* block, int at) {
+    AstNode* w = block->children[at];
+    AstNode* cond = w->children[0];
+    AstNode* body = w->children[1];
+    long a, b, k;
+    if (cond->type != AST_COMPARE || cond->op[0] == '=' || cond->op[0] == '!') return -1;
+    AstNode* v = cond->children[0];
+    if (v->type != AST_IDENT || v->child_count > 0 || !v->ty || v->ty->kind != TY_INT ||
+        !fixed_value(prog, func, cond->children[1], &b)) return -1;
+    if (find_global(prog, v->name) || address_taken(func, v->name) || continues(body) ||
+        count_writes(body, v->name) != 1) return -1;
+
+    long step = 0;
+    for (int i = 0; i < body->child_count && !step; i++) {
+        AstNode* s = body->children[i];
+        if (s->type != AST_ASSIGN || strcmp(s->name, v->name)) continue;
+        AstNode* e = s->children[0];
+        if (e->type != AST_BINOP || (e->op[0] != '+' && e->op[0] != '-') || e->op[1]) return -1;
+        AstNode* self = e->children[0];
+        AstNode* by = e->children[1];
+        if (e->op[0] == '+' && by->type == AST_IDENT && !strcmp(by->name, v->name)) { self = by; by = e->children[0]; }
+        if (self->type != AST_IDENT || self->child_count > 0 || strcmp(self->name, v->name) ||
+            !const_value(prog, by, &k) || k == 0) return -1;
+        step = e->op[0] == '+' ? k : -k;
+    }
+    if (!step) return -1;
+
+    for (int i = at - 1; i >= 0; i--) {
+        AstNode* s = block->children[i];
+        if (!assigns(s, v->name)) continue;
+        if ((s->type != AST_LET && s->type != AST_ASSIGN) || strcmp(s->name, v->name) ||
+            s->child_count != 1 || !const_value(prog, s->children[0], &a)) return -1;
+        long trip = loop_trip_count(a, cond->op, b, step, type_is_unsigned(v->ty));
+        if (trip > 0 && !for_step_fits(a + (trip - 1) * step, step, v->ty)) return -1;
+        return trip;
+    }
+    return -1;
+}
+
+static void infer_bounds_walk(AstNode* prog, AstNode* func, AstNode* n) {
+    for (int i = 0; i < n->child_count; i++) {
+        AstNode* c = n->children[i];
+        infer_bounds_walk(prog, func, c);
+        if (c->type != AST_WHILE || ast_attr(c, "trip") || ast_attr(c, "max_trip")) continue;
+        long bound = while_bound(prog, func, n, i), declared;
+        Attribute* attr = ast_attr(c, "bound");
+        if (attr && const_value(prog, attr->arg, &declared) && declared >= 0 && (bound < 0 || declared < bound)) {
+            bound = declared;
+        }
+        if (bound >= 0) ast_add_attr(c, "max_trip", ast_num(bound));
+    }
+}
+
+void infer_loop_bounds(AstNode* prog) {
+    for (int i = 0; i < prog->child_count; i++) {
+        AstNode* f = prog->children[i];
+        if (f->type == AST_FUNCTION) infer_bounds_walk(prog, f, f->children[f->child_count - 1]);
+    }
+}
+
+static AstNode* ast_call(char* name, AstNode* arg) {
+    AstNode* call = ast_new(AST_CALL);
+    call->name = strdup(name);
+    ast_add(call, arg);
+    return call;
+}
+
+// Before a loop with @bound(expr):
+//     let __boundK = expr; let __loopsK = 0;
+// and first in its body, ahead of any continue:
+//     __loopsK = __loopsK + 1;
+//     if (__loopsK > __boundK) { println("..."); exit(1); }
+static void bound_checks_walk(AstNode* n, int* count) {
+    for (int i = 0; i < n->child_count; i++) {
+        AstNode* c = n->children[i];
+        bound_checks_walk(c, count);
+        Attribute* bound = c->type == AST_WHILE || c->type == AST_FOR ? ast_attr(c, "bound") : NULL;
+        if (!bound) continue;
+        char limit[32], loops[32], message[80];
+        sprintf(limit, "__bound%d", *count);
+        sprintf(loops, "__loops%d", (*count)++);
+        snprintf(message, sizeof(message), "Error: loop at line %d ran past its @bound", c->line);
+        AstNode* msg = ast_new(AST_STRING);
+        msg->value = strdup(message);
+        AstNode* fail = ast_new(AST_BLOCK);
+        ast_add(fail, ast_call("println", msg));
+        ast_add(fail, ast_call("exit", ast_num(1)));
+        AstNode* over = ast_new(AST_COMPARE);
+        over->op = strdup(">");
+        ast_add(over, ast_ident(loops));
+        ast_add(over, ast_ident(limit));
+        AstNode* check = ast_new(AST_IF);
+        ast_add(check, over);
+        ast_add(check, fail);
+        AstNode* body = c->children[c->child_count - 1];
+        ast_insert(body, 0, check);
+        ast_insert(body, 0, ast_assign(loops, ast_binop("+", ast_ident(loops), ast_num(1))));
+        ast_insert(n, i++, ast_let(limit, ast_clone(bound->arg)));
+        ast_insert(n, i++, ast_let(loops, ast_num(0)));
+    }
+}
+
+// Const fns run in the compiler, which has its own step budget
+void bound_checks(AstNode* prog) {
+    int count = 0;
+    for (int i = 0; i < prog->child_count; i++) {
+        AstNode* f = prog->children[i];
+        if (f->type == AST_FUNCTION && !ast_attr(f, "const")) bound_checks_walk(f->children[f->child_count - 1], &count);
+    }
+}
+
+// ==== WCET ====
+// Static worst-case execution time of each function over the generated
+// code. A function's instructions are cut into basic blocks; loops are the
+// jumps back to a block that dominates the jump, bounded by the iteration
+// counts codegen recorded (a trip count, or the max_trip of LOOP BOUNDS) or,
+// in the runtime helpers, by a fixed table.
+// Innermost loops are collapsed first into one node that costs bound x the
+// longest way round plus the longest way out. The function's bound is the
+// longest path from its entry, and a call adds the callee's bound.
+//
+// Instruction costs are worst-case latencies for the -mtune
+// microarchitecture, added up with no overlap. Every conditional or indirect
+// branch pays a mispredict, and each memory operand pays an L1 hit, so
+// caches are assumed warm. A syscall counts the mode switch only, not the
+// kernel's work.
+#define WCET_UNBOUNDED LONG_MAX
+#define WCET_NONE -1L
+
+static const char* arch_names[] = {"skylake", "zen2"};
+
+typedef struct {
+    const char* name;
+    int cycles[2];       // Skylake, Zen 2
+} CycleCost;
+
+static const CycleCost cycle_costs[] = {
+    {"imul", {3, 3}},        {"mul", {4, 3}},          {"idiv", {95, 45}},      {"div", {88, 46}},
+    {"idiv32", {26, 30}},    {"div32", {26, 30}},      {"cdq", {1, 1}},         {"cqo", {1, 1}},
+    {"push", {2, 2}},        {"pop", {2, 2}},          {"call", {2, 2}},        {"ret", {2, 2}},
+    {"leave", {3, 3}},       {"syscall", {100, 100}},  {"cpuid", {200, 150}},   {"xgetbv", {15, 15}},
+    {"pmulld", {10, 4}},     {"vpmulld", {10, 4}},     {"pmuludq", {5, 3}},     {"vpmuludq", {5, 3}},
+    {"vinserti128", {3, 2}}, {"vextracti128", {3, 2}}, {"vpbroadcastd", {3, 1}}, {"vpbroadcastq", {3, 1}},
+    {"vpermq", {3, 6}},      {"vzeroupper", {1, 1}},   {"align", {4, 4}},       // Up to 15 bytes of nops
+};
+static const int load_cycles[] = {5, 4};       // L1 hit with an address to compute
+static const int mispredict_cycles[] = {16, 18};
+
+static long wcet_sum(long a, long b) {
+    if (a == WCET_UNBOUNDED || b == WCET_UNBOUNDED || a > WCET_UNBOUNDED - b) return WCET_UNBOUNDED;
+    return a + b;
+}
+
+static long wcet_times(long n, long a) {
+    if (a == WCET_UNBOUNDED || (a && n > WCET_UNBOUNDED / a)) return WCET_UNBOUNDED;
+    return n * a;
+}
+
+// Loops of the runtime helpers: at most 20 decimal digits in a 64-bit value
+static const struct { const char* label; long bound; } helper_loops[] = {
+    {".loop", 20}, {".print_loop", 21},
+};
+
+static int instr_cycles(Microarch arch, const char* op, const char* args) {
+    char name[32];
+    snprintf(name, sizeof(name), "%s", op);
+    // A 32-bit divisor is much cheaper than a 64-bit one
+    if ((!strcmp(op, "div") || !strcmp(op, "idiv")) && (args[0] == 'e' || strchr(args, 'd'))) strcat(name, "32");
+    int cycles = 1;
+    for (int i = 0; i < (int)(sizeof(cycle_costs) / sizeof(cycle_costs[0])); i++) {
+        if (!strcmp(cycle_costs[i].name, name)) cycles = cycle_costs[i].cycles[arch];
+    }
+    if (strchr(args, '[') && strcmp(op, "lea")) cycles += load_cycles[arch];
+    if (op[0] == 'j' && (strcmp(op, "jmp") || strchr(args, '['))) cycles += mispredict_cycles[arch];
+    return cycles;
+}
+
+typedef struct {
+    long cost;
+    int* succs;
+    int succ_count;
+    char** targets;      // Labels jumped to, resolved once every block is known
+    int target_count;
+    int falls;           // Runs on into the next block
+    int ended;           // Closed by a jump or ret
+    int loop;            // Index into Codegen.loops of a loop starting here, -1 if none
+    long helper_bound;   // Bound of a helper loop starting here, -1 if none
+} WBlock;
+
+typedef struct {
+    char* name;
+    int start, end;      // Its code in the code buffer
+    long wcet;           // WCET_NONE until computed
+    int busy;            // Being computed: reached again through recursion
+    char why[128];       // Why it has no bound
+} WFunc;
+
+typedef struct {
+    Codegen* cg;
+    WFunc* funcs;
+    int count;
+} Wcet;
+
+static WFunc* wcet_find(Wcet* w, const char* name) {
+    for (int i = 0; i < w->count; i++) {
+        if (!strcmp(w->funcs[i].name, name)) return &w->funcs[i];
+    }
+    return NULL;
+}
+
+static long wcet_function(Wcet* w, WFunc* f);
+
+// A call costs the callee's bound; without one the caller has none either
+static long wcet_call(Wcet* w, WFunc* f, const char* callee) {
+    WFunc* g = wcet_find(w, callee);
+    long cost = g ? wcet_function(w, g) : WCET_UNBOUNDED;
+    if (cost == WCET_UNBOUNDED && !f->why[0]) {
+        if (!g) snprintf(f->why, sizeof(f->why), "calls external %s", callee);
+        else if (g == f || g->busy) snprintf(f->why, sizeof(f->why), "recursive through %s", callee);
+        else snprintf(f->why, sizeof(f->why), "calls %s, which has no bound", callee);
+    }
+    return cost;
+}
+
+static void block_target(WBlock* b, const char* label, int len) {
+    b->targets = realloc(b->targets, sizeof(char*) * (b->target_count + 1));
+    b->targets[b->target_count++] = strndup(label, len);
+}
+
+static int wcet_block(WBlock** blocks, int* count) {
+    *blocks = realloc(*blocks, sizeof(WBlock) * (*count + 1));
+    WBlock* b = &(*blocks)[*count];
+    memset(b, 0, sizeof(WBlock));
+    b->falls = 1;
+    b->loop = -1;
+    b->helper_bound = -1;
+    return (*count)++;
+}
+
+// Split f's code into blocks. Label names are kept alongside to resolve jumps.
+static WBlock* wcet_blocks(Wcet* w, WFunc* f, int* count, char*** labels, int** label_blocks, int* label_count) {
+    Codegen* cg = w->cg;
+    WBlock* blocks = NULL;
+    *count = 0;
+    int cur = -1, has_code = 0, in_text = 1, table = -1;
+    char* code = cg->code_buf;
+    for (int at = f->start; at < f->end;) {
+        char* line = code + at;
+        char* nl = memchr(line, '\n', f->end - at);
+        int len = nl ? nl - line : f->end - at;
+        at += len + 1;
+        while (len > 0 && isspace((unsigned char)*line)) line++, len--;
+        while (len > 0 && isspace((unsigned char)line[len - 1])) len--;
+        if (len == 0 || line[0] == ';') continue;
+        if (!strncmp(line, "section ", 8)) {
+            in_text = !strncmp(line + 8, ".text", 5);
+            continue;
+        }
+        if (!in_text) {
+            // A jump table: every entry is a successor of the indirect jmp
+            if (strncmp(line, "dq ", 3) || table < 0) continue;
+            for (char* p = line + 3; p < line + len;) {
+                while (p < line + len && (*p == ' ' || *p == ',')) p++;
+                char* e = p;
+                while (e < line + len && *e != ',') e++;
+                if (e > p) block_target(&blocks[table], p, e - p);
+                p = e;
+            }
+            continue;
+        }
+        if (line[len - 1] == ':') {
+            if (cur < 0 || has_code) cur = wcet_block(&blocks, count), has_code = 0;
+            *labels = realloc(*labels, sizeof(char*) * (*label_count + 1));
+            *label_blocks = realloc(*label_blocks, sizeof(int) * (*label_count + 1));
+            (*labels)[*label_count] = strndup(line, len - 1);
+            (*label_blocks)[(*label_count)++] = cur;
+            int n = 0;
+            if (sscanf(line, ".L%d", &n) == 1) {
+                for (int i = 0; i < cg->loop_count; i++) {
+                    if (cg->loops[i].label == n) blocks[cur].loop = i;
+                }
+            }
+            for (int i = 0; i < (int)(sizeof(helper_loops) / sizeof(helper_loops[0])); i++) {
+                if ((int)strlen(helper_loops[i].label) == len - 1 && !strncmp(line, helper_loops[i].label, len - 1)) {
+                    blocks[cur].helper_bound = helper_loops[i].bound;
+                }
+            }
+            continue;
+        }
+        if (!strncmp(line, "global ", 7) || !strncmp(line, "extern ", 7)) continue;
+        char op[32] = "", args[128] = "";
+        int oplen = 0;
+        while (oplen < len && oplen < 31 && !isspace((unsigned char)line[oplen])) oplen++;
+        memcpy(op, line, oplen);
+        op[oplen] = '\0';
+        char* a = line + oplen;
+        while (a < line + len && isspace((unsigned char)*a)) a++;
+        snprintf(args, sizeof(args), "%.*s", (int)(line + len - a), a);
+        // Code after a jump with no label of its own cannot be reached
+        if (cur < 0 || blocks[cur].ended) cur = wcet_block(&blocks, count);
+        has_code = 1;
+        WBlock* b = &blocks[cur];
+        b->cost = wcet_sum(b->cost, instr_cycles(cg->opts->tune, op, args));
+        if (!strcmp(op, "call")) {
+            b->cost = wcet_sum(b->cost, wcet_call(w, f, args));
+        } else if (!strcmp(op, "ret")) {
+            b->falls = 0;
+            b->ended = 1;
+        } else if (op[0] == 'j') {
+            int jmp = !strcmp(op, "jmp");
+            if (args[0] == '.') block_target(b, args, strlen(args));
+            else if (strchr(args, '[')) table = cur;
+            else b->cost = wcet_sum(b->cost, wcet_call(w, f, args));  // Tail call
+            b->falls = !jmp;
+            b->ended = 1;
+        }
+    }
+    return blocks;
+}
+
+// Longest path from n to the loop's header (cycle) or out of the loop
+// (!cycle), through the loop's current nodes
+static long wcet_path(WBlock* blocks, char* in_loop, int header, int n, int cycle, long* memo) {
+    if (memo[n] != -2) return memo[n];
+    memo[n] = WCET_UNBOUNDED;  // A cycle left here means the flow is irreducible
+    WBlock* b = &blocks[n];
+    long best = !cycle && b->succ_count == 0 ? 0 : WCET_NONE;  // Returns
+    for (int i = 0; i < b->succ_count; i++) {
+        int s = b->succs[i];
+        long rest = WCET_NONE;
+        if (s == header && cycle) rest = 0;
+        else if (!in_loop[s] && !cycle) rest = 0;
+        else if (in_loop[s] && s != header) rest = wcet_path(blocks, in_loop, header, s, cycle, memo);
+        if (rest > best) best = rest;
+    }
+    memo[n] = best == WCET_NONE ? WCET_NONE : wcet_sum(b->cost, best);
+    return memo[n];
+}
+
+static int wcet_dominates(int* idom, int a, int b) {
+    while (b != a && idom[b] != b && idom[b] >= 0) b = idom[b];
+    return a == b;
+}
+
+static void wcet_add_succ(WBlock* b, int s) {
+    for (int i = 0; i < b->succ_count; i++) {
+        if (b->succs[i] == s) return;
+    }
+    b->succs = realloc(b->succs, sizeof(int) * (b->succ_count + 1));
+    b->succs[b->succ_count++] = s;
+}
+
+static long wcet_function(Wcet* w, WFunc* f) {
+    if (f->busy) return WCET_UNBOUNDED;
+    if (f->wcet != WCET_NONE) return f->wcet;
+    f->busy = 1;
+    int n = 0, label_count = 0;
+    char** labels = NULL;
+    int* label_blocks = NULL;
+    WBlock* blocks = wcet_blocks(w, f, &n, &labels, &label_blocks, &label_count);
+    for (int i = 0; i < n; i++) {
+        WBlock* b = &blocks[i];
+        if (b->falls && i + 1 < n) wcet_add_succ(b, i + 1);
+        for (int t = 0; t < b->target_count; t++) {
+            for (int l = 0; l < label_count; l++) {
+                if (!strcmp(labels[l], b->targets[t])) wcet_add_succ(b, label_blocks[l]);
+            }
+        }
+    }
+
+    // Dominators (Cooper, Harvey and Kennedy) over a reverse postorder
+    int* order = malloc(sizeof(int) * (n + 1));
+    int* rpo = malloc(sizeof(int) * (n + 1));
+    int* idom = malloc(sizeof(int) * (n + 1));
+    int* stack = malloc(sizeof(int) * (n + 1));
+    int* next = calloc(n + 1, sizeof(int));
+    int seen_count = 0, depth = 0;
+    for (int i = 0; i < n; i++) rpo[i] = -1, idom[i] = -1;
+    if (n > 0) stack[depth++] = 0, rpo[0] = -2;
+    while (depth > 0) {
+        int v = stack[depth - 1];
+        if (next[v] < blocks[v].succ_count) {
+            int s = blocks[v].succs[next[v]++];
+            if (rpo[s] == -1) rpo[s] = -2, stack[depth++] = s;
+        } else {
+            order[seen_count++] = v;
+            depth--;
+        }
+    }
+    for (int i = 0; i < seen_count; i++) rpo[order[seen_count - 1 - i]] = i;
+    if (n > 0) idom[0] = 0;
+    for (int changed = 1; changed;) {
+        changed = 0;
+        for (int k = seen_count - 2; k >= 0; k--) {
+            int v = order[k];
+            int best = -1;
+            for (int p = 0; p < n; p++) {
+                if (idom[p] < 0) continue;
+                int is_pred = 0;
+                for (int i = 0; i < blocks[p].succ_count; i++) is_pred |= blocks[p].succs[i] == v;
+                if (!is_pred) continue;
+                if (best < 0) { best = p; continue; }
+                int a = p, c = best;
+                while (a != c) {
+                    while (rpo[a] > rpo[c]) a = idom[a];
+                    while (rpo[c] > rpo[a]) c = idom[c];
+                }
+                best = a;
+            }
+            if (best >= 0 && idom[v] != best) idom[v] = best, changed = 1;
+        }
+    }
+
+    // Natural loops, innermost (smallest) first; a jump back to a block that
+    // does not dominate it cannot be bounded
+    char* in_loop = calloc(n + 1, 1);
+    long* memo = malloc(sizeof(long) * (n + 1));
+    int* rep = malloc(sizeof(int) * (n + 1));
+    for (int i = 0; i < n; i++) rep[i] = i;
+    int* headers = malloc(sizeof(int) * (n + 1));
+    int* sizes = calloc(n + 1, sizeof(int));
+    int header_count = 0;
+    long result = 0;
+    for (int v = 0; v < n; v++) {
+        if (idom[v] < 0) continue;
+        for (int i = 0; i < blocks[v].succ_count; i++) {
+            int h = blocks[v].succs[i];
+            if (rpo[h] > rpo[v]) continue;
+            if (!wcet_dominates(idom, h, v)) {
+                result = WCET_UNBOUNDED;
+                if (!f->why[0]) snprintf(f->why, sizeof(f->why), "irreducible control flow");
+                continue;
+            }
+            int known = 0;
+            for (int k = 0; k < header_count; k++) known |= headers[k] == h;
+            if (!known) headers[header_count++] = h;
+        }
+    }
+    // Body of each header's loop: the blocks reaching one of its back edges
+    char** bodies = malloc(sizeof(char*) * (header_count + 1));
+    for (int k = 0; k < header_count; k++) {
+        int h = headers[k];
+        char* body = bodies[k] = calloc(n + 1, 1);
+        body[h] = 1;
+        int top = 0;
+        for (int v = 0; v < n; v++) {
+            if (idom[v] < 0 || !wcet_dominates(idom, h, v)) continue;
+            for (int i = 0; i < blocks[v].succ_count; i++) {
+                if (blocks[v].succs[i] == h && !body[v]) body[v] = 1, stack[top++] = v;
+            }
+        }
+        while (top > 0) {
+            int v = stack[--top];
+            for (int p = 0; p < n; p++) {
+                if (body[p] || idom[p] < 0) continue;
+                for (int i = 0; i < blocks[p].succ_count; i++) {
+                    if (blocks[p].succs[i] == v) { body[p] = 1; stack[top++] = p; break; }
+                }
+            }
+        }
+        for (int v = 0; v < n; v++) sizes[k] += body[v];
+    }
+    for (int done = 0; done < header_count; done++) {
+        int k = -1;
+        for (int j = 0; j < header_count; j++) {
+            if (sizes[j] >= 0 && (k < 0 || sizes[j] < sizes[k])) k = j;
+        }
+        sizes[k] = -1;
+        int h = headers[k];
+        for (int v = 0; v < n; v++) in_loop[v] = 0;
+        for (int v = 0; v < n; v++) {
+            if (bodies[k][v]) in_loop[rep[v]] = 1;
+        }
+        long bound = blocks[h].helper_bound;
+        LoopBound* lb = blocks[h].loop >= 0 ? &w->cg->loops[blocks[h].loop] : NULL;
+        if (lb) bound = lb->bound;
+        long cost = WCET_UNBOUNDED;
+        if (bound >= 0) {
+            for (int v = 0; v < n; v++) memo[v] = -2;
+            long round = wcet_path(blocks, in_loop, h, h, 1, memo);
+            for (int v = 0; v < n; v++) memo[v] = -2;
+            long out = wcet_path(blocks, in_loop, h, h, 0, memo);
+            cost = wcet_sum(wcet_times(bound, round < 0 ? 0 : round), out < 0 ? 0 : out);
+        } else if (!f->why[0]) {
+            if (lb && lb->line > 0) snprintf(f->why, sizeof(f->why), "loop at line %d has no bound", lb->line);
+            else if (lb && lb->line < 0) snprintf(f->why, sizeof(f->why), "tail recursion");
+            else snprintf(f->why, sizeof(f->why), "a loop has no bound");
+        }
+        // Collapse: the header stands for the whole loop from now on
+        for (int v = 0; v < n; v++) {
+            if (!in_loop[v] || v == h) continue;
+            for (int i = 0; i < blocks[v].succ_count; i++) {
+                if (!in_loop[blocks[v].succs[i]]) wcet_add_succ(&blocks[h], blocks[v].succs[i]);
+            }
+            blocks[v].succ_count = 0;
+        }
+        int kept = 0;
+        for (int i = 0; i < blocks[h].succ_count; i++) {
+            if (!in_loop[blocks[h].succs[i]]) blocks[h].succs[kept++] = blocks[h].succs[i];
+        }
+        blocks[h].succ_count = kept;
+        blocks[h].cost = cost;
+        for (int v = 0; v < n; v++) {
+            if (bodies[k][v]) rep[v] = h;
+        }
+    }
+
+    // Longest path from the entry, every loop now a single node
+    if (n > 0 && result != WCET_UNBOUNDED) {
+        for (int v = 0; v < n; v++) in_loop[v] = 1, memo[v] = -2;
+        result = wcet_path(blocks, in_loop, -1, 0, 0, memo);
+    }
+    if (result < 0) result = 0;
+    if (result == WCET_UNBOUNDED && !f->why[0]) snprintf(f->why, sizeof(f->why), "recursive");
+    for (int k = 0; k < header_count; k++) free(bodies[k]);
+    for (int i = 0; i < n; i++) {
+        for (int t = 0; t < blocks[i].target_count; t++) free(blocks[i].targets[t]);
+        free(blocks[i].targets);
+        free(blocks[i].succs);
+    }
+    for (int l = 0; l < label_count; l++) free(labels[l]);
+    free(labels); free(label_blocks); free(blocks); free(bodies); free(headers); free(sizes);
+    free(order); free(rpo); free(idom); free(stack); free(next); free(in_loop); free(memo); free(rep);
+    f->busy = 0;
+    f->wcet = result;
+    return result;
+}
+
+// Every global label of the code starts a function or runtime helper
+static void wcet_collect(Wcet* w) {
+    char* code = w->cg->code_buf;
+    int in_text = 1;
+    for (int at = 0; at < w->cg->code_len;) {
+        char* nl = strchr(code + at, '\n');
+        int len = nl ? nl - (code + at) : w->cg->code_len - at;
+        char* line = code + at;
+        if (!strncmp(line, "section ", 8)) in_text = !strncmp(line + 8, ".text", 5);
+        if (in_text && len > 1 && line[len - 1] == ':' && (isalpha((unsigned char)line[0]) || line[0] == '_')) {
+            if (w->count) w->funcs[w->count - 1].end = at;
+            w->funcs = realloc(w->funcs, sizeof(WFunc) * (w->count + 1));
+            WFunc* f = &w->funcs[w->count++];
+            memset(f, 0, sizeof(WFunc));
+            f->name = strndup(line, len - 1);
+            f->start = at;
+            f->wcet = WCET_NONE;
+        }
+        at += len + 1;
+    }
+    if (w->count) w->funcs[w->count - 1].end = w->cg->code_len;
+}
+
+// -fwcet-report, and the @wcet(cycles) budgets: a function over its budget,
+// or without a bound, fails the compilation
+void wcet_analyze(Codegen* cg) {
+    int wanted = cg->opts->wcet_report;
+    for (int i = 0; i < cg->prog->child_count; i++) {
+        AstNode* f = cg->prog->children[i];
+        if (f->type == AST_FUNCTION && ast_attr(f, "wcet")) wanted = 1;
+    }
+    if (!wanted) return;
+    Wcet w = {cg, NULL, 0};
+    wcet_collect(&w);
+    FILE* json = NULL;
+    if (cg->opts->wcet_report) {
+        json = fopen("output.wcet.json", "w");
+        if (!json) { perror("Error"); exit(1); }
+        fprintf(json, "{\n  \"arch\": \"%s\",\n  \"functions\": [", arch_names[cg->opts->tune]);
+    }
+    int reported = 0, over = 0;
+    for (int i = 0; i < cg->prog->child_count; i++) {
+        AstNode* f = cg->prog->children[i];
+        if (f->type != AST_FUNCTION) continue;
+        Attribute* budget = ast_attr(f, "wcet");
+        long limit = -1;
+        if (budget && (!budget->arg || !ast_is_num(budget->arg, &limit) || limit < 0)) {
+            fprintf(stderr, "Error: @wcet on fn %s needs a cycle count\n", f->name);
+            exit(1);
+        }
+        WFunc* wf = wcet_find(&w, f->name);
+        if (!wf) continue;  // Inlined everywhere or unreachable: not in the output
+        long cycles = wcet_function(&w, wf);
+        int bounded = cycles != WCET_UNBOUNDED;
+        if (cg->opts->wcet_report) {
+            printf("wcet: fn %s: ", f->name);
+            if (bounded) printf("%ld cycles", cycles);
+            else printf("unbounded (%s)", wf->why);
+            if (limit >= 0) printf(" (budget %ld)", limit);
+            printf("\n");
+            fprintf(json, "%s\n    {\"name\": \"%s\", \"cycles\": ", reported++ ? "," : "", f->name);
+            if (bounded) fprintf(json, "%ld", cycles);
+            else fprintf(json, "null, \"reason\": \"%s\"", wf->why);
+            if (limit >= 0) fprintf(json, ", \"budget\": %ld", limit);
+            fprintf(json, "}");
+        }
+        if (limit >= 0 && (!bounded || cycles > limit)) {
+            if (bounded) fprintf(stderr, "Error: fn %s takes up to %ld cycles, over its @wcet(%ld) budget\n", f->name, cycles, limit);
+            else fprintf(stderr, "Error: fn %s has no WCET bound (%s) but a @wcet(%ld) budget\n", f->name, wf->why, limit);
+            over = 1;
+        }
+    }
+    if (json) {
+        fprintf(json, "\n  ]\n}\n");
+        fclose(json);
+    }
+    for (int i = 0; i < w.count; i++) free(w.funcs[i].name);
+    free(w.funcs);
+    if (over) exit(1);
+}
+
+// ==== STACK DEPTH ====
+// -fstack-report: the frame of each function and the deepest the stack can
+// get below its entry, measured on the generated code like the WCET. The
+// walk over a function tracks how far rsp is below its value at entry:
+// pushes and pops, `sub`/`add rsp`, the padding `and rsp` may add when
+// realigning, and locals kept in the red zone. The frame is the deepest
+// point of the function's own code. A call adds 8 bytes of return address
+// and the callee's depth, a tail jump the callee's depth from where it
+// leaves rsp.
+//
+// Calls that come back around form a cycle. A cycle of tail jumps only
+// reuses one frame. Any other needs @recursion(N) on one of its functions
+// (at most N calls of it active at once, which is trusted, not checked),
+// and each active call costs the deepest call back into the cycle. A
+// recursion without one is an error.
+typedef struct {
+    char* callee;
+    long at;             // Bytes below the entry rsp the callee starts at
+} StackCall;
+
+typedef struct {
+    char* name;
+    int start, end;
+    long frame;          // WCET_UNBOUNDED if rsp moves in a way we cannot follow
+    StackCall* calls;
+    int call_count;
+    long depth;          // WCET_NONE until computed
+    long recursion;      // @recursion(N), 0 if none
+    int index, low, on_stack, comp;  // Tarjan's strongly connected components
+    int unbounded;       // On a recursion with no @recursion bound
+    char why[128];       // Why the depth is unknown
+} StackFunc;
+
+typedef struct {
+    Codegen* cg;
+    StackFunc* funcs;
+    int count;
+    int next_index;
+    int* stack;
+    int top;
+    int comps;
+} Stack;
+
+typedef struct {
+    char* name;
+    long at;             // -1 until a jump or fall-through reaches it
+} StackLabel;
+
+static long* stack_label(StackLabel** labels, int* count, const char* name, int len) {
+    for (int i = 0; i < *count; i++) {
+        if ((int)strlen((*labels)[i].name) == len && !strncmp((*labels)[i].name, name, len)) return &(*labels)[i].at;
+    }
+    *labels = realloc(*labels, sizeof(StackLabel) * (*count + 1));
+    (*labels)[*count].name = strndup(name, len);
+    (*labels)[*count].at = -1;
+    return &(*labels)[(*count)++].at;
+}
+
+static int stack_merge(long* label, long at) {
+    if (at <= *label) return 0;
+    *label = at;
+    return 1;
+}
+
+static void stack_call(StackFunc* f, const char* callee, long at) {
+    f->calls = realloc(f->calls, sizeof(StackCall) * (f->call_count + 1));
+    f->calls[f->call_count].callee = strdup(callee);
+    f->calls[f->call_count++].at = at;
+}
+
+// Walk f's code until the depth at every label settles. Labels only get
+// deeper, so one that keeps sinking is a loop that grows the stack.
+static void stack_scan(Codegen* cg, StackFunc* f) {
+    StackLabel* labels = NULL;
+    int label_count = 0;
+    char* code = cg->code_buf;
+    for (int pass = 0, changed = 1; changed; pass++) {
+        if (pass > label_count + 2) {
+            f->frame = WCET_UNBOUNDED;
+            snprintf(f->why, sizeof(f->why), "the stack grows in a loop");
+            break;
+        }
+        changed = 0;
+        for (int i = 0; i < f->call_count; i++) free(f->calls[i].callee);
+        f->call_count = 0;
+        f->frame = 0;
+        long at = 0, base = 0, table = -1;
+        int live = 1, in_text = 1;
+        for (int pos = f->start; pos < f->end && f->frame != WCET_UNBOUNDED;) {
+            char* line = code + pos;
+            char* nl = memchr(line, '\n', f->end - pos);
+            int len = nl ? nl - line : f->end - pos;
+            pos += len + 1;
+            while (len > 0 && isspace((unsigned char)*line)) line++, len--;
+            while (len > 0 && isspace((unsigned char)line[len - 1])) len--;
+            if (len == 0) continue;
+            if (!strncmp(line, "section ", 8)) {
+                in_text = !strncmp(line + 8, ".text", 5);
+                continue;
+            }
+            if (!in_text) {
+                // Jump table entries start at the depth of the indirect jmp
+                if (strncmp(line, "dq ", 3) || table < 0) continue;
+                for (char* p = line + 3; p < line + len;) {
+                    while (p < line + len && (*p == ' ' || *p == ',')) p++;
+                    char* e = p;
+                    while (e < line + len && *e != ',') e++;
+                    if (e > p) changed |= stack_merge(stack_label(&labels, &label_count, p, e - p), table);
+                    p = e;
+                }
+                continue;
+            }
+            int red = 0;
+            if (line[0] == ';') {
+                if (live && sscanf(line, "; red zone %d", &red) == 1 && at + red > f->frame) f->frame = at + red;
+                continue;
+            }
+            if (line[len - 1] == ':') {
+                long* l = stack_label(&labels, &label_count, line, len - 1);
+                if (live) changed |= stack_merge(l, at);
+                live = *l >= 0;
+                if (live) at = *l;
+                continue;
+            }
+            if (!live || !strncmp(line, "global ", 7) || !strncmp(line, "extern ", 7)) continue;
+            char op[32] = "", args[128] = "";
+            int oplen = 0;
+            while (oplen < len && oplen < 31 && !isspace((unsigned char)line[oplen])) oplen++;
+            memcpy(op, line, oplen);
+            char* a = line + oplen;
+            while (a < line + len && isspace((unsigned char)*a)) a++;
+            snprintf(args, sizeof(args), "%.*s", (int)(line + len - a), a);
+            long n = 0;
+            if (!strcmp(op, "push")) at += 8;
+            else if (!strcmp(op, "pop")) at -= 8;
+            else if (!strcmp(op, "sub") && sscanf(args, "rsp, %ld", &n) == 1) at += n;
+            else if (!strcmp(op, "add") && sscanf(args, "rsp, %ld", &n) == 1) at -= n;
+            else if (!strcmp(op, "and") && sscanf(args, "rsp, -%ld", &n) == 1) at += n - 8;  // rsp is 8-aligned
+            else if (!strcmp(op, "mov") && !strcmp(args, "rbp, rsp")) base = at;
+            else if (!strcmp(op, "leave")) at = base - 8;
+            else if (!strcmp(op, "mov") && !strcmp(args, "rsp, [rbp-8]")) at = 8;  // Saved before realigning
+            else if (!strncmp(args, "rsp,", 4)) {
+                f->frame = WCET_UNBOUNDED;
+                snprintf(f->why, sizeof(f->why), "`%s` moves rsp by an unknown amount", op);
+            } else if (!strcmp(op, "call")) {
+                stack_call(f, args, at + 8);
+            } else if (!strcmp(op, "ret")) {
+                live = 0;
+            } else if (op[0] == 'j') {
+                if (args[0] == '.') changed |= stack_merge(stack_label(&labels, &label_count, args, strlen(args)), at);
+                else if (strchr(args, '[')) table = at;
+                else stack_call(f, args, at);  // Tail call
+                live = strcmp(op, "jmp") != 0;
+            }
+            if (f->frame != WCET_UNBOUNDED && at > f->frame) f->frame = at;
+        }
+    }
+    for (int i = 0; i < label_count; i++) free(labels[i].name);
+    free(labels);
+}
+
+static StackFunc* stack_find(Stack* s, const char* name) {
+    for (int i = 0; i < s->count; i++) {
+        if (!strcmp(s->funcs[i].name, name)) return &s->funcs[i];
+    }
+    return NULL;
+}
+
+// Can `to` reach `from` through calls between functions of component
+// `comp` that have no @recursion bound?
+static int stack_reaches(Stack* s, StackFunc* from, StackFunc* to, int comp, char* seen) {
+    if (from == to) return 1;
+    if (seen[from - s->funcs]) return 0;
+    seen[from - s->funcs] = 1;
+    for (int i = 0; i < from->call_count; i++) {
+        StackFunc* g = stack_find(s, from->calls[i].callee);
+        if (g && g->comp == comp && !g->recursion && stack_reaches(s, g, to, comp, seen)) return 1;
+    }
+    return 0;
+}
+
+// The depth of a component, once every component it calls has one
+static void stack_component(Stack* s, int* members, int count) {
+    int comp = s->comps++;
+    for (int i = 0; i < count; i++) s->funcs[members[i]].comp = comp;
+    long out = 0, per_call = 0, levels = 0;
+    int recursive = 0, unbounded_cycle = 0, annotated = 0;
+    char why[128] = "";
+    for (int i = 0; i < count; i++) {
+        StackFunc* f = &s->funcs[members[i]];
+        if (f->frame == WCET_UNBOUNDED && !why[0]) snprintf(why, sizeof(why), "%s", f->why);
+        if (f->frame > out) out = f->frame;
+        if (f->recursion) levels += f->recursion, annotated++;
+        for (int c = 0; c < f->call_count; c++) {
+            StackCall* call = &f->calls[c];
+            StackFunc* g = stack_find(s, call->callee);
+            long depth = WCET_UNBOUNDED;
+            if (!g) {
+                if (!why[0]) snprintf(why, sizeof(why), "calls external %s", call->callee);
+            } else if (g->comp == comp) {
+                // Back into the cycle: a tail jump from the top of the frame reuses it
+                if (call->at == 0) continue;
+                recursive = 1;
+                if (call->at > per_call) per_call = call->at;
+                if (!f->recursion && !g->recursion) {
+                    char* seen = calloc(s->count, 1);
+                    if (stack_reaches(s, g, f, comp, seen)) unbounded_cycle = 1;
+                    free(seen);
+                }
+                continue;
+            } else {
+                depth = g->depth;
+                if (depth == WCET_UNBOUNDED && !why[0]) snprintf(why, sizeof(why), "calls %s, whose depth is unknown", g->name);
+            }
+            long total = wcet_sum(call->at, depth);
+            if (total > out) out = total;
+        }
+    }
+    long depth = out;
+    if (unbounded_cycle) {
+        depth = WCET_UNBOUNDED;
+        snprintf(why, sizeof(why), "recursive with no @recursion bound");
+    } else if (recursive) {
+        // Between two bounded calls there is at most one of each other function
+        levels += (levels + 1) * (count - annotated);
+        depth = wcet_sum(wcet_times(levels - 1, per_call), out);
+    }
+    for (int i = 0; i < count; i++) {
+        StackFunc* f = &s->funcs[members[i]];
+        f->depth = depth;
+        f->unbounded = unbounded_cycle;
+        if (depth == WCET_UNBOUNDED) snprintf(f->why, sizeof(f->why), "%s", why);
+    }
+}
+
+static void stack_visit(Stack* s, int v) {
+    StackFunc* f = &s->funcs[v];
+    f->index = f->low = s->next_index++;
+    s->stack[s->top++] = v;
+    f->on_stack = 1;
+    for (int i = 0; i < f->call_count; i++) {
+        StackFunc* g = stack_find(s, f->calls[i].callee);
+        if (!g) continue;
+        int w = g - s->funcs;
+        if (g->index < 0) {
+            stack_visit(s, w);
+            if (g->low < f->low) f->low = g->low;
+        } else if (g->on_stack && g->index < f->low) {
+            f->low = g->index;
+        }
+    }
+    if (f->low != f->index) return;
+    int* members = malloc(sizeof(int) * s->count);
+    int count = 0;
+    int w;
+    do {
+        w = s->stack[--s->top];
+        s->funcs[w].on_stack = 0;
+        members[count++] = w;
+    } while (w != v);
+    stack_component(s, members, count);
+    free(members);
+}
+
+// -fstack-report: print and write output.stack.json, then fail on a
+// recursion without a bound
+void stack_analyze(Codegen* cg) {
+    if (!cg->opts->stack_report) return;
+    Wcet w = {cg, NULL, 0};
+    wcet_collect(&w);  // The same function boundaries
+    Stack s = {cg, calloc(w.count + 1, sizeof(StackFunc)), w.count, 0, malloc(sizeof(int) * (w.count + 1)), 0, 0};
+    for (int i = 0; i < w.count; i++) {
+        StackFunc* f = &s.funcs[i];
+        f->name = w.funcs[i].name;
+        f->start = w.funcs[i].start;
+        f->end = w.funcs[i].end;
+        f->depth = WCET_NONE;
+        f->index = -1;
+        AstNode* fn = find_function(cg->prog, f->name);
+        Attribute* bound = fn ? ast_attr(fn, "recursion") : NULL;
+        if (bound && (!bound->arg || !ast_is_num(bound->arg, &f->recursion) || f->recursion < 1)) {
+            fprintf(stderr, "Error: @recursion on fn %s needs a depth of at least 1\n", f->name);
+            exit(1);
+        }
+        stack_scan(cg, f);
+    }
+    for (int i = 0; i < s.count; i++) {
+        if (s.funcs[i].index < 0) stack_visit(&s, i);
+    }
+
+    FILE* json = fopen("output.stack.json", "w");
+    if (!json) { perror("Error"); exit(1); }
+    fprintf(json, "{\n  \"functions\": [");
+    int reported = 0;
+    for (int i = 0; i < cg->prog->child_count; i++) {
+        AstNode* fn = cg->prog->children[i];
+        StackFunc* f = fn->type == AST_FUNCTION ? stack_find(&s, fn->name) : NULL;
+        if (!f) continue;  // Inlined everywhere or unreachable: not in the output
+        printf("stack: fn %s: frame ", f->name);
+        if (f->frame == WCET_UNBOUNDED) printf("unknown");
+        else printf("%ld bytes", f->frame);
+        if (f->depth == WCET_UNBOUNDED) printf(", depth unknown (%s)\n", f->why);
+        else printf(", depth %ld bytes\n", f->depth);
+        fprintf(json, "%s\n    {\"name\": \"%s\", \"frame\": ", reported++ ? "," : "", f->name);
+        if (f->frame == WCET_UNBOUNDED) fprintf(json, "null");
+        else fprintf(json, "%ld", f->frame);
+        if (f->depth == WCET_UNBOUNDED) fprintf(json, ", \"depth\": null, \"reason\": \"%s\"}", f->why);
+        else fprintf(json, ", \"depth\": %ld}", f->depth);
+    }
+    StackFunc* start = stack_find(&s, "_start");
+    long total = start ? start->depth : WCET_UNBOUNDED;
+    if (total == WCET_UNBOUNDED) printf("stack: program: unknown\n");
+    else printf("stack: program: %ld bytes\n", total);
+    fprintf(json, "\n  ],\n  \"program\": ");
+    if (total == WCET_UNBOUNDED) fprintf(json, "null\n}\n");
+    else fprintf(json, "%ld\n}\n", total);
+    fclose(json);
+
+    int failed = 0;
+    for (int i = 0; i < s.count; i++) {
+        StackFunc* f = &s.funcs[i];
+        if (f->unbounded) {
+            failed = 1;
+            fprintf(stderr, "Error: fn %s recurses with no @recursion(N) bound on its depth\n", f->name);
+        }
+        for (int c = 0; c < f->call_count; c++) free(f->calls[c].callee);
+        free(f->calls);
+        free(f->name);
+    }
+    free(s.funcs);
+    free(s.stack);
+    free(w.funcs);
+    if (failed) exit(1);
+}
+
 int main(int argc, char** argv) {
-    if (argc < 2) { printf("Usage: chronos <file.ch>\n"); return 1; }
+    Options opts = {1, 1, VEC_AUTO, 0, 0, 0, 0, 0, NULL, NULL, ARCH_SKYLAKE, 0, 0, 0};
+    char* input = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-O0")) opts.opt_level = 0;
+        else if (!strcmp(argv[i], "-O1")) opts.opt_level = 1;
+        else if (!strcmp(argv[i], "-fno-vectorize")) opts.vectorize = 0;
+        else if (!strcmp(argv[i], "-msse2")) opts.vec_isa = VEC_SSE2;
+        else if (!strcmp(argv[i], "-mavx2")) opts.vec_isa = VEC_AVX2;
+        else if (!strcmp(argv[i], "-fdump-layout")) opts.dump_layout = 1;
+        else if (!strcmp(argv[i], "-floop-report")) opts.loop_report = 1;
+        else if (!strcmp(argv[i], "-funroll")) opts.unroll = 1;
+        else if (!strcmp(argv[i], "-fdead-report")) opts.dead_report = 1;
+        else if (!strcmp(argv[i], "-fpurity-report")) opts.purity_report = 1;
+        else if (!strcmp(argv[i], "--profile-generate")) opts.profile_generate = "chronos.pgo";
+        else if (!strncmp(argv[i], "--profile-generate=", 19)) opts.profile_generate = argv[i] + 19;
+        else if (!strcmp(argv[i], "--profile-use")) opts.profile_use = "chronos.pgo";
+        else if (!strncmp(argv[i], "--profile-use=", 14)) opts.profile_use = argv[i] + 14;
+        else if (!strcmp(argv[i], "-mtune=skylake")) opts.tune = ARCH_SKYLAKE;
+        else if (!strcmp(argv[i], "-mtune=zen2")) opts.tune = ARCH_ZEN2;
+        else if (!strcmp(argv[i], "-fwcet-report")) opts.wcet_report = 1;
+        else if (!strcmp(argv[i], "-fstack-report")) opts.stack_report = 1;
+        else if (!strcmp(argv[i], "-fbound-check")) opts.bound_check = 1;
+        else input = argv[i];
+    }
+    if (!input) {
+        printf("Usage: chronos [-O0|-O1] [-fno-vectorize] [-funroll] [-msse2|-mavx2] [-fdump-layout] [-floop-report] [-fdead-report] [-fpurity-report] [--profile-generate[=file]] [--profile-use[=file]] [-fwcet-report] [-mtune=skylake|zen2] [-fstack-report] [-fbound-check] <file.ch>\n");
+        return 1;
+    }
+    Optimizer opt;
+    memset(&opt, 0, sizeof(opt));
+    opt.opts = &opts;
 
-    FILE* f = fopen(argv[1], "r");
+    FILE* f = fopen(input, "r");
     if (!f) { perror("Error"); return 1; }
     fseek(f, 0, SEEK_END);
     long size = ftell(f);
@@ -1130,18 +7996,30 @@ int main(int argc, char** argv) {
 
     printf("🔥 CHRONOS v0.10 - STRING OPERATIONS\n");
     printf("strcmp, strcpy, strlen + Self-hosting ready\n");
-    printf("Compiling: %s\n", argv[1]);
+    printf("Compiling: %s\n", input);
 
     int count;
     Tok* toks = tokenize(src, &count);
-    Parser parser = {toks, 0, count};
+    Parser parser = {toks, 0, count, 0};
     AstNode* ast = parse(&parser);
+    if (opts.bound_check || opts.opt_level == 0) bound_checks(ast);
 
+    // The optimizer relies on element sizes; its rewrites are typed afterwards
     TypeTable* types = typetab_new();
     build_type_table(types, ast);
+    if (opts.dump_layout) typetab_report(types, stdout);
+    typecheck(ast, types);
+    infer_loop_bounds(ast);
+    if (opts.loop_report) loop_report(ast, "output.loops.json");
+    Profile profile = {0, 0, NULL};
+    profile_number(&profile, ast);
+    if (opts.profile_use) profile_load(&profile, opts.profile_use);
+    fold_constants(ast, &opts);
+    optimize(&opt, ast);
+    typecheck(ast, types);
 
     StringTable* strtab = strtab_new();
-    codegen(ast, "output.asm", strtab, types);
+    codegen(ast, "output.asm", strtab, types, &opts, &profile);
 
     printf("✅ Code generated\n");
     system("nasm -f elf64 output.asm -o output.o 2>&1 | head -5");